@@ -7,7 +7,6 @@
 #define RM_ENABLE_OFFLOAD
 #define LOG_REQS_FILE "log_reqs.csv"
 #define LOG_RM_FILE "log_rm.csv"
-#define STRLEN_COMMAND 100
 /*#define DEBUG_NOPINNING */
 
 #include <stdint.h>
@@ -28,6 +27,7 @@
 #include <sys/wait.h>
 #include "app_workload.h"
 #include "mpc_interface.h"
+#include "mpc_sched.h"
 
 /* Put this macro where debugging is needed */
 #define PRINT_ERROR(x) {fprintf(stderr, "%s:%d errno=%i, %s\n",	\
@@ -46,10 +46,10 @@ struct job_record * recs_all;
 
 
 /*
- * Set prio priority (high number => high priority) and pin the
- * invoking process to CPU cpu_id
+ * Set SCHED_FIFO priority prio (high number => high priority) and pin
+ * the invoking process to the list of CPUs cpus (see mpc_sched.h)
  */
-void sched_set_prio_affinity(uint32_t prio, int cpu_id);
+void sched_set_prio_affinity(uint32_t prio, const char * cpus);
 
 /*
  * Handler of the Ctrl-C signal (SIGINT).
@@ -67,6 +67,13 @@ void process_request(void);
  *
  *   <integer>,<float>: <integer> is the number of requests separated
  *   by <float> seconds
+ *
+ * argv[2]: CPUs of the workers, such as "1,3-4" [OPTIONAL]. If not
+ * specified, MPC_CPU_ID of mpc_interface.h (same CPU of MPC: with MPC
+ * at SCHED_DEADLINE, its bandwidth is guaranteed anyway)
+ *
+ * argv[3]: CPUs of the releaser and the manager [OPTIONAL]. If not
+ * specified, MPC_CPU_ID-1
  */
 int main(int argc, char * argv[]) {
 	struct sigaction sa;
@@ -80,6 +87,17 @@ int main(int argc, char * argv[]) {
 	unsigned long cur_req, req_len=0, *req_howmany = NULL;
 	double cur_sep;
 	struct timespec * req_period = NULL;
+	char cpus_work[MPC_SCHED_CPUS_LEN], cpus_other[MPC_SCHED_CPUS_LEN];
+
+	/* CPUs from argv[2] and argv[3], if any */
+	if (argc >= 3)
+		snprintf(cpus_work, sizeof(cpus_work), "%s", argv[2]);
+	else
+		snprintf(cpus_work, sizeof(cpus_work), "%d", MPC_CPU_ID);
+	if (argc >= 4)
+		snprintf(cpus_other, sizeof(cpus_other), "%s", argv[3]);
+	else
+		snprintf(cpus_other, sizeof(cpus_other), "%d", MPC_CPU_ID-1);
 
 	/* Reading the CSV file from argv[1] */
 	csv_infile = fopen(argv[1],"r");
@@ -138,8 +156,8 @@ int main(int argc, char * argv[]) {
 #ifndef DEBUG_NOPINNING
 			/* Pinning workers onto same CPU of MPC */
 			sched_set_prio_affinity(
-				sched_get_priority_max(SCHED_FIFO)-1,
-				MPC_CPU_ID);
+				(uint32_t)sched_get_priority_max(SCHED_FIFO)-1,
+				cpus_work);
 #endif
 			
 			/* get pointers */
@@ -184,8 +202,8 @@ int main(int argc, char * argv[]) {
 
 #ifndef DEBUG_NOPINNING
 	/* All next stuff should not interfere with MPC */
-	sched_set_prio_affinity(sched_get_priority_max(SCHED_FIFO),
-				MPC_CPU_ID-1);
+	sched_set_prio_affinity(
+		(uint32_t)sched_get_priority_max(SCHED_FIFO), cpus_other);
 #endif
 	releaser_pid =fork();
 	if (releaser_pid == 0) {
@@ -273,36 +291,12 @@ void process_request()
 	}
 }
 
-void sched_set_prio_affinity(uint32_t prio, int cpu_id)
+void sched_set_prio_affinity(uint32_t prio, const char * cpus)
 {
-	cpu_set_t  mask;
-
-	/* Set CPU affinity */
-	CPU_ZERO(&mask);
-	CPU_SET(cpu_id, &mask);
-	if (sched_setaffinity(0, sizeof(mask), &mask) != 0) {
-		PRINT_ERROR("sched_setaffinity");
+	if (mpc_sched_pin(cpus) != 0)
 		exit(-1);
-	}
-
-	/* Set priority */
-#if SCHED_SETATTR_IN_SCHED_H
-	/* EB: TO BE TESTED */
-	struct sched_attr attr;
-	
-	bzero(&attr, sizeof(attr));
-	attr.size = sizeof(attr);
-	attr.sched_policy = SCHED_FIFO;
-	attr.sched_priority = prio;
-	if (sched_setattr(0, &attr, 0) != 0) {
+	if (mpc_sched_setattr(MPC_SCHED_FIFO, prio, 0, 0, 0) != 0) {
 		PRINT_ERROR("sched_setattr");
 		exit(-1);
 	}
-#else
-	char launched[STRLEN_COMMAND];  /* String with launched command */
-
-	snprintf(launched, STRLEN_COMMAND,
-		 "sudo chrt -f -p %d %d", prio, getpid());
-	system(launched);
-#endif
 }
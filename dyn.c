@@ -19,6 +19,205 @@
 /*#define PRINT_MAT */
 #define NO_FREE
 
+#define EXPM_PADE_DEG 6     /* degree of Pade approximant of exp */
+#define EXPM_NORM_MAX 0.5   /* max 1-norm of the scaled matrix */
+
+static void dyn_update_power_AB(dyn_plant * p);
+static void dyn_init_power_AB(dyn_plant * p);
+
+/*
+ * Compute E = exp(M) of the square matrix M by the Pade approximant
+ * with scaling and squaring:  M is scaled  by 2^s to have a small
+ * norm, then exp(M/2^s) is approximated by D^{-1}*N, with N and D
+ * polynomials of degree EXPM_PADE_DEG, and finally squared s times.
+ */
+static void dyn_expm(const gsl_matrix * M, gsl_matrix * E)
+{
+	size_t i, j, k, n;
+	int s, sign;
+	double norm, col, c;
+	gsl_matrix *X, *N, *D, *tmp;
+	gsl_permutation *perm;
+	gsl_vector_view E_col;
+
+	n = M->size1;
+	/* 1-norm of M: max over columns of sum of abs values */
+	for (j=0, norm=0; j < n; j++) {
+		for (i=0, col=0; i < n; i++)
+			col += fabs(gsl_matrix_get(M, i, j));
+		norm = GSL_MAX(norm, col);
+	}
+	s = norm > EXPM_NORM_MAX ?
+		(int)ceil(log2(norm/EXPM_NORM_MAX)) : 0;
+
+	X = gsl_matrix_calloc(n, n);   /* powers of M/2^s */
+	N = gsl_matrix_calloc(n, n);
+	D = gsl_matrix_calloc(n, n);
+	tmp = gsl_matrix_calloc(n, n);
+	perm = gsl_permutation_alloc(n);
+	gsl_matrix_set_identity(X);
+	gsl_matrix_set_identity(N);
+	gsl_matrix_set_identity(D);
+	c = 1;
+	for (k=1, sign=-1; k <= EXPM_PADE_DEG; k++, sign = -sign) {
+		c *= (double)(EXPM_PADE_DEG-k+1)/
+			(double)(k*(2*EXPM_PADE_DEG-k+1));
+		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans,
+			       ldexp(1, -s), X, M, 0, tmp);
+		gsl_matrix_memcpy(X, tmp);
+		/* N += c*X, D += (-1)^k*c*X */
+		gsl_matrix_scale(tmp, c);
+		gsl_matrix_add(N, tmp);
+		gsl_matrix_scale(tmp, sign);
+		gsl_matrix_add(D, tmp);
+	}
+	/* E = D^{-1}*N, column by column */
+	gsl_linalg_LU_decomp(D, perm, &sign);
+	gsl_matrix_memcpy(E, N);
+	for (j=0; j < n; j++) {
+		E_col = gsl_matrix_column(E, j);
+		gsl_linalg_LU_svx(D, perm, &E_col.vector);
+	}
+	/* Squaring s times */
+	for (; s > 0; s--) {
+		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1, E, E, 0, tmp);
+		gsl_matrix_memcpy(E, tmp);
+	}
+	gsl_matrix_free(X);
+	gsl_matrix_free(N);
+	gsl_matrix_free(D);
+	gsl_matrix_free(tmp);
+	gsl_permutation_free(perm);
+}
+
+/*
+ * Discretize the continuous-time A and B with sampling period tau
+ * (see dyn.h)
+ */
+void dyn_set_tau(dyn_plant * p, double tau)
+{
+	gsl_matrix *M, *E;
+	gsl_matrix_view blk;
+	size_t n, m;
+
+	if (p->A == NULL || p->B == NULL) {
+		PRINT_ERROR("continuous-time model needed to set tau");
+		return;
+	}
+	n = p->n;
+	m = p->m;
+	p->tau = tau;
+
+	/* exp([A B; 0 0]*tau) = [Ad Bd; 0 I] */
+	M = gsl_matrix_calloc(n+m, n+m);
+	E = gsl_matrix_calloc(n+m, n+m);
+	blk = gsl_matrix_submatrix(M, 0, 0, n, n);
+	gsl_matrix_memcpy(&blk.matrix, p->A);
+	blk = gsl_matrix_submatrix(M, 0, n, n, m);
+	gsl_matrix_memcpy(&blk.matrix, p->B);
+	gsl_matrix_scale(M, tau);
+	dyn_expm(M, E);
+	blk = gsl_matrix_submatrix(E, 0, 0, n, n);
+	gsl_matrix_memcpy(p->Ad[0], &blk.matrix);
+	blk = gsl_matrix_submatrix(E, 0, n, n, m);
+	gsl_matrix_memcpy(p->ABd[0], &blk.matrix);
+	gsl_matrix_free(M);
+	gsl_matrix_free(E);
+
+	/* Storing powers of Ad and ABd */
+	dyn_update_power_AB(p);
+}
+
+/*
+ * Propagate the state x by t seconds with constant input u (see dyn.h)
+ */
+void dyn_propagate(const dyn_plant * p, dyn_prop_cache * c,
+		   double * x, const double * u, double t)
+{
+	gsl_vector_view x_v;
+	gsl_vector_const_view u_v;
+	gsl_vector *x_next;
+	gsl_matrix_view blk;
+	double frac;
+	size_t k, steps;
+
+	if (t <= 0)
+		return;
+	if (!(p->tau > 0)) {
+		PRINT_ERROR("sampling period needed to propagate the state");
+		return;
+	}
+	x_v = gsl_vector_view_array(x, p->n);
+	u_v = gsl_vector_const_view_array(u, p->m);
+	x_next = c->x_next;
+
+	/* Whole steps by Ad and Bd */
+	frac = t/p->tau;
+	steps = (size_t)floor(frac);
+	frac -= (double)steps;
+	for (k=0; k < steps; k++) {
+		gsl_blas_dgemv(CblasNoTrans, 1, p->Ad[0], &x_v.vector,
+			       0, x_next);
+		gsl_blas_dgemv(CblasNoTrans, 1, p->ABd[0], &u_v.vector,
+			       1, x_next);
+		gsl_vector_memcpy(&x_v.vector, x_next);
+	}
+
+	/* Remaining fraction of step */
+	if (frac > 0 && p->A != NULL && p->B != NULL) {
+		/*
+		 * exact: exp([A B; 0 0]*frac*tau) as in dyn_set_tau,
+		 * unless the one of a close fraction is in the scratch
+		 */
+		if (c->t_frac < 0 ||
+		    fabs(frac*p->tau-c->t_frac) > c->rel_tol*p->tau) {
+			c->t_frac = frac*p->tau;
+			gsl_matrix_set_zero(c->M);
+			blk = gsl_matrix_submatrix(c->M, 0, 0, p->n, p->n);
+			gsl_matrix_memcpy(&blk.matrix, p->A);
+			blk = gsl_matrix_submatrix(c->M, 0, p->n, p->n, p->m);
+			gsl_matrix_memcpy(&blk.matrix, p->B);
+			gsl_matrix_scale(c->M, c->t_frac);
+			dyn_expm(c->M, c->E);
+		}
+		blk = gsl_matrix_submatrix(c->E, 0, 0, p->n, p->n);
+		gsl_blas_dgemv(CblasNoTrans, 1, &blk.matrix, &x_v.vector,
+			       0, x_next);
+		blk = gsl_matrix_submatrix(c->E, 0, p->n, p->n, p->m);
+		gsl_blas_dgemv(CblasNoTrans, 1, &blk.matrix, &u_v.vector,
+			       1, x_next);
+		gsl_vector_memcpy(&x_v.vector, x_next);
+	} else if (frac > 0) {
+		/* discrete-time only: linear interpolation within a step */
+		gsl_blas_dgemv(CblasNoTrans, 1, p->Ad[0], &x_v.vector,
+			       0, x_next);
+		gsl_blas_dgemv(CblasNoTrans, 1, p->ABd[0], &u_v.vector,
+			       1, x_next);
+		gsl_vector_sub(x_next, &x_v.vector);
+		gsl_blas_daxpy(frac, x_next, &x_v.vector);
+	}
+}
+
+/*
+ * Scratch of dyn_propagate (see dyn.h)
+ */
+void dyn_prop_cache_init(dyn_prop_cache * c, const dyn_plant * p,
+			 double rel_tol)
+{
+	c->x_next = gsl_vector_alloc(p->n);
+	c->M = gsl_matrix_calloc(p->n+p->m, p->n+p->m);
+	c->E = gsl_matrix_calloc(p->n+p->m, p->n+p->m);
+	c->t_frac = -1;
+	c->rel_tol = rel_tol;
+}
+
+void dyn_prop_cache_free(dyn_prop_cache * c)
+{
+	gsl_vector_free(c->x_next);
+	gsl_matrix_free(c->M);
+	gsl_matrix_free(c->E);
+}
+
 void dyn_init_witheig(dyn_plant * p, const size_t n, const size_t m, const double *D, const double *V, const double *B) {
 	size_t i;
 	
@@ -61,8 +260,15 @@ void dyn_discretize(dyn_plant * p, double tau, size_t H) {
 	size_t i,j;
 	
 	if (p->has_eig == 0) {
-		fprintf(stderr, "Discretization not implemented if eigenvectors aren't specified\n");
-		exit(1);
+		/* general matrix exponential */
+		p->H = H;
+		p->Ad = malloc(p->H*sizeof(*(p->Ad)));
+		p->ABd = malloc(p->H*sizeof(*(p->ABd)));
+		p->Ad[0] = gsl_matrix_calloc(p->n, p->n);
+		p->ABd[0] = gsl_matrix_calloc(p->n, p->m);
+		dyn_init_power_AB(p);
+		dyn_set_tau(p, tau);
+		return;
 	}
 
 	p->tau = tau;   /* sampling interval */
@@ -156,17 +362,15 @@ void dyn_discretize(dyn_plant * p, double tau, size_t H) {
  * assumes that needed data is properly stored in p. Not exported in
  * the API
  */
-static void dyn_init_power_AB(dyn_plant * p)
+static void dyn_update_power_AB(dyn_plant * p)
 {
 	size_t i;
 
 	for(i = 1; i < p->H; i++) {
 		/* Powers of Ad */
- 		p->Ad[i] = gsl_matrix_calloc(p->n, p->n);
 		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1, p->Ad[i-1], p->Ad[0], 0, p->Ad[i]);
 
 		/* Powers of Ad times Bd */
- 		p->ABd[i] = gsl_matrix_calloc(p->n, p->m);
 		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1, p->Ad[i-1], p->ABd[0], 0, p->ABd[i]);
 #ifdef PRINT_MAT
 		printf("\nAd[%i]\n", (int)i);
@@ -177,6 +381,29 @@ static void dyn_init_power_AB(dyn_plant * p)
 	}
 }
 
+static void dyn_init_power_AB(dyn_plant * p)
+{
+	size_t i;
+
+	for(i = 1; i < p->H; i++) {
+ 		p->Ad[i] = gsl_matrix_calloc(p->n, p->n);
+ 		p->ABd[i] = gsl_matrix_calloc(p->n, p->m);
+	}
+	dyn_update_power_AB(p);
+}
+
+/*
+ * Update the discrete-time matrices Ad and Bd (and their powers)
+ */
+void dyn_update_discrete(dyn_plant * p, const double *Ad, const double *Bd)
+{
+	if (Ad != NULL)
+		memcpy(p->Ad[0]->data, Ad, p->n*p->n*sizeof(*Ad));
+	if (Bd != NULL)
+		memcpy(p->ABd[0]->data, Bd, p->n*p->m*sizeof(*Bd));
+	dyn_update_power_AB(p);
+}
+
 /*
  * Initialize a discrete-time system by reading from the JSON
  * struct. The continuous part is set to null
@@ -194,7 +421,11 @@ void dyn_init_discrete(dyn_plant * p, struct json_object * in)
 	/* Ignore continuous-time matrices */
 	p->A = NULL;
 	p->B = NULL;
-	p->tau = 0.f/0.f;   /* sampling interval should be ignored  */
+	/* sampling interval is NaN (to be ignored) unless in JSON */
+	if (json_object_object_get_ex(in, "sampling_period", &tmp))
+		p->tau = json_object_get_double(tmp);
+	else
+		p->tau = 0.f/0.f;
 
 	/* Get the number of system states */
 	if (!json_object_object_get_ex(in, "state_num", &tmp)) {
@@ -266,6 +497,97 @@ void dyn_init_discrete(dyn_plant * p, struct json_object * in)
 }
 
 
+/*
+ * Read the rows*cols matrix name from the JSON object in and store
+ * it in M. Return 0 if successful, -1 otherwise
+ */
+static int dyn_json_matrix(struct json_object * in, const char * name,
+			   gsl_matrix * M)
+{
+	size_t i;
+	struct json_object *tmp, *elem;
+
+	if (!json_object_object_get_ex(in, name, &tmp)) {
+		fprintf(stderr, "%s\n", name);
+		PRINT_ERROR("missing matrix in JSON");
+		return -1;
+	}
+	if ((size_t)json_object_array_length(tmp) != M->size1*M->size2) {
+		fprintf(stderr, "%s\n", name);
+		PRINT_ERROR("wrong size of matrix in JSON");
+		return -1;
+	}
+	for (i=0; i < M->size1*M->size2; i++) {
+		elem = json_object_array_get_idx(tmp, (int)i);
+		errno = 0;
+		M->data[i] = json_object_get_double(elem);
+		if (errno) {
+			fprintf(stderr, "%s[%i]\n", name, (int)i);
+			PRINT_ERROR("issues in converting element of matrix");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Initialize a continuous-time system by reading from the JSON struct
+ * and discretize it (see dyn.h)
+ */
+void dyn_init_continuous(dyn_plant * p, struct json_object * in)
+{
+	struct json_object *tmp;
+
+	/* Ignore eigensystems: general matrix exponential */
+	p->has_eig = 0; 
+	p->A_eigD = NULL;
+	p->A_eigV = NULL;
+
+	if (!json_object_object_get_ex(in, "state_num", &tmp)) {
+		PRINT_ERROR("missing state_num in JSON");
+		return;
+	}
+	p->n = (size_t)json_object_get_int(tmp);
+	if (!json_object_object_get_ex(in, "input_num", &tmp)) {
+		PRINT_ERROR("missing input_num in JSON");
+		return;
+	}
+	p->m = (size_t)json_object_get_int(tmp);
+	if (!json_object_object_get_ex(in, "len_horizon", &tmp)) {
+		PRINT_ERROR("missing len_horizon in JSON");
+		return;
+	}
+	p->H = (size_t)json_object_get_int(tmp);
+	if (!json_object_object_get_ex(in, "sampling_period", &tmp)) {
+		PRINT_ERROR("missing sampling_period in JSON");
+		return;
+	}
+	p->tau = json_object_get_double(tmp);
+
+	/* Continuous-time matrices */
+	p->A = gsl_matrix_calloc(p->n, p->n);
+	p->B = gsl_matrix_calloc(p->n, p->m);
+	if (dyn_json_matrix(in, "state_A", p->A) ||
+	    dyn_json_matrix(in, "input_B", p->B)) {
+		return;
+	}
+	dyn_discretize(p, p->tau, p->H);
+}
+
+/*
+ * Initialize a continuous-time or discrete-time system (see dyn.h)
+ */
+void dyn_init_json(dyn_plant * p, struct json_object * in)
+{
+	struct json_object *tmp;
+
+	if (json_object_object_get_ex(in, "state_A", &tmp))
+		dyn_init_continuous(p, in);
+	else
+		dyn_init_discrete(p, in);
+}
+
+
 void dyn_state_dynamics(const dyn_plant * p, const gsl_vector * x_0, const gsl_matrix * u, gsl_matrix * x_full) {
 	size_t i, id_u=0;
 	gsl_vector *x_cur, *x_next, *x_aux, *u_cur;
@@ -32,6 +32,20 @@ typedef struct {
 	
 } dyn_plant;
 
+/*
+ * Scratch of dyn_propagate, owned by its caller (not by the plant,
+ * which may be shared by threads): no memory is allocated at every
+ * call, and exp([A B; 0 0]*t) of the last fraction of step t is kept,
+ * reused while the fraction changes by less than rel_tol*tau.
+ */
+#define DYN_PROP_TOL 0.01  /* default rel_tol */
+typedef struct {
+	gsl_vector *x_next; /* n */
+	gsl_matrix *M, *E;  /* (n+m)*(n+m): [A B; 0 0]*t, exponential */
+	double t_frac;      /* t (sec) of E, negative if none */
+	double rel_tol;     /* max change of t, relative to tau, reusing E */
+} dyn_prop_cache;
+
 /*
  * Data structure for the a state evolution in presence of given
  * inputs
@@ -74,7 +88,8 @@ void dyn_init_witheig(dyn_plant * p, const size_t n, const size_t m, const doubl
  * - H, horizon (number of intervals) of the explicit discretization
  *
  * Upon a successful  invocation, proper powers of matrices  Ad and Bd
- * are stored in p->Ad and p->ABd
+ * are stored in p->Ad and p->ABd. If the eigenvectors of A are not
+ * known, the general matrix exponential is used (see dyn_set_tau).
  */
 void dyn_discretize(dyn_plant * p, double tau, size_t H);
 
@@ -86,10 +101,70 @@ void dyn_discretize(dyn_plant * p, double tau, size_t H);
  *   "horizon", length (in discrete steps) of the time horizon
  *   "Ad", matrix A of the discrete-time dynamics
  *   "Bd", matrix B of the discrete-time dynamics
+ *   "sampling_period", sampling period (sec) [OPTIONAL]
  * The continuous part is set to null.
  */
 void dyn_init_discrete(dyn_plant * p, struct json_object * in);
 
+/*
+ * Update the  matrices of a  discrete-time system already initialized
+ * (for example,  by dyn_init_discrete(...)). Ad is  n*n long and Bd is
+ * n*m long, both stored by rows.  If Ad (or Bd) is NULL, it is left
+ * unchanged. The powers of Ad and Ad^k*Bd are recomputed in place.
+ */
+void dyn_update_discrete(dyn_plant * p, const double *Ad, const double *Bd);
+
+/*
+ * Initialize  a continuous-time system by reading from the JSON struct
+ * and  discretize it  by the matrix exponential. Expected field in JSON
+ * file are:
+ *   "state_num", number of states of the system
+ *   "input_num", number of inputs of the system
+ *   "len_horizon", length (in discrete steps) of the time horizon
+ *   "sampling_period", sampling period (sec) of the discretization
+ *   "state_A", matrix A of the continuous-time dynamics
+ *   "input_B", matrix B of the continuous-time dynamics
+ */
+void dyn_init_continuous(dyn_plant * p, struct json_object * in);
+
+/*
+ * Initialize the system by reading from the JSON struct: continuous-time
+ * if "state_A" is in JSON (see dyn_init_continuous), discrete-time
+ * otherwise (see dyn_init_discrete).
+ */
+void dyn_init_json(dyn_plant * p, struct json_object * in);
+
+/*
+ * Discretize a continuous-time system with a new sampling period tau.
+ * Ad = exp(A*tau) and Bd are computed together by the exponential of
+ * the matrix [A B; 0 0]*tau,  by Pade approximant with scaling and
+ * squaring (any A, no eigenvectors needed). The powers of Ad and
+ * Ad^k*Bd are then recomputed in place.
+ */
+void dyn_set_tau(dyn_plant * p, double tau);
+
+/*
+ * Propagate in place the state x (n long) by t seconds, with the input
+ * u (m long) held constant. The whole  steps use Ad and Bd, while the
+ * remaining fraction of step is exact for continuous-time systems (by
+ * the matrix exponential) and linearly interpolated for discrete-time
+ * ones. The sampling period p->tau must be known. The scratch c is
+ * initialized by dyn_prop_cache_init for p; with rel_tol > 0, the
+ * exponential of the fraction is computed again only if the fraction
+ * moved by more than rel_tol*tau (the expected delay is nearly the
+ * same at every step).
+ */
+void dyn_propagate(const dyn_plant * p, dyn_prop_cache * c,
+		   double * x, const double * u, double t);
+
+/*
+ * Allocate the scratch c of dyn_propagate for the plant p, with tolerance
+ * rel_tol, and free it
+ */
+void dyn_prop_cache_init(dyn_prop_cache * c, const dyn_plant * p,
+			 double rel_tol);
+void dyn_prop_cache_free(dyn_prop_cache * c);
+
 
 /*
  * TO BE DEPRECATED SOON in favour of
@@ -34,6 +34,7 @@
 #endif
 
 #include "mpc_interface.h"
+#include "mpc_plant.h"
 #include "app_workload.h"
 
 /* Put this macro where debugging is needed */
@@ -42,7 +43,7 @@
 
 
 /* GLOBAL VARIABLES (used in handler) */
-int app_shmid, mpc_shmid;
+int app_shmid;
 struct worker_data * app_data;
 struct shared_data * mpc_data;
 FILE * logrm;
@@ -54,7 +55,7 @@ void term_handler(int signum);
 
 
 /*
- * argv[1]: ID of the shared memory with pending requests
+ * argv[1]: instance of the MPC controller [OPTIONAL]
  */
 int main(int argc, char * argv[]) {
 	struct sigaction sa;
@@ -97,11 +98,11 @@ int main(int argc, char * argv[]) {
 	sigaction(SIGINT, &sa, NULL);
 
 	/* Getting the MPC data */
-	mpc_shmid = shmget(MPC_SHM_KEY, 0, 0);
-	if (mpc_shmid == -1) {
-		PRINT_ERROR("shmget of MPC failed");
+	mpc_data = mpc_plant_attach(argc >= 2 ? argv[1] : NULL);
+	if (mpc_data == NULL) {
+		PRINT_ERROR("MPC instance not found");
+		exit(-1);
 	}
-	mpc_data = (struct shared_data *)shmat(mpc_shmid, NULL, 0);
 	MPC_OFFLOAD_DISABLE(mpc_data);
 
 	/* Let's go */
@@ -142,7 +143,7 @@ void term_handler(int signum)
 {
 	printf("Got SIGINT (Ctrl-C). Closing RM and detaching\n");
 	fclose(logrm);
-	shmdt(mpc_data);
+	mpc_plant_detach(mpc_data);
 	shmdt(app_data);
 	exit(0);
 }
@@ -3,12 +3,16 @@
 #include <strings.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_linalg.h>
 #include <gsl/gsl_sf_exp.h>
 #include <glpk.h>
 #include "dyn.h"
 #include "mpc.h"
+#include "mpc_interface.h"
 
 /* Put this macro where debugging is needed */
 #define PRINT_ERROR(x) {fprintf(stderr, "%s:%d errno=%i, %s\n",	\
@@ -17,12 +21,47 @@
 #define DOUBLE_SMALL 1e-10 /* may be needed to be a small number 1e-10 */
 #define DONTCARE 0 /* any constant to be ignored */
 #define BIG_M 1e4 /* only needed for obstacles */
+#define MIP_TM_LIM 50    /* max msec of branch-and-bound with no budget */
+#define MIP_NODE_LIM 200 /* default max nodes of branch-and-bound */
+#define RICCATI_IT_MAX 10000 /* max iterations of the Riccati equation */
+#define RICCATI_TOL 1e-9     /* relative tolerance of Riccati iterations */
 
 /* macros for lower/upper bounds */
 #define HAS_NONE  0x00
 #define HAS_LOWER 0x01
 #define HAS_UPPER 0x02
 
+/* callback of branch-and-bound (with obstacles only) */
+static void mpc_mip_callback(glp_tree * tree, void * info);
+
+/*
+ * Convex regions of the free space around the obstacle, each solved
+ * by its own thread. Region 0 is solved by the invoking thread.
+ */
+struct mpc_regions {
+	size_t num;               /* number of regions */
+	int best;                 /* region of last solution, -1 if none */
+	pthread_barrier_t start;  /* all regions start solving */
+	pthread_barrier_t done;   /* all regions solved */
+	int quit;                 /* 1: threads of regions must end */
+	struct mpc_region {
+		mpc_glpk mpc;     /* copy of the problem + face constraints */
+		struct mpc_regions * all;
+		pthread_t thread;
+		int ret;          /* value returned by glp_simplex */
+		int feasible;     /* 1 if optimal solution found */
+		double obj;       /* cost of the solution */
+	} * reg;
+};
+
+/* big-M of an axis of the obstacle, and its coefficients in the LP */
+static void mpc_obstacle_M_set(mpc_glpk * mpc, size_t i);
+static void mpc_obstacle_M_apply(mpc_glpk * mpc, size_t i);
+
+/* update of RHS of the face of an obstacle region */
+static void mpc_face_update_rhs(mpc_glpk * mpc, size_t k,
+				const gsl_vector * x_k);
+
 /*
  * Adding  the variables  for  the  control input  to  the MPC  problem
  * pointed  by  mpc. A successful invocation needs:
@@ -122,6 +161,46 @@ void mpc_input_norm_addvar(mpc_glpk * mpc)
 	}
 }
 
+/*
+ * Set the bounds of the j-th input at all steps, from mpc->u_lo and
+ * mpc->u_up, in the GLPK problem
+ */
+static void mpc_input_bnds_apply(mpc_glpk * mpc, size_t j)
+{
+	size_t i;
+	int id;
+	char bnds_has = HAS_NONE;
+	double lo, up;
+
+	lo = gsl_vector_get(mpc->u_lo, j);
+	up = gsl_vector_get(mpc->u_up, j);
+	if (isfinite(lo))
+		bnds_has |= HAS_LOWER;
+	if (isfinite(up))
+		bnds_has |= HAS_UPPER;
+	id = mpc->v_U+(int)j;
+	for (i=0; i < mpc->h_ctrl+1; i++, id += (int)mpc->model->m) {
+		switch (bnds_has) {
+		case (HAS_NONE):
+			glp_set_col_bnds(mpc->op, id,
+					 GLP_FR,DONTCARE,DONTCARE);
+			break;
+		case (HAS_LOWER):
+			glp_set_col_bnds(mpc->op, id,
+					 GLP_LO,lo,DONTCARE);
+			break;
+		case (HAS_UPPER):
+			glp_set_col_bnds(mpc->op, id,
+					 GLP_UP,DONTCARE,up);
+			break;
+		case (HAS_LOWER | HAS_UPPER):
+			glp_set_col_bnds(mpc->op, id,
+					 GLP_DB,lo,up);
+			break;
+		}
+	}
+}
+
 /*
  * Set the bound on the input variables. A successful invocation needs:
  * - GLPK variables of mpc->op be initialized
@@ -130,11 +209,8 @@ void mpc_input_norm_addvar(mpc_glpk * mpc)
  */
 void mpc_input_set_bnds(mpc_glpk * mpc, struct json_object * in)
 {
-	size_t i,j;
-	int id;
+	size_t i;
 	struct json_object * bnds, *bnds1, *elem;
-	char *bnds_has;
-	double *bnds_lo, *bnds_up;
 	
 	/* Get the input bounds */
 	if (!json_object_object_get_ex(in, "input_bounds", &bnds)) {
@@ -145,9 +221,9 @@ void mpc_input_set_bnds(mpc_glpk * mpc, struct json_object * in)
 		PRINT_ERROR("wrong size of input_bounds in JSON");
 		return;
 	}
-	bnds_has = calloc(mpc->model->m, sizeof(*bnds_has));
-	bnds_lo  = calloc(mpc->model->m, sizeof(*bnds_lo));
-	bnds_up  = calloc(mpc->model->m, sizeof(*bnds_up));
+	/* Bounds stored in mpc to be later updated, if needed */
+	mpc->u_lo = gsl_vector_calloc(mpc->model->m);
+	mpc->u_up = gsl_vector_calloc(mpc->model->m);
 
 	/* Parsing input_bounds from JSON file*/
 	for (i=0; i < mpc->model->m; i++) {
@@ -158,57 +234,21 @@ void mpc_input_set_bnds(mpc_glpk * mpc, struct json_object * in)
 		}
 		/* getting lower bound */
 		elem = json_object_array_get_idx(bnds1, 0);
-		bnds_lo[i] = json_object_get_double(elem);
-		if (isfinite(bnds_lo[i]))
-			bnds_has[i] |= HAS_LOWER;
-		else
-			bnds_has[i] |= HAS_NONE;
+		gsl_vector_set(mpc->u_lo, i, json_object_get_double(elem));
 		
 		/* getting upper bound */
 		elem = json_object_array_get_idx(bnds1, 1);
-		bnds_up[i] = json_object_get_double(elem);
-		if (isfinite(bnds_up[i]))
-			bnds_has[i] |= HAS_UPPER;
-		else
-			bnds_has[i] |= HAS_NONE;
+		gsl_vector_set(mpc->u_up, i, json_object_get_double(elem));
 	}
 	
 	/* Setting the bounds in the GLPK problem */
-	id = mpc->v_U;
-	for (i=0; i < mpc->h_ctrl+1; i++) {
-		for (j=0; j < mpc->model->m; j++, id++) {
-			switch (bnds_has[j]) {
-			case (HAS_NONE):
-				glp_set_col_bnds(mpc->op, id,
-						 GLP_FR,DONTCARE,DONTCARE);
-				break;
-			case (HAS_LOWER):
-				glp_set_col_bnds(mpc->op, id,
-						 GLP_LO,bnds_lo[j],DONTCARE);
-				break;
-			case (HAS_UPPER):
-				glp_set_col_bnds(mpc->op, id,
-						 GLP_UP,DONTCARE,bnds_up[j]);
-				break;
-			case (HAS_LOWER | HAS_UPPER):
-				glp_set_col_bnds(mpc->op, id,
-						 GLP_DB,bnds_lo[j],bnds_up[j]);
-				break;
-			}
-		}
+	for (i=0; i < mpc->model->m; i++) {
+		mpc_input_bnds_apply(mpc, i);
 	}
-
-	free(bnds_has);
-	free(bnds_lo);
-	free(bnds_up);
 }
 
 /*
- * Add constraints on maximum admissible rate of inputs. A successful
- * invocation needs:
- * - GLPK variables of mpc->op be initialized
- * - the JSON object in have the following fields:
- *     "input_rate_max", array of max input rates be initiaized
+ * Add constraints on maximum admissible rate of inputs (see mpc.h)
  */
 void mpc_input_set_delta(mpc_glpk * mpc, struct json_object * in)
 {
@@ -218,9 +258,9 @@ void mpc_input_set_delta(mpc_glpk * mpc, struct json_object * in)
 	int id, *ind;
 	struct json_object * vec_rates, *elem;
 	
-	/* Get the input bounds */
+	/* Get the input max rates */
 	if (!json_object_object_get_ex(in, "input_rate_max", &vec_rates)) {
-		PRINT_ERROR("missing input_rate_max in JSON");
+		/* no rate constraints */
 		return;
 	}
 	if ((size_t)json_object_array_length(vec_rates) != mpc->model->m) {
@@ -259,8 +299,8 @@ void mpc_input_set_delta(mpc_glpk * mpc, struct json_object * in)
 			}
 			sprintf(s,"U%i[%02i]_(rate)",(int)j,(int)i);
 			glp_set_row_name(mpc->op, id, s);
-			ind[1] = (int)(i*mpc->model->m+j+1);
-			ind[2] = (int)((i+1)*mpc->model->m+j+1);
+			ind[1] = mpc->v_U+(int)(i*mpc->model->m+j);
+			ind[2] = mpc->v_U+(int)((i+1)*mpc->model->m+j);
 			val[1] = -1;
 			val[2] = 1;
 			glp_set_mat_row(mpc->op, id, 2, ind, val);
@@ -278,53 +318,53 @@ void mpc_input_set_delta(mpc_glpk * mpc, struct json_object * in)
 
 
 /*
- * Add  constraints  on  maximum/minimum  first  input  based  on  max
- * admissible  rate of  inputs and  last applied  input. A  successful
- * invocation needs:
- * - GLPK control control variables of mpc->op be initialized
- * - the JSON object in have the following fields:
- *     "input_rate_max", array of max input rates be initiaized
- * - the parameter u0 be set with last input
+ * Tighten the bounds of U(0), ..., U(h_ctrl) by the max input rates
+ * from the last applied input u0, within the bounds u_lo, u_up
  */
-void mpc_input_set_delta0(mpc_glpk * mpc, const gsl_vector * u0)
+static void mpc_input_delta0_apply(mpc_glpk * mpc, const double * u0)
 {
-	gsl_vector *lo, *up;
 	int id;
-	double bnd, col_lo, col_up;
+	double rate, lo, up;
 	size_t i, j;
 
-	lo = gsl_vector_calloc(mpc->model->m);
-	gsl_vector_memcpy(lo, u0);
-	up = gsl_vector_calloc(mpc->model->m);
-	gsl_vector_memcpy(up, u0);
-
-	/* Get and possibly set new bounds in the GLPK problem */
-	id = mpc->v_U;
-	for (i=0; i < mpc->h_ctrl+1; i++) {
+	for (j=0; j < mpc->model->m; j++) {
+		rate = gsl_vector_get(mpc->max_rate, j);
+		if (rate < 0) {
+			/* no max rate, bounds as set by mpc_input_bnds_apply */
+			continue;
+		}
+		id = mpc->v_U+(int)j;
 		/* Widen the bounds as steps move forward */
-		gsl_vector_sub(lo, mpc->max_rate);
-		gsl_vector_add(up, mpc->max_rate);
-		for (j=0; j < mpc->model->m; j++, id++) {
-			if (gsl_vector_get(mpc->max_rate, j) < 0) {
-				/* no max rate, just skip */
-				continue;
-			}
-			if (gsl_vector_get(mpc->max_rate, j) == 0) {
-				/* no admitted change, keep var constant */
-				bnd = gsl_vector_get(u0, j);
-				glp_set_col_bnds(mpc->op, id, GLP_FX, bnd, bnd);
-				continue;
+		for (i=1; i <= mpc->h_ctrl+1; i++, id += (int)mpc->model->m) {
+			lo = GSL_MAX(gsl_vector_get(mpc->u_lo, j),
+				     u0[j]-rate*(double)i);
+			up = GSL_MIN(gsl_vector_get(mpc->u_up, j),
+				     u0[j]+rate*(double)i);
+			if (lo > up) {
+				/* u0 out of bounds: the nearest bound */
+				lo = up = u0[j] < lo ? lo : up;
 			}
-			/* mpc->max_rate[j] > 0 */
-			col_lo = glp_get_col_lb(mpc->op, id);
-			col_lo = GSL_MAX(col_lo, gsl_vector_get(lo,j));
-			col_up = glp_get_col_ub(mpc->op, id);
-			col_up = GSL_MIN(col_up, gsl_vector_get(up,j));
-			glp_set_col_bnds(mpc->op, id, GLP_DB, col_lo, col_up);
+			glp_set_col_bnds(mpc->op, id,
+					 lo == up ? GLP_FX : GLP_DB, lo, up);
 		}
 	}
+}
 
-	
+/*
+ * Bounds of the inputs from the last applied input (see mpc.h)
+ */
+void mpc_input_set_delta0(mpc_glpk * mpc, const double * u0)
+{
+	size_t k;
+
+	if (mpc->max_rate == NULL) {
+		/* no rate constraints */
+		return;
+	}
+	mpc_input_delta0_apply(mpc, u0);
+	for (k=0; mpc->regs != NULL && k < mpc->regs->num; k++) {
+		mpc_input_delta0_apply(&mpc->regs->reg[k].mpc, u0);
+	}
 }
 
 /*
@@ -503,18 +543,15 @@ void mpc_state_norm_addvar(mpc_glpk * mpc, struct json_object * in)
 }
 
 /*
- * Set the bound on the state variables. A successful invocation needs:
- * - GLPK state norm constraints initialized  (mpc->v_Ninf_X non zero)
- * - the JSON object in have the following fields:
- *     "state_bounds", array of lower/upper bound of the state
+ * Set the bound on the state variables (see mpc.h)
  */
 void mpc_state_set_bnds(mpc_glpk * mpc, struct json_object * in)
 {
 	size_t i,j,k,num_vars;
-	struct json_object * bnds, *bnds1, *elem;
+	struct json_object * bnds, *bnds1, *elem, *tmp;
 	char s[100];
 	int * ind, id_norm, id, len, first;
-	double * val;
+	double * val, penalty;
 
 	
 	if (mpc->id_norm <= 0) {
@@ -553,8 +590,25 @@ void mpc_state_set_bnds(mpc_glpk * mpc, struct json_object * in)
 			       json_object_get_double(elem));
 	}
 	
-	/* Setting the bounds in the GLPK problem */
-	num_vars = mpc->model->m*mpc->h_ctrl+1;
+	/* Soft bounds: slack of lower/upper bound of each component */
+	if (json_object_object_get_ex(in, "state_bounds_penalty", &tmp)) {
+		penalty = json_object_get_double(tmp);
+		mpc->v_slack = glp_add_cols(mpc->op, (int)(2*mpc->model->n));
+		for (k=0; k < mpc->model->n; k++) {
+			id = mpc->v_slack+(int)(2*k);
+			sprintf(s,"S%i_LO", (int)k);
+			glp_set_col_name(mpc->op, id, s);
+			sprintf(s,"S%i_UP", (int)k);
+			glp_set_col_name(mpc->op, id+1, s);
+			glp_set_col_bnds(mpc->op, id, GLP_LO, 0, DONTCARE);
+			glp_set_col_bnds(mpc->op, id+1, GLP_LO, 0, DONTCARE);
+			glp_set_obj_coef(mpc->op, id, penalty);
+			glp_set_obj_coef(mpc->op, id+1, penalty);
+		}
+	}
+
+	/* Setting the bounds in the GLPK problem (+2 for slacks) */
+	num_vars = mpc->model->m*(mpc->h_ctrl+1)+2;
 	/* Allocating for num_vars+1 because GLPK counts indices in array from 1 */
 	ind = calloc(num_vars+1, sizeof(int));
 	val = calloc(num_vars+1, sizeof(double));
@@ -585,6 +639,14 @@ void mpc_state_set_bnds(mpc_glpk * mpc, struct json_object * in)
 			}
 			len--;
 
+			/* X(i) = ...+S_LO-S_UP: violation by at most S */
+			if (mpc->v_slack > 0) {
+				ind[++len] = mpc->v_slack+(int)(2*k);
+				val[len] = 1;
+				ind[++len] = mpc->v_slack+(int)(2*k)+1;
+				val[len] = -1;
+			}
+
 			/* Setting constraint bounds: name, coefficients */
 			id = glp_add_rows(mpc->op, 1);
 			if (first) {
@@ -604,70 +666,489 @@ void mpc_state_set_bnds(mpc_glpk * mpc, struct json_object * in)
 }
 
 /*
- * Update the initial state of the plant.
+ * Return  1 if  the obstacle  at step k  is present  and overlaps  the
+ * state bounds along all its axes, 0 otherwise (then it cannot be
+ * reached by the state). The obstacle is absent at step k if its size
+ * is zero along any of its axes.
  */
-void mpc_update_x0(mpc_glpk * mpc) {
-	gsl_vector *x_k;
-	int id_normZ, id_Xbnds;
-	size_t i, n, k, H;
+static int mpc_obstacle_reachable(const mpc_glpk * mpc, size_t k)
+{
+	size_t i;
+	double c, s, lo, up;
+
+	for (i=0; i < mpc->model->n; i++) {
+		if (gsl_vector_get(mpc->obst_size_max, i) <= DOUBLE_SMALL) {
+			/* no box constraint along this axis */
+			continue;
+		}
+		c = gsl_matrix_get(mpc->obst_center, k-1, i);
+		s = gsl_matrix_get(mpc->obst_size, k-1, i);
+		lo = mpc->x_lo != NULL ? gsl_vector_get(mpc->x_lo, i) : NAN;
+		up = mpc->x_up != NULL ? gsl_vector_get(mpc->x_up, i) : NAN;
+		if (s <= DOUBLE_SMALL || c-s > up || c+s < lo) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Update the  RHS of the obstacle  constraints at step k,  given the
+ * free evolution  x_k of the state  at step k. If the  obstacle does
+ * not overlap the state bounds along some axis, it cannot be reached
+ * and all its constraints at step k are relaxed.
+ */
+static void mpc_obstacle_update_rhs(mpc_glpk * mpc, size_t k,
+				    const gsl_vector * x_k)
+{
+	size_t i;
+	int id, relax;
+	double c, s;
+
+	relax = !mpc_obstacle_reachable(mpc, k);
+
+	/* Row with at least one constraint true */
+	id = mpc->id_obstacle+(int)((k-1)*(mpc->obst_num+1));
+	if (relax) {
+		glp_set_row_bnds(mpc->op, id, GLP_FR, DONTCARE, DONTCARE);
+	} else {
+		glp_set_row_bnds(mpc->op, id, GLP_UP, DONTCARE,
+				 (double)mpc->obst_num-1+DOUBLE_SMALL);
+	}
+	id++;
+	for (i=0; i < mpc->model->n; i++) {
+		if (gsl_vector_get(mpc->obst_size_max, i) <= DOUBLE_SMALL) {
+			/* no constraints along this axis */
+			continue;
+		}
+		if (relax) {
+			glp_set_row_bnds(mpc->op, id++, GLP_FR,
+					 DONTCARE, DONTCARE);
+			glp_set_row_bnds(mpc->op, id++, GLP_FR,
+					 DONTCARE, DONTCARE);
+			continue;
+		}
+		c = gsl_matrix_get(mpc->obst_center, k-1, i);
+		s = gsl_matrix_get(mpc->obst_size, k-1, i);
+		/* X_i(k) >= c+s, unless binary var is 1 */
+		glp_set_row_bnds(mpc->op, id++, GLP_LO,
+				 c+s-gsl_vector_get(x_k, i), DONTCARE);
+		/* X_i(k) <= c-s, unless binary var is 1 */
+		glp_set_row_bnds(mpc->op, id++, GLP_UP,
+				 DONTCARE, c-s-gsl_vector_get(x_k, i));
+	}
+}
+
+/*
+ * Update the RHS of the state norm constraints at step k, given the
+ * free evolution x_k of the state at step k.  The norm is the one of
+ * the distance from the reference X_ref(k), if any.
+ */
+static void mpc_norm_update_rhs(mpc_glpk * mpc, size_t k,
+				const gsl_vector * x_k)
+{
+	size_t i;
+	int id;
+	double rhs;
+
+	id = mpc->id_norm+(int)(2*(k-1)*mpc->model->n);
+	for (i=0; i < mpc->model->n; i++) {
+		rhs = -gsl_vector_get(x_k, i);
+		if (mpc->x_ref != NULL)
+			rhs += gsl_matrix_get(mpc->x_ref, k-1, i);
+		if (gsl_vector_get(mpc->w,i) > 0) {
+			glp_set_row_bnds(mpc->op, id++,
+					 GLP_UP, DONTCARE, rhs);
+			glp_set_row_bnds(mpc->op, id++,
+					 GLP_LO, rhs, DONTCARE);
+		} else {
+			/* no weight to this component of the state */
+#if 1 /* setting a very large upper bound */
+			glp_set_row_bnds(mpc->op, id++,
+					 GLP_UP, DONTCARE, 1e10);
+			glp_set_row_bnds(mpc->op, id++,
+					 GLP_UP, DONTCARE, 1e10);
+#else /* setting infinity as upper bound */
+			glp_set_row_bnds(mpc->op, id++,
+					 GLP_FR, DONTCARE, DONTCARE);
+			glp_set_row_bnds(mpc->op, id++,
+					 GLP_FR, DONTCARE, DONTCARE);
+#endif
+		}
+	}
+}
+
+/*
+ * Update the RHS of the state bound constraints at step k, given the
+ * free evolution x_k of the state at step k
+ */
+static void mpc_state_bnds_update_rhs(mpc_glpk * mpc, size_t k,
+				      const gsl_vector * x_k)
+{
+	size_t i;
+	int id;
 	double lo, up, x_ik;
 
+	id = mpc->id_state_bnds+(int)((k-1)*mpc->model->n);
+	for (i=0; i < mpc->model->n; i++) {
+		x_ik = gsl_vector_get(x_k, i);
+		lo = gsl_vector_get(mpc->x_lo, i);
+		up = gsl_vector_get(mpc->x_up, i);
+		if (isfinite(lo) && isfinite(up))
+			glp_set_row_bnds(mpc->op, id++, GLP_DB,
+					 lo-x_ik, up-x_ik);
+		else if (isfinite(lo))
+			glp_set_row_bnds(mpc->op, id++, GLP_LO,
+					 lo-x_ik, DONTCARE);
+		else if (isfinite(up))
+			glp_set_row_bnds(mpc->op, id++, GLP_UP,
+					 DONTCARE, up-x_ik);
+		else /* no bounds */
+			glp_set_row_bnds(mpc->op, id++, GLP_FR,
+					 DONTCARE, DONTCARE);
+	}
+}
+
+/*
+ * Update the RHS of the constraints of abs(input), so that the cost
+ * of the input is the one of the distance from the reference U_ref.
+ */
+static void mpc_input_ref_rhs(mpc_glpk * mpc)
+{
+	size_t i, j;
+	int id;
+	double u_ref;
+
+	if (mpc->id_absU <= 0)
+		return;
+	id = mpc->id_absU;
+	for (i=0; i < mpc->h_ctrl+1; i++) {
+		for (j=0; j < mpc->model->m; j++) {
+			u_ref = mpc->u_ref != NULL ?
+				gsl_matrix_get(mpc->u_ref, i, j) : 0;
+			/* U_j(i)-|U_j(i)| <= U_ref_j(i) */
+			glp_set_row_bnds(mpc->op, id++, GLP_UP, DONTCARE, u_ref);
+			/* U_j(i)+|U_j(i)| >= U_ref_j(i) */
+			glp_set_row_bnds(mpc->op, id++, GLP_LO, u_ref, DONTCARE);
+		}
+	}
+}
+
+/*
+ * Store the reference  in mpc and update the cost  of inputs. Regions
+ * share the reference of mpc.
+ */
+static void mpc_ref_store(mpc_glpk * mpc,
+			  const double *x_ref, const double *u_ref)
+{
+	size_t k;
+
+	if (x_ref != NULL) {
+		if (mpc->x_ref == NULL)
+			mpc->x_ref = gsl_matrix_calloc(mpc->model->H,
+						       mpc->model->n);
+		memcpy(mpc->x_ref->data, x_ref,
+		       sizeof(*x_ref)*mpc->model->H*mpc->model->n);
+	}
+	if (u_ref != NULL) {
+		if (mpc->u_ref == NULL)
+			mpc->u_ref = gsl_matrix_calloc(mpc->h_ctrl+1,
+						       mpc->model->m);
+		memcpy(mpc->u_ref->data, u_ref,
+		       sizeof(*u_ref)*(mpc->h_ctrl+1)*mpc->model->m);
+		mpc_input_ref_rhs(mpc);
+	}
+	if (mpc->regs == NULL)
+		return;
+	for (k=0; k < mpc->regs->num; k++) {
+		mpc->regs->reg[k].mpc.x_ref = mpc->x_ref;
+		mpc->regs->reg[k].mpc.u_ref = mpc->u_ref;
+		if (u_ref != NULL)
+			mpc_input_ref_rhs(&mpc->regs->reg[k].mpc);
+	}
+}
+
+/*
+ * Update the reference to be tracked (see mpc.h)
+ */
+void mpc_update_ref(mpc_glpk * mpc, const double *x_ref, const double *u_ref)
+{
+	gsl_vector_view x_k;
+	size_t k;
+
+	mpc_ref_store(mpc, x_ref, u_ref);
+	if (x_ref == NULL || mpc->x_free == NULL)
+		return;
+	/* Regions update their RHS at next solve */
+	for (k=1; k <= mpc->model->H; k++) {
+		x_k = gsl_matrix_row(mpc->x_free, k-1);
+		mpc_norm_update_rhs(mpc, k, &x_k.vector);
+	}
+}
+
+/*
+ * Update the bounds of the i-th input (see mpc.h)
+ */
+void mpc_input_update_bnds(mpc_glpk * mpc, size_t i, double lo, double up)
+{
+	size_t k;
+
+	if (mpc->u_lo == NULL || i >= mpc->model->m) {
+		PRINT_ERROR("input bounds not set or wrong index");
+		return;
+	}
+	gsl_vector_set(mpc->u_lo, i, lo);
+	gsl_vector_set(mpc->u_up, i, up);
+	mpc_input_bnds_apply(mpc, i);
+	for (k=0; mpc->regs != NULL && k < mpc->regs->num; k++) {
+		mpc_input_bnds_apply(&mpc->regs->reg[k].mpc, i);
+	}
+}
+
+/*
+ * Update the bounds of the i-th state component (see mpc.h)
+ */
+void mpc_state_update_bnds(mpc_glpk * mpc, size_t i, double lo, double up)
+{
+	gsl_vector_view x_k;
+	size_t k;
+
+	if (mpc->x_lo == NULL || i >= mpc->model->n) {
+		PRINT_ERROR("state bounds not set or wrong index");
+		return;
+	}
+	gsl_vector_set(mpc->x_lo, i, lo);
+	gsl_vector_set(mpc->x_up, i, up);
+	if (mpc->id_obstacle > 0 &&
+	    gsl_vector_get(mpc->obst_size_max, i) > DOUBLE_SMALL) {
+		/* big-M valid for the new bounds */
+		mpc_obstacle_M_set(mpc, i);
+		mpc_obstacle_M_apply(mpc, i);
+	}
+	if (mpc->x_free == NULL)
+		return;
+	/* Regions share the bounds and update RHS at next solve */
+	for (k=1; k <= mpc->model->H; k++) {
+		x_k = gsl_matrix_row(mpc->x_free, k-1);
+		mpc_state_bnds_update_rhs(mpc, k, &x_k.vector);
+		if (mpc->id_obstacle > 0)
+			mpc_obstacle_update_rhs(mpc, k, &x_k.vector);
+	}
+}
+
+/*
+ * Set the coefficient of |X(k)|_inf in the norm constraints of the
+ * i-th state component, according to the weight mpc->w
+ */
+static void mpc_norm_weight_apply(mpc_glpk * mpc, size_t i)
+{
+	size_t k, j;
+	int id, len, *ind;
+	double coef, *val;
+
+	ind = calloc((size_t)glp_get_num_cols(mpc->op)+1, sizeof(*ind));
+	val = calloc((size_t)glp_get_num_cols(mpc->op)+1, sizeof(*val));
+	if (gsl_vector_get(mpc->w,i) > 0) {
+		coef = -1.0/gsl_vector_get(mpc->w,i);
+	} else {
+		/* UNUSED: any placeholder */
+		coef = 0.12345;
+	}
+	for (k=1; k <= mpc->model->H; k++) {
+		id = mpc->id_norm+(int)(2*((k-1)*mpc->model->n+i));
+		len = glp_get_mat_row(mpc->op, id, ind, val);
+		for (j=1; j <= (size_t)len; j++)
+			if (ind[j] == mpc->v_Ninf_X+(int)k-1)
+				break;
+		/* upper bound, then lower bound with opposite sign */
+		val[j] = coef;
+		glp_set_mat_row(mpc->op, id, len, ind, val);
+		len = glp_get_mat_row(mpc->op, id+1, ind, val);
+		for (j=1; j <= (size_t)len; j++)
+			if (ind[j] == mpc->v_Ninf_X+(int)k-1)
+				break;
+		val[j] = -coef;
+		glp_set_mat_row(mpc->op, id+1, len, ind, val);
+	}
+	free(ind);
+	free(val);
+}
+
+/*
+ * Update the weight of the i-th state component (see mpc.h)
+ */
+void mpc_state_update_weight(mpc_glpk * mpc, size_t i, double w)
+{
+	gsl_vector_view x_k;
+	size_t k;
+
+	if (i >= mpc->model->n) {
+		PRINT_ERROR("wrong index of state weight");
+		return;
+	}
+	gsl_vector_set(mpc->w, i, w);
+	mpc_norm_weight_apply(mpc, i);
+	for (k=0; mpc->regs != NULL && k < mpc->regs->num; k++) {
+		mpc_norm_weight_apply(&mpc->regs->reg[k].mpc, i);
+	}
+	if (mpc->x_free == NULL)
+		return;
+	/* RHS depends on the weight being zero or not */
+	for (k=1; k <= mpc->model->H; k++) {
+		x_k = gsl_matrix_row(mpc->x_free, k-1);
+		mpc_norm_update_rhs(mpc, k, &x_k.vector);
+	}
+}
+
+/*
+ * Set the cost of the j-th input at all steps to w
+ */
+static void mpc_input_weight_apply(mpc_glpk * mpc, size_t j, double w)
+{
+	size_t i;
+
+	/* looping over all input vars */
+	for (i=0; i < mpc->h_ctrl+1; i++) {
+		glp_set_obj_coef(mpc->op,
+				 mpc->v_absU+(int)((mpc->model->m)*i+j), w);
+	}
+}
+
+/*
+ * Update the weight of the j-th input (see mpc.h)
+ */
+void mpc_input_update_weight(mpc_glpk * mpc, size_t j, double w)
+{
+	size_t k;
+
+	if (mpc->v_absU <= 0 || j >= mpc->model->m) {
+		PRINT_ERROR("input cost not set or wrong index");
+		return;
+	}
+	mpc_input_weight_apply(mpc, j, w);
+	for (k=0; mpc->regs != NULL && k < mpc->regs->num; k++) {
+		mpc_input_weight_apply(&mpc->regs->reg[k].mpc, j, w);
+	}
+}
+
+/*
+ * Apply the last command of sol_st, unless already applied (see mpc.h)
+ */
+void mpc_status_cmd_apply(mpc_glpk * mpc, const mpc_status * sol_st)
+{
+	size_t index;
+
+	if (sol_st->cmd[MPC_CMD_SEQ] == mpc->cmd_seq)
+		return;
+	mpc->cmd_seq = sol_st->cmd[MPC_CMD_SEQ];
+	index = sol_st->cmd[MPC_CMD_INDEX];
+	switch (sol_st->cmd[MPC_CMD_TYPE]) {
+	case MPC_CMD_INPUT_BNDS:
+		mpc_input_update_bnds(mpc, index,
+				      sol_st->cmd_val[0], sol_st->cmd_val[1]);
+		break;
+	case MPC_CMD_STATE_BNDS:
+		mpc_state_update_bnds(mpc, index,
+				      sol_st->cmd_val[0], sol_st->cmd_val[1]);
+		break;
+	case MPC_CMD_STATE_WEIGHT:
+		mpc_state_update_weight(mpc, index, sol_st->cmd_val[0]);
+		break;
+	case MPC_CMD_INPUT_WEIGHT:
+		mpc_input_update_weight(mpc, index, sol_st->cmd_val[0]);
+		break;
+	case MPC_CMD_TAU:
+		mpc_update_tau(mpc, sol_st->cmd_val[0]);
+		break;
+	default:
+		PRINT_ERROR("unknown command");
+	}
+}
+
+/*
+ * Settings changed by commands: x_lo, x_up, w, u_lo, u_up, input
+ * weights, tau (see mpc.h)
+ */
+void mpc_status_conf_save(const mpc_glpk * mpc, mpc_status * sol_st)
+{
+	size_t i, n, m;
+	double * c = sol_st->conf;
+
 	n = mpc->model->n;
-	H = mpc->model->H;
-	id_normZ = mpc->id_norm;
-	id_Xbnds = mpc->id_state_bnds;
+	m = mpc->model->m;
+	for (i=0; i < n; i++) {
+		c[i] = mpc->x_lo != NULL ? gsl_vector_get(mpc->x_lo, i) : 0;
+		c[n+i] = mpc->x_up != NULL ? gsl_vector_get(mpc->x_up, i) : 0;
+		c[2*n+i] = gsl_vector_get(mpc->w, i);
+	}
+	for (i=0; i < m; i++) {
+		c[3*n+i] = mpc->u_lo != NULL ? gsl_vector_get(mpc->u_lo, i) : 0;
+		c[3*n+m+i] = mpc->u_up != NULL ?
+			gsl_vector_get(mpc->u_up, i) : 0;
+		/* same weight at all steps: the one of U(0) */
+		c[3*n+2*m+i] = mpc->v_absU > 0 ?
+			glp_get_obj_coef(mpc->op, mpc->v_absU+(int)i) : 0;
+	}
+	c[3*n+3*m] = mpc->model->tau;
+}
+
+void mpc_status_conf_apply(mpc_glpk * mpc, const mpc_status * sol_st)
+{
+	size_t i, n, m;
+	const double * c = sol_st->conf;
+
+	n = mpc->model->n;
+	m = mpc->model->m;
+	for (i=0; i < n; i++) {
+		if (mpc->x_lo != NULL &&
+		    (c[i] != gsl_vector_get(mpc->x_lo, i) ||
+		     c[n+i] != gsl_vector_get(mpc->x_up, i)))
+			mpc_state_update_bnds(mpc, i, c[i], c[n+i]);
+		if (c[2*n+i] != gsl_vector_get(mpc->w, i))
+			mpc_state_update_weight(mpc, i, c[2*n+i]);
+	}
+	for (i=0; i < m; i++) {
+		if (mpc->u_lo != NULL &&
+		    (c[3*n+i] != gsl_vector_get(mpc->u_lo, i) ||
+		     c[3*n+m+i] != gsl_vector_get(mpc->u_up, i)))
+			mpc_input_update_bnds(mpc, i, c[3*n+i], c[3*n+m+i]);
+		if (mpc->v_absU > 0 && c[3*n+2*m+i] !=
+		    glp_get_obj_coef(mpc->op, mpc->v_absU+(int)i))
+			mpc_input_update_weight(mpc, i, c[3*n+2*m+i]);
+	}
+	if (c[3*n+3*m] != mpc->model->tau && mpc_tau_valid(mpc, c[3*n+3*m]))
+		mpc_update_tau(mpc, c[3*n+3*m]);
+}
+
+/*
+ * Update the initial state of the plant.
+ */
+void mpc_update_x0(mpc_glpk * mpc) {
+	gsl_vector *x_k;
+	gsl_vector_view x_k_view;
+	size_t k;
 
-	x_k = gsl_vector_calloc(n);
+	/* Free evolution is kept for later updates of RHS */
+	if (mpc->x_free == NULL) {
+		mpc->x_free = gsl_matrix_calloc(mpc->model->H, mpc->model->n);
+	}
 
 	/* Looping over all state variables from X(1) to X(H) */
-	for (k=1; k<=H; k++) {
+	for (k=1; k<=mpc->model->H; k++) {
 		/* Computing free evolution of X(k): Ad^k*x_0 */
+		x_k_view = gsl_matrix_row(mpc->x_free, k-1);
+		x_k = &x_k_view.vector;
 		gsl_blas_dgemv(CblasNoTrans, 1, mpc->model->Ad[k-1],
 			       mpc->x0, 0, x_k);
-		/* Loop over components of X(k) */
-		for (i=0; i < n; i++) {
-			/* i-th component of X(k) */
-			x_ik = gsl_vector_get (x_k, i);
-			
-			/* Updating RHS of state norm constraints */
-			if (gsl_vector_get(mpc->w,i) > 0) {
-				glp_set_row_bnds(mpc->op, id_normZ++,
-						 GLP_UP, DONTCARE, -x_ik);
-				glp_set_row_bnds(mpc->op, id_normZ++,
-						 GLP_LO, -x_ik, DONTCARE);
-			} else {
-				/* no weight to this component of the state */
-#if 1 /* setting a very large upper bound */
-				glp_set_row_bnds(mpc->op, id_normZ++,
-						 GLP_UP, DONTCARE, 1e10);
-				glp_set_row_bnds(mpc->op, id_normZ++,
-						 GLP_UP, DONTCARE, 1e10);
-#else /* setting infinity as upper bound */
-				glp_set_row_bnds(mpc->op, id++,
-						 GLP_FR, DONTCARE, DONTCARE);
-				glp_set_row_bnds(mpc->op, id++,
-						 GLP_FR, DONTCARE, DONTCARE);
-#endif
-			}
-
-			/* Updating RHS of state bound constraints */
-			lo = gsl_vector_get(mpc->x_lo, i);
-			up = gsl_vector_get(mpc->x_up, i);
-			if (isfinite(lo) && isfinite(up))
-				glp_set_row_bnds(mpc->op, id_Xbnds++, GLP_DB,
-						 lo-x_ik, up-x_ik);
-			else if (isfinite(lo))
-				glp_set_row_bnds(mpc->op, id_Xbnds++, GLP_LO,
-						 lo-x_ik, DONTCARE);
-			else if (isfinite(up))
-				glp_set_row_bnds(mpc->op, id_Xbnds++, GLP_UP,
-						 DONTCARE, up-x_ik);
-			else /* no bounds */
-				glp_set_row_bnds(mpc->op, id_Xbnds++, GLP_FR,
-						 DONTCARE, DONTCARE);
+		if (mpc->id_obstacle > 0) {
+			mpc_obstacle_update_rhs(mpc, k, x_k);
+		}
+		if (mpc->id_face > 0) {
+			mpc_face_update_rhs(mpc, k, x_k);
 		}
+		mpc_norm_update_rhs(mpc, k, x_k);
+		mpc_state_bnds_update_rhs(mpc, k, x_k);
 	}
-	gsl_vector_free(x_k);
 }
 
 /*
@@ -801,49 +1282,137 @@ void mpc_goal_set(mpc_glpk * mpc, struct json_object * in)
  */
 void mpc_warmup(mpc_glpk * mpc)
 {
-	mpc->x0 = gsl_vector_calloc(mpc->model->n);
+	if (mpc->x0 == NULL)
+		mpc->x0 = gsl_vector_calloc(mpc->model->n);
 	mpc_update_x0(mpc);
-	glp_simplex(mpc->op, mpc->param);
+	mpc_optimize(mpc);
 }
 
 
 /*
- * Model the presence of an obstacle by adding BINARY (not continuous)
- * variables. The obstable is modeled by  an array center and an array
- * size.   Both arrays  are  expected to  be  mpc->model->n long.  The
- * obstacle is modeled  as a box centered at center.  The edges of the
- * box  are 2*size  long. If  size[i] is  equal to  zero, then  no box
- * contraint along the i-th dimension.
- *
- * FUTURE EXTENSION (not too complicated): model a moving obstable,
- * possibly with varying size.
+ * Compute the big-M of the i-th axis of the obstacle from the state
+ * bounds and the size the obstacle was added with
  */
-
-void mpc_state_obstacle_add(mpc_glpk * mpc, double *center, double *size)
+static void mpc_obstacle_M_set(mpc_glpk * mpc, size_t i)
 {
-	size_t i, j, k, constr_num, num_vars=0;
-	char s[100];
-	int * ind, id_norm, v_B, id, len;
-	double * val, rhs;
+	double lo, up, s;
 
-	/* add two constraints (R, L) for any non-zero size */
-	for (i=0, constr_num = 0; i < mpc->model->n; i++) {
-		if (fabs(size[i]) > DOUBLE_SMALL) {
-			constr_num += 2;
-		}
-	}
-	if (constr_num == 0) {
+	/*
+	 * Tightest big-M valid for any obstacle overlapping the state
+	 * bounds: X_k(i) >= c+s-M must hold for X_k(i) at the lower
+	 * bound, X_k(i) <= c-s+M at the upper bound.
+	 */
+	s = gsl_vector_get(mpc->obst_size_max, i);
+	lo = mpc->x_lo != NULL ? gsl_vector_get(mpc->x_lo, i) : NAN;
+	up = mpc->x_up != NULL ? gsl_vector_get(mpc->x_up, i) : NAN;
+	if (isfinite(lo) && isfinite(up))
+		gsl_vector_set(mpc->obst_M, i, up-lo+2*s);
+	else
+		gsl_vector_set(mpc->obst_M, i, BIG_M);
+}
+
+/*
+ * Rewrite the big-M coefficients of the binary variables in the
+ * obstacle constraints of the i-th axis at all steps, after obst_M
+ * has changed
+ */
+static void mpc_obstacle_M_apply(mpc_glpk * mpc, size_t i)
+{
+	size_t k, j, p, b;
+	int id, len, *ind;
+	double M, *val;
+
+	/* rows and binary vars of axis i after the ones of axes below */
+	for (p=0, b=0; p < i; p++)
+		if (gsl_vector_get(mpc->obst_size_max, p) > DOUBLE_SMALL)
+			b += 2;
+	M = gsl_vector_get(mpc->obst_M, i);
+	ind = calloc((size_t)glp_get_num_cols(mpc->op)+1, sizeof(*ind));
+	val = calloc((size_t)glp_get_num_cols(mpc->op)+1, sizeof(*val));
+	for (k=1; k <= mpc->model->H; k++) {
+		/* X_i(k) UP row, then LO row, after the "one_true" row */
+		id = mpc->id_obstacle+(int)((k-1)*(mpc->obst_num+1)+b)+1;
+		for (p=0; p < 2; p++, id++) {
+			len = glp_get_mat_row(mpc->op, id, ind, val);
+			for (j=1; j <= (size_t)len; j++)
+				if (ind[j] == mpc->v_B+
+				    (int)((k-1)*mpc->obst_num+b+p))
+					break;
+			val[j] = p == 0 ? M : -M;
+			glp_set_mat_row(mpc->op, id, len, ind, val);
+		}
+	}
+	free(ind);
+	free(val);
+}
+
+/*
+ * Store center and size of the obstacle  in mpc (same at all steps).
+ * Also computing the big-M of each axis
+ */
+static void mpc_obstacle_store(mpc_glpk * mpc,
+			       const double *center, const double *size)
+{
+	size_t i, k;
+
+	mpc->obst_center = gsl_matrix_calloc(mpc->model->H, mpc->model->n);
+	mpc->obst_size = gsl_matrix_calloc(mpc->model->H, mpc->model->n);
+	mpc->obst_size_max = gsl_vector_calloc(mpc->model->n);
+	mpc->obst_M = gsl_vector_calloc(mpc->model->n);
+	for (i=0; i < mpc->model->n; i++) {
+		for (k=0; k < mpc->model->H; k++) {
+			gsl_matrix_set(mpc->obst_center, k, i, center[i]);
+			gsl_matrix_set(mpc->obst_size, k, i, fabs(size[i]));
+		}
+		gsl_vector_set(mpc->obst_size_max, i, fabs(size[i]));
+		mpc_obstacle_M_set(mpc, i);
+	}
+}
+
+/*
+ * Model the presence of an obstacle by adding BINARY (not continuous)
+ * variables. The obstable is modeled by  an array center and an array
+ * size.   Both arrays  are  expected to  be  mpc->model->n long.  The
+ * obstacle is modeled  as a box centered at center.  The edges of the
+ * box  are 2*size  long. If  size[i] is  equal to  zero, then  no box
+ * contraint along the i-th dimension.
+ *
+ * The big-M  coefficient of each  axis is  derived from the  state bounds
+ * (hence mpc_state_set_bnds(...) should be invoked before). The RHS of
+ * the obstacle constraints is set by mpc_update_x0(...).
+ *
+ * The obstacle may then move and change size along the horizon by
+ * mpc_state_obstacle_update(...).
+ */
+void mpc_state_obstacle_add(mpc_glpk * mpc, double *center, double *size)
+{
+	size_t i, j, k, constr_num, num_vars=0;
+	char s[100];
+	int * ind, id_norm, v_B, id, len;
+	double * val;
+
+	/* add two constraints (R, L) for any non-zero size */
+	for (i=0, constr_num = 0; i < mpc->model->n; i++) {
+		if (fabs(size[i]) > DOUBLE_SMALL) {
+			constr_num += 2;
+		}
+	}
+	if (constr_num == 0) {
 		/* No need of constraints */
 		mpc->id_obstacle = 0;
 		mpc->v_B = 0;
 		return;
 	}
+	mpc->obst_num = constr_num;
+
+	/* Storing the obstacle: RHS are set by mpc_update_x0 */
+	mpc_obstacle_store(mpc, center, size);
 
 	/* 
 	 * num_vars is the max number of variables with non-zero
 	 * coefficient in any constraint
 	 */
-	num_vars = GSL_MAX(num_vars, mpc->model->m*mpc->h_ctrl+1);
+	num_vars = GSL_MAX(num_vars, mpc->model->m*(mpc->h_ctrl+1)+1);
 	num_vars = GSL_MAX(num_vars, constr_num);
 	/* Allocating for num_vars+1 because GLPK counts indices in array from 1 */
 	ind = calloc(num_vars+1, sizeof(int));
@@ -880,9 +1449,6 @@ void mpc_state_obstacle_add(mpc_glpk * mpc, double *center, double *size)
 		}
 		glp_set_mat_row(mpc->op, mpc->id_obstacle+(int)((i-1)*(constr_num+1)),
 				(int)constr_num, ind, val);
-		glp_set_row_bnds(mpc->op, mpc->id_obstacle+(int)((i-1)*(constr_num+1)),
-				 GLP_UP, DONTCARE,
-				 (double)constr_num-1+DOUBLE_SMALL);
 			
 		/* Loop over components of X(i) */
 		for (k=0; k < mpc->model->n; k++) {
@@ -894,51 +1460,927 @@ void mpc_state_obstacle_add(mpc_glpk * mpc, double *center, double *size)
 			
 			/* Get the coefs of the corresponding norm constraint */
 			len = glp_get_mat_row(mpc->op, id_norm, ind, val);
-			rhs = glp_get_row_ub(mpc->op, id_norm);
 			id_norm += 2;
 			/* searching for id of v_Ninf_X+i in ind */
 			for (j=1; j<=(size_t)len; j++)
 				if (ind[j] == mpc->v_Ninf_X+(int)i-1)
 					break;
 
-			/* Setting constraint of "upper" boundary: X_k(i) >= center[k]+size[k] */
-			id = glp_add_rows(mpc->op, 1);
-			sprintf(s,"Ob(%02d) X%i_UP", (int)i, (int)k);
-			glp_set_row_name(mpc->op, id, s);
+			/* Setting constraint of "upper" boundary: X_k(i) >= center[k]+size[k] */
+			id = glp_add_rows(mpc->op, 1);
+			sprintf(s,"Ob(%02d) X%i_UP", (int)i, (int)k);
+			glp_set_row_name(mpc->op, id, s);
+
+			/* Setting coef and name of "upper" binary var */
+			glp_set_col_kind(mpc->op, v_B, GLP_BV);
+			sprintf(s,"B%i_UP(%02d)", (int)k, (int)i);
+			glp_set_col_name(mpc->op, v_B, s);
+
+			/* setting the big-M coefficient to bin var */
+			ind[j] = v_B++;
+			val[j] = gsl_vector_get(mpc->obst_M, k);
+			glp_set_mat_row(mpc->op, id, len, ind, val);
+
+			/* Setting "lower" boundary: X_k(i) <= center[k]-size[k]  */
+			id = glp_add_rows(mpc->op, 1);
+			sprintf(s,"Ob(%02d) X%i_LO", (int)i, (int)k);
+			glp_set_row_name(mpc->op, id, s);
+
+			/* Setting coef and name of "lower" binary var */
+			glp_set_col_kind(mpc->op, v_B, GLP_BV);
+			sprintf(s,"B%i_LO(%02d)", (int)k, (int)i);
+			glp_set_col_name(mpc->op, v_B, s);
+
+			/* setting the -big-M coefficient to bin var */
+			ind[j] = v_B++;
+			val[j] = -gsl_vector_get(mpc->obst_M, k);
+			glp_set_mat_row(mpc->op, id, len, ind, val);
+		} /* k: loop over components of X(i) */
+	} /* i: loop over X(i) */
+
+	/* Branch-and-bound: the LP relaxation is solved by us */
+	mpc->mip_param = malloc(sizeof(*(mpc->mip_param)));
+	glp_init_iocp(mpc->mip_param);
+	mpc->mip_param->msg_lev  = mpc->param->msg_lev;
+	mpc->mip_param->presolve = GLP_OFF;
+	mpc->mip_param->tm_lim   = MIP_TM_LIM;
+	mpc->mip_tm_lim = 0; /* only the budget of the solve */
+	mpc->mip_param->cb_func  = mpc_mip_callback;
+	mpc->mip_param->cb_info  = mpc;
+	mpc->mip_node_lim = MIP_NODE_LIM;
+	mpc->mip_sol  = calloc((size_t)glp_get_num_cols(mpc->op)+1,
+			       sizeof(*mpc->mip_sol));
+	mpc->mip_seed = calloc((size_t)glp_get_num_cols(mpc->op)+1,
+			       sizeof(*mpc->mip_seed));
+	mpc->mip_has_sol = 0;
+
+	free(ind);
+	free(val);
+}
+
+/*
+ * Solve the LP by the Simplex method, starting from the current basis.
+ * If such a  basis is invalid or singular  (for example, after some
+ * coefficients are changed), it is repaired and the LP solved again.
+ */
+static int mpc_simplex(mpc_glpk * mpc)
+{
+	int ret;
+
+	ret = glp_simplex(mpc->op, mpc->param);
+	switch (ret) {
+	case GLP_EBADB:
+	case GLP_ESING:
+	case GLP_ECOND:
+		glp_adv_basis(mpc->op, 0);
+		ret = glp_simplex(mpc->op, mpc->param);
+		break;
+	}
+	return ret;
+}
+
+/*
+ * Update the RHS of the face constraint at step k, given the free
+ * evolution x_k of the state at step k
+ */
+static void mpc_face_update_rhs(mpc_glpk * mpc, size_t k,
+				const gsl_vector * x_k)
+{
+	int id;
+	double c, s, x;
+
+	id = mpc->id_face+(int)k-1;
+	if (!mpc_obstacle_reachable(mpc, k)) {
+		glp_set_row_bnds(mpc->op, id, GLP_FR, DONTCARE, DONTCARE);
+		return;
+	}
+	c = gsl_matrix_get(mpc->obst_center, k-1, mpc->face_axis[k-1]);
+	s = gsl_matrix_get(mpc->obst_size, k-1, mpc->face_axis[k-1]);
+	x = gsl_vector_get(x_k, mpc->face_axis[k-1]);
+	if (mpc->face_up[k-1]) {
+		/* X_axis(k) >= c+s */
+		glp_set_row_bnds(mpc->op, id, GLP_LO, c+s-x, DONTCARE);
+	} else {
+		/* X_axis(k) <= c-s */
+		glp_set_row_bnds(mpc->op, id, GLP_UP, DONTCARE, c-s-x);
+	}
+}
+
+/*
+ * Add to mpc the constraints of the state X(1), ..., X(H) to be beyond
+ * one face of the obstacle at each step: the face of X(i) is along
+ * mpc->face_axis[i-1], above it if mpc->face_up[i-1]. Coefficients are
+ * taken from the norm constraints (as in mpc_state_set_bnds)
+ */
+static void mpc_face_add(mpc_glpk * mpc)
+{
+	size_t i, j, axis;
+	int *ind, id, len;
+	double *val;
+	char s[100];
+
+	ind = calloc(mpc->model->m*(mpc->h_ctrl+1)+2, sizeof(*ind));
+	val = calloc(mpc->model->m*(mpc->h_ctrl+1)+2, sizeof(*val));
+	for (i=1; i <= mpc->model->H; i++) {
+		axis = mpc->face_axis[i-1];
+		len = glp_get_mat_row(mpc->op, mpc->id_norm+
+				      2*(int)((i-1)*mpc->model->n+axis),
+				      ind, val);
+		/* removing the norm var */
+		for (j=1; j<=(size_t)len; j++)
+			if (ind[j] == mpc->v_Ninf_X+(int)i-1)
+				break;
+		if (j < (size_t)len) {
+			memmove(ind+j, ind+j+1, sizeof(*ind)*((size_t)len-j));
+			memmove(val+j, val+j+1, sizeof(*val)*((size_t)len-j));
+		}
+		len--;
+		id = glp_add_rows(mpc->op, 1);
+		if (i == 1) {
+			mpc->id_face = id;
+		}
+		sprintf(s,"Face(%02d) X%i_%s", (int)i, (int)axis,
+			mpc->face_up[i-1] ? "UP" : "LO");
+		glp_set_row_name(mpc->op, id, s);
+		glp_set_mat_row(mpc->op, id, len, ind, val);
+	}
+	free(ind);
+	free(val);
+}
+
+/*
+ * Solve one region: the state x0 is shared with the original problem
+ */
+static void mpc_region_solve(struct mpc_region * r)
+{
+	mpc_update_x0(&r->mpc);
+	r->ret = mpc_simplex(&r->mpc);
+	r->feasible = r->ret == 0 && glp_get_status(r->mpc.op) == GLP_OPT;
+	r->obj = r->feasible ? glp_get_obj_val(r->mpc.op) : INFINITY;
+}
+
+/*
+ * Body of the threads solving the regions from 1 onward
+ */
+static void * mpc_region_thread(void * arg)
+{
+	struct mpc_region * r;
+
+	r = (struct mpc_region *)arg;
+	while (1) {
+		pthread_barrier_wait(&r->all->start);
+		if (r->all->quit)
+			break;
+		mpc_region_solve(r);
+		pthread_barrier_wait(&r->all->done);
+	}
+	return NULL;
+}
+
+/*
+ * Model an obstacle by convex regions (see mpc.h)
+ */
+void mpc_state_obstacle_regions(mpc_glpk * mpc, double *center, double *size,
+				size_t windows)
+{
+	struct mpc_regions * regs;
+	struct mpc_region * r;
+	size_t i, k, w, H, f, f_num, code;
+	size_t *f_axis, *w_face;
+
+	/* faces of the box: 2*i below, 2*i+1 above the i-th axis */
+	H = mpc->model->H;
+	f_axis = calloc(2*mpc->model->n, sizeof(*f_axis));
+	for (i=0, f_num=0; i < mpc->model->n; i++) {
+		if (fabs(size[i]) > DOUBLE_SMALL) {
+			f_axis[f_num++] = i;
+			f_axis[f_num++] = i;
+		}
+	}
+	if (f_num == 0) {
+		/* No need of regions */
+		free(f_axis);
+		return;
+	}
+	if (windows < 1)
+		windows = 1;
+	if (windows > H)
+		windows = H;
+
+	/* a face per window, never the opposite of the previous one */
+	regs = calloc(1, sizeof(*regs));
+	regs->num = f_num;
+	for (w=1; w < windows; w++)
+		regs->num *= f_num-1;
+	mpc_obstacle_store(mpc, center, size);
+	regs->reg = calloc(regs->num, sizeof(*regs->reg));
+	regs->best = -1;
+	pthread_barrier_init(&regs->start, NULL, (unsigned)regs->num);
+	pthread_barrier_init(&regs->done, NULL, (unsigned)regs->num);
+
+	/* 
+	 * Each region shares model, initial state, bounds and solver
+	 * parameters with mpc, but has its own copy of the LP
+	 */
+	w_face = calloc(windows, sizeof(*w_face));
+	for (k=0; k < regs->num; k++) {
+		/* faces of the k-th region, by the digits of k */
+		code = k;
+		w_face[0] = code % f_num;
+		code /= f_num;
+		for (w=1; w < windows; w++) {
+			f = code % (f_num-1);
+			code /= f_num-1;
+			/* skipping the opposite face (f^1) of the previous */
+			w_face[w] = f < (w_face[w-1]^1) ? f : f+1;
+		}
+		r = regs->reg+k;
+		r->all = regs;
+		r->mpc = *mpc;
+		/* x0 written by mpc, read by all regions */
+		r->mpc.x0 = mpc->x0;
+		r->mpc.x_free = NULL;
+		r->mpc.op = glp_create_prob();
+		glp_copy_prob(r->mpc.op, mpc->op, GLP_ON);
+		r->mpc.face_axis = calloc(H, sizeof(*r->mpc.face_axis));
+		r->mpc.face_up = calloc(H, sizeof(*r->mpc.face_up));
+		for (i=0; i < H; i++) {
+			/* windows of equal number of steps */
+			f = w_face[i*windows/H];
+			r->mpc.face_axis[i] = f_axis[f];
+			r->mpc.face_up[i] = (int)(f & 1);
+		}
+		mpc_face_add(&r->mpc);
+	}
+	free(w_face);
+	free(f_axis);
+	for (k=1; k < regs->num; k++) {
+		pthread_create(&regs->reg[k].thread, NULL,
+			       mpc_region_thread, regs->reg+k);
+	}
+	mpc->regs = regs;
+}
+
+/*
+ * Solve all regions in parallel and select the cheapest one
+ */
+static int mpc_regions_optimize(mpc_glpk * mpc)
+{
+	struct mpc_regions * regs;
+	size_t k;
+
+	regs = mpc->regs;
+	pthread_barrier_wait(&regs->start);
+	mpc_region_solve(regs->reg);
+	pthread_barrier_wait(&regs->done);
+
+	regs->best = -1;
+	for (k=0; k < regs->num; k++) {
+		if (!regs->reg[k].feasible)
+			continue;
+		if (regs->best < 0 || regs->reg[k].obj < regs->reg[regs->best].obj)
+			regs->best = (int)k;
+	}
+	return regs->best < 0 ? GLP_ENOPFS : regs->reg[regs->best].ret;
+}
+
+/*
+ * Move/resize the obstacle along the horizon (see mpc.h)
+ */
+void mpc_state_obstacle_update(mpc_glpk * mpc,
+			       const double *center, const double *size)
+{
+	gsl_vector_view x_k;
+	size_t i, k, n;
+	double s, s_max;
+
+	if (mpc->obst_center == NULL) {
+		/* no obstacle: nothing to do */
+		return;
+	}
+	n = mpc->model->n;
+	for (k=0; k < mpc->model->H; k++) {
+		for (i=0; i < n; i++) {
+			if (center != NULL)
+				gsl_matrix_set(mpc->obst_center, k, i,
+					       center[k*n+i]);
+			if (size == NULL)
+				continue;
+			/* Never larger than initial size: big-M valid */
+			s = fabs(size[k*n+i]);
+			s_max = gsl_vector_get(mpc->obst_size_max, i);
+			gsl_matrix_set(mpc->obst_size, k, i,
+				       s > s_max ? s_max : s);
+		}
+	}
+
+	/*
+	 * Only RHS changes: the basis of last solution remains valid.
+	 * Regions recompute the RHS of their face at next solve.
+	 */
+	if (mpc->id_obstacle <= 0 || mpc->x_free == NULL)
+		return;
+	for (k=1; k <= mpc->model->H; k++) {
+		x_k = gsl_matrix_row(mpc->x_free, k-1);
+		mpc_obstacle_update_rhs(mpc, k, &x_k.vector);
+	}
+}
+
+/*
+ * Set the coefficients of  U in row id to  the ones of the k-th row of
+ * L_i  (only the first u_num  columns of L_i). Other coefficients are
+ * kept. Arrays ind and val must be long enough for the full row.
+ */
+static void mpc_row_set_U(mpc_glpk * mpc, int id, const gsl_matrix * L_i,
+			  size_t k, size_t u_num, int * ind, double * val)
+{
+	size_t j;
+	int len, cur;
+
+	/* Keeping coefs not of U (zero coefs of U are not even stored) */
+	len = glp_get_mat_row(mpc->op, id, ind, val);
+	for (j=1, cur=0; j <= (size_t)len; j++) {
+		if (ind[j] >= mpc->v_U && ind[j] < mpc->v_U+(int)u_num)
+			continue;
+		cur++;
+		ind[cur] = ind[j];
+		val[cur] = val[j];
+	}
+	for (j=0; j < u_num; j++) {
+		cur++;
+		ind[cur] = mpc->v_U+(int)j;
+		val[cur] = gsl_matrix_get(L_i, k, j);
+	}
+	glp_set_mat_row(mpc->op, id, cur, ind, val);
+}
+
+/*
+ * Rewrite the coefficients of U in all rows depending on X(i): norm,
+ * state bounds, obstacle, obstacle face. L_i is the linear operator
+ * from U(0), U(1), ... to X(i)
+ */
+static void mpc_step_rows_update(mpc_glpk * mpc, size_t i,
+				 const gsl_matrix * L_i, int * ind, double * val)
+{
+	size_t k, u_num;
+	int id_obst;
+
+	u_num = mpc->model->m*GSL_MIN(i, mpc->h_ctrl+1);
+	id_obst = mpc->id_obstacle+(int)((i-1)*(mpc->obst_num+1));
+	for (k=0; k < mpc->model->n; k++) {
+		mpc_row_set_U(mpc, mpc->id_norm+(int)(2*((i-1)*mpc->model->n+k)),
+			      L_i, k, u_num, ind, val);
+		mpc_row_set_U(mpc, mpc->id_norm+(int)(2*((i-1)*mpc->model->n+k))+1,
+			      L_i, k, u_num, ind, val);
+		if (mpc->id_state_bnds > 0)
+			mpc_row_set_U(mpc, mpc->id_state_bnds+
+				      (int)((i-1)*mpc->model->n+k),
+				      L_i, k, u_num, ind, val);
+		if (mpc->id_obstacle > 0 &&
+		    gsl_vector_get(mpc->obst_size_max, k) > DOUBLE_SMALL) {
+			/* the two rows after "one_true" row (or previous) */
+			mpc_row_set_U(mpc, ++id_obst, L_i, k, u_num, ind, val);
+			mpc_row_set_U(mpc, ++id_obst, L_i, k, u_num, ind, val);
+		}
+		if (mpc->id_face > 0 && mpc->face_axis[i-1] == k)
+			mpc_row_set_U(mpc, mpc->id_face+(int)i-1,
+				      L_i, k, u_num, ind, val);
+	}
+}
+
+/*
+ * Rewrite the  coefficients of U in all rows  depending on the state,
+ * after the model has changed
+ */
+static void mpc_model_rows_update(mpc_glpk * mpc)
+{
+	size_t i, j, k, m, p, num;
+	int *ind;
+	double *val;
+	gsl_matrix *L_i, *held;
+	gsl_matrix_view blk;
+
+	m = mpc->model->m;
+	p = mpc->h_ctrl;
+	L_i = gsl_matrix_calloc(mpc->model->n, m*(p+1));
+	held = gsl_matrix_calloc(mpc->model->n, m);
+	num = (size_t)glp_get_num_cols(mpc->op)+1;
+	ind = calloc(num, sizeof(*ind));
+	val = calloc(num, sizeof(*val));
+	for (i=1; i <= mpc->model->H; i++) {
+		/* X(i) depends on U(j) by Ad^{i-1-j}*Bd ... */
+		for (j=0; j < GSL_MIN(i, p); j++) {
+			blk = gsl_matrix_submatrix(L_i, 0, m*j,
+						   mpc->model->n, m);
+			gsl_matrix_memcpy(&blk.matrix,
+					  mpc->model->ABd[i-1-j]);
+		}
+		/* ... and on U(p) held from step p to i-1 */
+		if (i > p) {
+			gsl_matrix_add(held, mpc->model->ABd[i-1-p]);
+			blk = gsl_matrix_submatrix(L_i, 0, m*p,
+						   mpc->model->n, m);
+			gsl_matrix_memcpy(&blk.matrix, held);
+		}
+		mpc_step_rows_update(mpc, i, L_i, ind, val);
+		for (k=0; mpc->regs != NULL && k < mpc->regs->num; k++) {
+			mpc_step_rows_update(&mpc->regs->reg[k].mpc, i, L_i,
+					     ind, val);
+		}
+	}
+	free(ind);
+	free(val);
+	gsl_matrix_free(L_i);
+	gsl_matrix_free(held);
+	/* offload requests matched to the new model */
+	mpc->model_id = mpc_model_id(mpc);
+}
+
+/*
+ * Update the model of the plant (see mpc.h)
+ */
+void mpc_update_model(mpc_glpk * mpc, const double *Ad, const double *Bd)
+{
+	/* Same model shared with all regions */
+	dyn_update_discrete(mpc->model, Ad, Bd);
+	mpc_model_rows_update(mpc);
+
+	/* Free evolution changed: updating RHS */
+	if (mpc->x0 != NULL) {
+		mpc_update_x0(mpc);
+	}
+}
+
+/*
+ * Sampling period which can be set (see mpc.h)
+ */
+int mpc_tau_valid(const mpc_glpk * mpc, double tau)
+{
+	return mpc->model->A != NULL && isfinite(tau) && tau > 0;
+}
+
+/*
+ * Update the sampling period of the plant (see mpc.h)
+ */
+void mpc_update_tau(mpc_glpk * mpc, double tau)
+{
+	if (!mpc_tau_valid(mpc, tau)) {
+		PRINT_ERROR("continuous-time model and positive tau needed");
+		return;
+	}
+	dyn_set_tau(mpc->model, tau);
+	mpc_model_rows_update(mpc);
+	if (mpc->x0 != NULL) {
+		mpc_update_x0(mpc);
+	}
+}
+
+/*
+ * Add the obstacle described in JSON, if any (see mpc.h)
+ */
+void mpc_state_obstacle_set(mpc_glpk * mpc, struct json_object * in)
+{
+	struct json_object * obst, *vec_c, *vec_s, *tmp;
+	double *center, *size;
+	const char * method = "milp";
+	size_t i, windows = 1;
+
+	if (!json_object_object_get_ex(in, "obstacle", &obst)) {
+		/* no obstacle: nothing to do */
+		return;
+	}
+	if (!json_object_object_get_ex(obst, "center", &vec_c) ||
+	    !json_object_object_get_ex(obst, "size", &vec_s)) {
+		PRINT_ERROR("missing center/size of obstacle in JSON");
+		return;
+	}
+	if ((size_t)json_object_array_length(vec_c) != mpc->model->n ||
+	    (size_t)json_object_array_length(vec_s) != mpc->model->n) {
+		PRINT_ERROR("wrong size of center/size of obstacle in JSON");
+		return;
+	}
+	center = calloc(mpc->model->n, sizeof(*center));
+	size = calloc(mpc->model->n, sizeof(*size));
+	for (i=0; i < mpc->model->n; i++) {
+		center[i] = json_object_get_double(
+			json_object_array_get_idx(vec_c, (int)i));
+		size[i] = json_object_get_double(
+			json_object_array_get_idx(vec_s, (int)i));
+	}
+	if (json_object_object_get_ex(obst, "method", &tmp)) {
+		method = json_object_get_string(tmp);
+	}
+	if (json_object_object_get_ex(obst, "windows", &tmp)) {
+		if (json_object_get_int(tmp) > 1)
+			windows = (size_t)json_object_get_int(tmp);
+	}
+	if (strcmp(method, "regions") == 0) {
+		mpc_state_obstacle_regions(mpc, center, size, windows);
+	} else {
+		mpc_state_obstacle_add(mpc, center, size);
+	}
+	free(center);
+	free(size);
+	if (mpc->mip_param == NULL) {
+		/* obstacle with all zero size, or regions */
+		return;
+	}
+
+	/* Optional limits of branch-and-bound */
+	if (json_object_object_get_ex(obst, "mip_time_limit", &tmp)) {
+		mpc->mip_tm_lim = json_object_get_int(tmp);
+	}
+	if (json_object_object_get_ex(obst, "mip_node_limit", &tmp)) {
+		mpc->mip_node_lim = json_object_get_int(tmp);
+	}
+}
+
+/*
+ * Callback of branch-and-bound. It provides the shifted incumbent of
+ * the previous solve as heuristic solution and terminates the search
+ * after mpc->mip_node_lim nodes.
+ */
+static void mpc_mip_callback(glp_tree * tree, void * info)
+{
+	mpc_glpk * mpc;
+	int nodes;
+
+	mpc = (mpc_glpk *)info;
+	switch (glp_ios_reason(tree)) {
+	case GLP_IHEUR:
+		if (mpc->mip_seeded) {
+			glp_ios_heur_sol(tree, mpc->mip_seed);
+			mpc->mip_seeded = 0; /* once is enough */
+		}
+		break;
+	case GLP_ISELECT:
+		glp_ios_tree_size(tree, NULL, NULL, &nodes);
+		if (nodes >= mpc->mip_node_lim) {
+			glp_ios_terminate(tree);
+		}
+		break;
+	}
+}
+
+/*
+ * Compute the starting solution of branch-and-bound: binary variables
+ * are taken from the incumbent of the previous solve, shifted by one
+ * step (the last one  is repeated), and the continuous ones by solving
+ * the LP with such binary variables fixed.
+ */
+static void mpc_mip_seed(mpc_glpk * mpc)
+{
+	size_t i, k;
+	int id, id_prev, cols;
+	double b;
+
+	mpc->mip_seeded = 0;
+	if (!mpc->mip_has_sol) {
+		return;
+	}
+	
+	/* Fixing shifted binary vars */
+	for (i=1; i <= mpc->model->H; i++) {
+		for (k=0; k < mpc->obst_num; k++) {
+			id = mpc->v_B+(int)((i-1)*mpc->obst_num+k);
+			id_prev = i < mpc->model->H ? id+(int)mpc->obst_num : id;
+			b = mpc->mip_sol[id_prev] > 0.5 ? 1 : 0;
+			glp_set_col_bnds(mpc->op, id, GLP_FX, b, b);
+		}
+	}
+	if (mpc_simplex(mpc) == 0 &&
+	    glp_get_status(mpc->op) == GLP_OPT) {
+		cols = glp_get_num_cols(mpc->op);
+		for (id=1; id <= cols; id++) {
+			mpc->mip_seed[id] = glp_get_col_prim(mpc->op, id);
+		}
+		mpc->mip_seeded = 1;
+	}
+
+	/* Back to binary vars */
+	for (i=0; i < mpc->model->H*mpc->obst_num; i++) {
+		glp_set_col_bnds(mpc->op, mpc->v_B+(int)i, GLP_DB, 0, 1);
+	}
+}
+
+/*
+ * Number of modes described in JSON (see mpc.h)
+ */
+int mpc_json_mode_num(struct json_object * in)
+{
+	struct json_object * modes;
+
+	if (!json_object_object_get_ex(in, "modes", &modes)) {
+		/* the root object is the only mode */
+		return 1;
+	}
+	return (int)json_object_array_length(modes);
+}
+
+/*
+ * JSON object of a mode: root fields overridden by the mode (see mpc.h)
+ */
+struct json_object * mpc_json_mode(struct json_object * in, int mode)
+{
+	struct json_object * modes, *cur, *out;
+
+	out = json_object_new_object();
+	{
+		json_object_object_foreach(in, key, val) {
+			if (strcmp(key, "modes") != 0)
+				json_object_object_add(out, key,
+						       json_object_get(val));
+		}
+	}
+	if (!json_object_object_get_ex(in, "modes", &modes)) {
+		/* no modes: just the root */
+		return out;
+	}
+	if ((cur = json_object_array_get_idx(modes, (size_t)mode)) == NULL) {
+		PRINT_ERROR("mode not in JSON");
+		return out;
+	}
+	{
+		/* replacing the fields of the root */
+		json_object_object_foreach(cur, key, val) {
+			json_object_object_add(out, key, json_object_get(val));
+		}
+	}
+	return out;
+}
+
+/*
+ * How to wait, from JSON (see mpc.h)
+ */
+void mpc_json_wait(struct json_object * in, const char * name,
+		   uint32_t * mode, double * spin, double * period)
+{
+	struct json_object * wait, *tmp;
+	const char * mode_str;
+
+	if (!json_object_object_get_ex(in, name, &wait)) {
+		return;
+	}
+	if (!json_object_object_get_ex(wait, "mode", &tmp)) {
+		PRINT_ERROR("missing mode of waiting");
+		return;
+	}
+	mode_str = json_object_get_string(tmp);
+	if (strcmp(mode_str, "poll") == 0) {
+		*mode = MPC_WAIT_POLL;
+	} else if (strcmp(mode_str, "spin") == 0) {
+		*mode = MPC_WAIT_SPIN;
+	} else if (strcmp(mode_str, "block") == 0) {
+		*mode = MPC_WAIT_BLOCK;
+	} else if (strcmp(mode_str, "periodic") == 0 && period != NULL) {
+		*mode = MPC_WAIT_PERIODIC;
+		*period = 0;
+		if (json_object_object_get_ex(wait, "period", &tmp)) {
+			*period = json_object_get_double(tmp);
+		}
+	} else {
+		PRINT_ERROR("unknown mode of waiting");
+		return;
+	}
+	*spin = MPC_WAIT_SPIN_US;
+	if (json_object_object_get_ex(wait, "spin_us", &tmp)) {
+		*spin = json_object_get_double(tmp);
+	}
+}
+
+/*
+ * Scheduling from JSON (see mpc.h)
+ */
+void mpc_json_sched(struct json_object * in, const char * name,
+		    mpc_sched * s)
+{
+	struct json_object * sched, *tmp;
+	const char * str;
+
+	if (!json_object_object_get_ex(in, name, &sched)) {
+		return;
+	}
+	if (json_object_object_get_ex(sched, "policy", &tmp)) {
+		str = json_object_get_string(tmp);
+		if (strcmp(str, "other") == 0) {
+			s->policy = MPC_SCHED_OTHER;
+		} else if (strcmp(str, "fifo") == 0) {
+			s->policy = MPC_SCHED_FIFO;
+		} else if (strcmp(str, "deadline") == 0) {
+			s->policy = MPC_SCHED_DEADLINE;
+		} else {
+			PRINT_ERROR("unknown scheduling policy");
+		}
+	}
+	if (json_object_object_get_ex(sched, "prio", &tmp)) {
+		s->prio = (uint32_t)json_object_get_int(tmp);
+	}
+	if (json_object_object_get_ex(sched, "cpus", &tmp)) {
+		snprintf(s->cpus, sizeof(s->cpus), "%s",
+			 json_object_get_string(tmp));
+	}
+	if (json_object_object_get_ex(sched, "period", &tmp)) {
+		s->period = json_object_get_double(tmp);
+	}
+	if (json_object_object_get_ex(sched, "runtime", &tmp)) {
+		s->runtime = json_object_get_double(tmp);
+	}
+	if (json_object_object_get_ex(sched, "percentile", &tmp)) {
+		s->pct = json_object_get_double(tmp);
+	}
+	if (json_object_object_get_ex(sched, "margin", &tmp)) {
+		s->margin = json_object_get_double(tmp);
+	}
+	if (json_object_object_get_ex(sched, "profile", &tmp) &&
+	    json_object_get_int(tmp) > 0) {
+		s->profile_len = (size_t)json_object_get_int(tmp);
+	}
+}
+
+/*
+ * Time (sec) of CLOCK_MONOTONIC
+ */
+static double mpc_clock(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)t.tv_sec+(double)t.tv_nsec*1e-9;
+}
 
-			/* Setting coef and name of "upper" binary var */
-			glp_set_col_kind(mpc->op, v_B, GLP_BV);
-			sprintf(s,"B%i_UP(%02d)", (int)k, (int)i);
-			glp_set_col_name(mpc->op, v_B, s);
+/*
+ * Budget (msec) of one solve: the limit of the Simplex method, also
+ * bounded by the sampling period if so requested (see mpc.h)
+ */
+static int mpc_budget(const mpc_glpk * mpc)
+{
+	double tau;
 
-			/* setting the BIG_M coefficient to bin var */
-			ind[j] = v_B++;
-			val[j] = BIG_M;
-			rhs += center[k]+size[k];
-			glp_set_mat_row(mpc->op, id, len, ind, val);
-			glp_set_row_bnds(mpc->op, id, GLP_LO, rhs, DONTCARE);
+	tau = mpc->model->tau;
+	if (!mpc->tm_lim_tau || !isfinite(tau) || tau <= 0)
+		return mpc->param->tm_lim;
+	return GSL_MIN(mpc->param->tm_lim, GSL_MAX(1, (int)(tau*1e3)));
+}
 
-			/* Setting "lower" boundary: X_k(i) <= center[k]-size[k]  */
-			id = glp_add_rows(mpc->op, 1);
-			sprintf(s,"Ob(%02d) X%i_LO", (int)i, (int)k);
-			glp_set_row_name(mpc->op, id, s);
+/*
+ * Msec left before time end (INFINITY: no end), 0 if none
+ */
+static int mpc_tm_left(double end)
+{
+	double left;
+
+	if (isinf(end))
+		return INT_MAX;
+	left = (end-mpc_clock())*1e3;
+	if (left >= INT_MAX)
+		return INT_MAX;
+	return left < 1 ? 0 : (int)left;
+}
 
-			/* Setting coef and name of "lower" binary var */
-			glp_set_col_kind(mpc->op, v_B, GLP_BV);
-			sprintf(s,"B%i_LO(%02d)", (int)k, (int)i);
-			glp_set_col_name(mpc->op, v_B, s);
+/*
+ * The incumbent is the seed of branch-and-bound, if any: used when the
+ * budget is over before branch-and-bound
+ */
+static void mpc_mip_seed_take(mpc_glpk * mpc)
+{
+	if (!mpc->mip_seeded) {
+		mpc->mip_has_sol = 0;
+		return;
+	}
+	memcpy(mpc->mip_sol, mpc->mip_seed,
+	       sizeof(*mpc->mip_sol)*((size_t)glp_get_num_cols(mpc->op)+1));
+	mpc->mip_seeded = 0;
+	mpc->mip_has_sol = 1;
+}
 
-			/* setting the -BIG_M coefficient to bin var */
-			ind[j] = v_B++;
-			val[j] = -BIG_M;
-			rhs -= 2*size[k];
-			glp_set_mat_row(mpc->op, id, len, ind, val);
-			glp_set_row_bnds(mpc->op, id, GLP_UP, DONTCARE, rhs);
-		} /* k: loop over components of X(i) */
-	} /* i: loop over X(i) */
+/*
+ * Solve the MPC problem (see mpc.h)
+ */
+int mpc_optimize(mpc_glpk * mpc)
+{
+	int ret, id, cols, tm_lim, left;
+	double end;
 
-	free(ind);
-	free(val);
+	if (mpc->regs != NULL) {
+		/* Obstacle by convex regions */
+		return mpc_regions_optimize(mpc);
+	}
+	tm_lim = mpc->param->tm_lim;
+	mpc->param->tm_lim = mpc_budget(mpc);
+	if (mpc->v_B <= 0) {
+		/* No binary variables: LP only */
+		ret = mpc_simplex(mpc);
+		mpc->param->tm_lim = tm_lim;
+		return ret;
+	}
+
+	/* Seed, relaxation and branch-and-bound share the budget */
+	end = mpc->param->tm_lim == INT_MAX ? INFINITY :
+		mpc_clock()+mpc->param->tm_lim*1e-3;
+	
+	/* Starting solution from previous incumbent */
+	mpc_mip_seed(mpc);
+
+	/* branch-and-bound needs an optimal LP relaxation */
+	mpc->param->tm_lim = GSL_MAX(1, mpc_tm_left(end));
+	ret = mpc_simplex(mpc);
+	mpc->param->tm_lim = tm_lim;
+	left = mpc_tm_left(end);
+	if (ret != 0 || glp_get_status(mpc->op) != GLP_OPT || left == 0) {
+		/*
+		 * Budget over (the relaxation is feasible if the seed
+		 * is): the seed, if any, is the incumbent
+		 */
+		mpc_mip_seed_take(mpc);
+		return ret;
+	}
+	if (left == INT_MAX) {
+		/* no budget: the limit of branch-and-bound only */
+		left = mpc->mip_tm_lim > 0 ? mpc->mip_tm_lim : MIP_TM_LIM;
+	} else if (mpc->mip_tm_lim > 0) {
+		left = GSL_MIN(left, mpc->mip_tm_lim);
+	}
+	mpc->mip_param->tm_lim = left;
+	ret = glp_intopt(mpc->op, mpc->mip_param);
+	switch (glp_mip_status(mpc->op)) {
+	case GLP_OPT:
+	case GLP_FEAS:
+		/* Storing the incumbent for next time */
+		cols = glp_get_num_cols(mpc->op);
+		for (id=1; id <= cols; id++) {
+			mpc->mip_sol[id] = glp_mip_col_val(mpc->op, id);
+		}
+		mpc->mip_has_sol = 1;
+		break;
+	default:
+		mpc->mip_has_sol = 0;
+	}
+	return ret;
+}
+
+/*
+ * Outcome of the last solve (see mpc.h)
+ */
+int mpc_sol_status(const mpc_glpk * mpc)
+{
+	size_t k;
+
+	if (mpc->regs != NULL) {
+		if (mpc->regs->best < 0)
+			return MPC_SOL_INFEAS;
+	} else if (mpc->v_B > 0) {
+		/* the LP relaxation ignores the obstacle: not a solution */
+		if (!mpc->mip_has_sol)
+			return MPC_SOL_INFEAS;
+	} else if (glp_get_prim_stat(mpc->op) != GLP_FEAS) {
+		/* LP infeasible, or budget over before a feasible basis */
+		return MPC_SOL_INFEAS;
+	}
+	for (k=0; mpc->v_slack > 0 && k < 2*mpc->model->n; k++) {
+		if (mpc_sol_col(mpc, mpc->v_slack+(int)k) >
+		    mpc->param->tol_bnd)
+			return MPC_SOL_SOFT;
+	}
+	return MPC_SOL_OK;
+}
+
+/*
+ * Budget of the solver from JSON (see mpc.h)
+ */
+void mpc_solver_set_lim(mpc_glpk * mpc, struct json_object * in)
+{
+	struct json_object * tmp;
+
+	if (json_object_object_get_ex(in, "solver_it_lim", &tmp)) {
+		mpc->param->it_lim = json_object_get_int(tmp);
+	}
+	if (json_object_object_get_ex(in, "solver_tm_lim", &tmp)) {
+		mpc->param->tm_lim = json_object_get_int(tmp);
+	} else {
+		/* no solve longer than the sampling period */
+		mpc->tm_lim_tau = 1;
+	}
+}
+
+/*
+ * Return the value of a column in the last solution (see mpc.h)
+ */
+double mpc_sol_col(const mpc_glpk * mpc, int id)
+{
+	if (mpc->regs != NULL) {
+		/* the cheapest region, or anything if none feasible */
+		return glp_get_col_prim(
+			mpc->regs->reg[GSL_MAX(mpc->regs->best, 0)].mpc.op, id);
+	}
+	if (mpc->v_B <= 0) {
+		return glp_get_col_prim(mpc->op, id);
+	}
+	/*
+	 * If branch-and-bound found nothing, the LP relaxation is
+	 * returned, with mpc_sol_status MPC_SOL_INFEAS
+	 */
+	return mpc->mip_has_sol ? mpc->mip_sol[id] :
+		glp_get_col_prim(mpc->op, id);
 }
 
 
@@ -1072,21 +2514,31 @@ mpc_status * mpc_status_alloc(const mpc_glpk * mpc)
 	rows = glp_get_num_rows(mpc->op);
 	cols = glp_get_num_cols(mpc->op);
 	
-	tmp->size = n*sizeof(tmp->state[0])+m*sizeof(tmp->input[0])
+	tmp->size = n*sizeof(tmp->state[0])
+		+(mpc->h_ctrl+1)*m*sizeof(tmp->input[0])
 		/* "+1" because indices in GLPK arrays starts from 1 */
 		+((size_t)rows+1)*sizeof(tmp->row_stat[0])
 		+((size_t)cols+1)*sizeof(tmp->col_stat[0])
 		+sizeof(tmp->steps_bdg[0])+sizeof(tmp->time_bdg[0])
-		+sizeof(tmp->prim_stat)+sizeof(tmp->dual_stat);
+		+sizeof(tmp->prim_stat)+sizeof(tmp->dual_stat)
+		+sizeof(tmp->sol_stat[0])
+		+(mpc->model->H*n+(mpc->h_ctrl+1)*m)*sizeof(tmp->ref[0])
+		+MPC_CMD_LEN*sizeof(tmp->cmd[0])+2*sizeof(tmp->cmd_val[0])
+		+(3*n+3*m+1)*sizeof(tmp->conf[0]);
 	tmp->block = malloc(tmp->size);
 	bzero(tmp->block, tmp->size);
 	tmp->state = (double *)tmp->block;
 	tmp->input = (double *)(tmp->state+n);
-	tmp->time_bdg = (double *)(tmp->input+m);
+	tmp->ref = (double *)(tmp->input+(mpc->h_ctrl+1)*m);
+	tmp->cmd_val = (double *)(tmp->ref+mpc->model->H*n+(mpc->h_ctrl+1)*m);
+	tmp->conf = (double *)(tmp->cmd_val+2);
+	tmp->time_bdg = (double *)(tmp->conf+3*n+3*m+1);
 	tmp->steps_bdg = (int *)(tmp->time_bdg+1);
 	tmp->prim_stat = (int *)(tmp->steps_bdg+1);
 	tmp->dual_stat = (int *)(tmp->prim_stat+1);
-	tmp->row_stat = (uint32_t *)(tmp->dual_stat+1);
+	tmp->sol_stat = (int *)(tmp->dual_stat+1);
+	tmp->cmd = (uint32_t *)(tmp->sol_stat+1);
+	tmp->row_stat = (uint32_t *)(tmp->cmd+MPC_CMD_LEN);
 	tmp->col_stat = (uint32_t *)(tmp->row_stat+rows+1);
 
 	return tmp;
@@ -1100,10 +2552,19 @@ void mpc_status_free(mpc_status * sol_st)
 
 /*
  * Set the  initial state x0  from sol_st->state to  the corresponding
- * field in mpc
+ * field in mpc. Also the reference is taken from sol_st->ref, the
+ * last command in sol_st is applied, and the input rates are bounded
+ * from the last applied input in sol_st->input
  */
 void mpc_status_set_x0(mpc_glpk * mpc, const mpc_status * sol_st)
 {
+	mpc_status_cmd_apply(mpc, sol_st);
+	mpc_input_set_delta0(mpc, sol_st->input);
+
+	/* update reference, then RHS updated together with x0 */
+	mpc_ref_store(mpc, sol_st->ref,
+		      sol_st->ref+mpc->model->H*mpc->model->n);
+
 	/* update initial state */
 	memcpy(mpc->x0->data, sol_st->state,
 	       sizeof(*sol_st->state)*mpc->model->n);
@@ -1152,14 +2613,15 @@ void mpc_status_save(const mpc_glpk * mpc, mpc_status * sol_st)
 {
 	int i;
 
-	/* Getting the solution. FIXME: need an efficient way */
-	for (i = 0; i < (int)mpc->model->m; i++) {
-		sol_st->input[i] = glp_get_col_prim(mpc->op, mpc->v_U+i);
+	/* Getting the full plan U(0), ..., U(h_ctrl) */
+	for (i = 0; i < (int)((mpc->h_ctrl+1)*mpc->model->m); i++) {
+		sol_st->input[i] = mpc_sol_col(mpc, mpc->v_U+i);
 	}
 	
 	/* Storing the optimality of the solution */
 	*sol_st->prim_stat = glp_get_prim_stat(mpc->op);
 	*sol_st->dual_stat = glp_get_dual_stat(mpc->op);
+	*sol_st->sol_stat = mpc_sol_status(mpc);
 	
 	/* Saving basic/non-basic status of rows */
 	for (i = 1; i <= glp_get_num_rows(mpc->op); i++) {
@@ -1172,6 +2634,370 @@ void mpc_status_save(const mpc_glpk * mpc, mpc_status * sol_st)
 	}
 }
 
+/*
+ * Set up the event-triggered MPC from JSON (see mpc.h)
+ */
+void mpc_event_trigger_set(mpc_glpk * mpc, struct json_object * in)
+{
+	struct json_object * ev, *tmp;
+
+	mpc->ev_max_skip = 0;
+	if (!json_object_object_get_ex(in, "event_trigger", &ev)) {
+		/* solving at every step */
+		return;
+	}
+	if (!json_object_object_get_ex(ev, "threshold", &tmp)) {
+		PRINT_ERROR("missing threshold of event_trigger in JSON");
+		return;
+	}
+	mpc->ev_threshold = json_object_get_double(tmp);
+	if (!json_object_object_get_ex(ev, "max_skip", &tmp)) {
+		PRINT_ERROR("missing max_skip of event_trigger in JSON");
+		return;
+	}
+	/* X(k+1) of the last plan is needed after k skips */
+	mpc->ev_max_skip = GSL_MIN((size_t)json_object_get_int(tmp),
+				   mpc->model->H-1);
+}
+
+/*
+ * Set up the delay compensation from JSON (see mpc.h)
+ */
+void mpc_delay_comp_set(mpc_glpk * mpc, struct json_object * in)
+{
+	struct json_object * dc, *tmp;
+
+	mpc->delay_comp = 0;
+	mpc->delay_est = 0;
+	mpc->delay_act = 0;
+	mpc->delay_alpha = 0.1;
+	if (!json_object_object_get_ex(in, "delay_comp", &dc)) {
+		/* state used as it is */
+		return;
+	}
+	if (!(mpc->model->tau > 0)) {
+		PRINT_ERROR("delay_comp needs sampling_period in JSON");
+		return;
+	}
+	if (json_object_object_get_ex(dc, "initial_delay", &tmp))
+		mpc->delay_est = json_object_get_double(tmp);
+	if (json_object_object_get_ex(dc, "actuation_delay", &tmp))
+		mpc->delay_act = json_object_get_double(tmp);
+	if (json_object_object_get_ex(dc, "alpha", &tmp))
+		mpc->delay_alpha = json_object_get_double(tmp);
+	if (mpc->delay_alpha <= 0 || mpc->delay_alpha > 1) {
+		PRINT_ERROR("alpha of delay_comp must be in (0,1]");
+		return;
+	}
+	mpc->delay_cache = malloc(sizeof(*mpc->delay_cache));
+	dyn_prop_cache_init(mpc->delay_cache, mpc->model, DYN_PROP_TOL);
+	if (json_object_object_get_ex(dc, "exp_tolerance", &tmp))
+		mpc->delay_cache->rel_tol = json_object_get_double(tmp);
+	mpc->delay_comp = 1;
+}
+
+/*
+ * Propagate the state by the expected delay (see mpc.h)
+ */
+double mpc_delay_compensate(const mpc_glpk * mpc, double * x,
+			    const double * u, double age)
+{
+	double delay;
+
+	if (!mpc->delay_comp)
+		return 0;
+	delay = GSL_MAX(age, 0)+mpc->delay_est+mpc->delay_act;
+	dyn_propagate(mpc->model, mpc->delay_cache, x, u, delay);
+	return delay;
+}
+
+/*
+ * Moving average of the solve delay (see mpc.h)
+ */
+void mpc_delay_update(mpc_glpk * mpc, double delay)
+{
+	mpc->delay_est += mpc->delay_alpha*(delay-mpc->delay_est);
+}
+
+/*
+ * Fallback LQR gain by Riccati iterations (see mpc.h)
+ */
+void mpc_fallback_init(mpc_glpk * mpc, struct json_object * in)
+{
+	struct json_object * fb, *tmp;
+	gsl_matrix *A, *B, *P, *P_next, *BtP, *S, *AmBK, *tmp_n;
+	gsl_permutation *perm;
+	gsl_vector_view K_col;
+	size_t i, j, n, m, it;
+	double r, w, diff, norm;
+	int sign;
+
+	mpc->K_fb = NULL;
+	if (!json_object_object_get_ex(in, "fallback", &fb)) {
+		/* no fallback: waiting for the solver */
+		return;
+	}
+	if (!json_object_object_get_ex(fb, "deadline", &tmp)) {
+		PRINT_ERROR("missing deadline of fallback in JSON");
+		return;
+	}
+	mpc->fb_deadline = json_object_get_double(tmp);
+
+	n = mpc->model->n;
+	m = mpc->model->m;
+	A = mpc->model->Ad[0];
+	B = mpc->model->ABd[0];
+	mpc->K_fb = gsl_matrix_calloc(m, n);
+	P = gsl_matrix_calloc(n, n);
+	P_next = gsl_matrix_calloc(n, n);
+	tmp_n = gsl_matrix_calloc(n, n);
+	AmBK = gsl_matrix_calloc(n, n);
+	BtP = gsl_matrix_calloc(m, n);
+	S = gsl_matrix_calloc(m, m);
+	perm = gsl_permutation_alloc(m);
+
+	/* Q by the state weights, R by the input weights (or 1) */
+	for (i=0; i < n; i++) {
+		w = gsl_vector_get(mpc->w, i);
+		gsl_matrix_set(P, i, i, w*w);
+	}
+	for (it=0; it < RICCATI_IT_MAX; it++) {
+		/* K = (R+B'PB)^{-1}*B'PA */
+		gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1, B, P, 0, BtP);
+		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1, BtP, B, 0, S);
+		for (j=0; j < m; j++) {
+			r = mpc->v_absU > 0 ?
+				glp_get_obj_coef(mpc->op, mpc->v_absU+(int)j) : 0;
+			gsl_matrix_set(S, j, j, gsl_matrix_get(S, j, j)+
+				       (r > 0 ? r*r : 1));
+		}
+		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1, BtP, A,
+			       0, mpc->K_fb);
+		gsl_linalg_LU_decomp(S, perm, &sign);
+		for (i=0; i < n; i++) {
+			K_col = gsl_matrix_column(mpc->K_fb, i);
+			gsl_linalg_LU_svx(S, perm, &K_col.vector);
+		}
+
+		/* P_next = Q+A'P(A-BK) */
+		gsl_matrix_memcpy(AmBK, A);
+		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, -1, B, mpc->K_fb,
+			       1, AmBK);
+		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1, P, AmBK,
+			       0, tmp_n);
+		gsl_matrix_set_zero(P_next);
+		for (i=0; i < n; i++) {
+			w = gsl_vector_get(mpc->w, i);
+			gsl_matrix_set(P_next, i, i, w*w);
+		}
+		gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1, A, tmp_n,
+			       1, P_next);
+
+		/* Stop when P does not change anymore */
+		for (i=0, diff=0, norm=0; i < n*n; i++) {
+			diff = GSL_MAX(diff, fabs(P_next->data[i]-P->data[i]));
+			norm = GSL_MAX(norm, fabs(P_next->data[i]));
+		}
+		gsl_matrix_memcpy(P, P_next);
+		if (diff <= RICCATI_TOL*(1+norm))
+			break;
+	}
+	if (it == RICCATI_IT_MAX) {
+		PRINT_ERROR("Riccati iterations of fallback not converged");
+	}
+
+	/* Simplex stopped at the deadline (msec) */
+	mpc->param->tm_lim = GSL_MIN(mpc->param->tm_lim,
+				     GSL_MAX(1, (int)(mpc->fb_deadline*1e3)));
+
+	gsl_matrix_free(P);
+	gsl_matrix_free(P_next);
+	gsl_matrix_free(tmp_n);
+	gsl_matrix_free(AmBK);
+	gsl_matrix_free(BtP);
+	gsl_matrix_free(S);
+	gsl_permutation_free(perm);
+}
+
+/*
+ * Saturated fallback input (see mpc.h)
+ */
+void mpc_fallback_input(const mpc_glpk * mpc, const double * x, double * u)
+{
+	size_t i, j;
+	double dx;
+
+	/* u = u_ref-K*(x-x_ref) at the first step */
+	for (j=0; j < mpc->model->m; j++) {
+		u[j] = mpc->u_ref != NULL ? gsl_matrix_get(mpc->u_ref, 0, j) : 0;
+	}
+	for (i=0; i < mpc->model->n; i++) {
+		dx = x[i];
+		if (mpc->x_ref != NULL)
+			dx -= gsl_matrix_get(mpc->x_ref, 0, i);
+		for (j=0; j < mpc->model->m; j++) {
+			u[j] -= gsl_matrix_get(mpc->K_fb, j, i)*dx;
+		}
+	}
+	for (j=0; j < mpc->model->m; j++) {
+		u[j] = GSL_MIN(GSL_MAX(u[j], gsl_vector_get(mpc->u_lo, j)),
+			       gsl_vector_get(mpc->u_up, j));
+	}
+}
+
+/*
+ * Weighted infty-norm of x-y (see mpc.h)
+ */
+double mpc_state_dist(const mpc_glpk * mpc, const double * x, const double * y)
+{
+	size_t i;
+	double dist = 0;
+
+	for (i=0; i < mpc->model->n; i++) {
+		dist = GSL_MAX(dist, gsl_vector_get(mpc->w, i)*fabs(x[i]-y[i]));
+	}
+	return dist;
+}
+
+/*
+ * Set up the speculative solve from JSON (see mpc.h)
+ */
+void mpc_speculate_set(mpc_glpk * mpc, struct json_object * in)
+{
+	struct json_object * sp, *tmp;
+
+	mpc->spec = 0;
+	mpc->spec_valid = 0;
+	if (!json_object_object_get_ex(in, "speculate", &sp)) {
+		/* solving when the state arrives */
+		return;
+	}
+	if (!json_object_object_get_ex(sp, "tolerance", &tmp)) {
+		PRINT_ERROR("missing tolerance of speculate in JSON");
+		return;
+	}
+	mpc->spec_tol = json_object_get_double(tmp);
+	mpc->spec_x0 = calloc(mpc->model->n, sizeof(*mpc->spec_x0));
+	mpc->spec = 1;
+}
+
+/*
+ * Solve ahead the next step (see mpc.h)
+ */
+int mpc_speculate(mpc_glpk * mpc, mpc_status * sol_st,
+		  const double * x0, const double * u, double budget)
+{
+	gsl_vector_const_view x_v, u_v;
+	gsl_vector_view x_next;
+	int ret, tm_lim;
+
+	mpc->spec_valid = 0;
+	if (!mpc->spec || budget*1e3 < 1)
+		return -1;
+	x_v = gsl_vector_const_view_array(x0, mpc->model->n);
+	u_v = gsl_vector_const_view_array(u, mpc->model->m);
+	x_next = gsl_vector_view_array(mpc->spec_x0, mpc->model->n);
+	gsl_blas_dgemv(CblasNoTrans, 1, mpc->model->Ad[0],
+		       &x_v.vector, 0, &x_next.vector);
+	gsl_blas_dgemv(CblasNoTrans, 1, mpc->model->ABd[0],
+		       &u_v.vector, 1, &x_next.vector);
+
+	/* input held: u is the last applied input of the next step */
+	memcpy(sol_st->state, mpc->spec_x0,
+	       sizeof(*sol_st->state)*mpc->model->n);
+	memcpy(sol_st->input, u, sizeof(*sol_st->input)*mpc->model->m);
+	mpc_status_set_x0(mpc, sol_st);
+	tm_lim = mpc->param->tm_lim;
+	if (budget*1e3 < tm_lim)
+		mpc->param->tm_lim = (int)(budget*1e3);
+	ret = mpc_optimize(mpc);
+	mpc->param->tm_lim = tm_lim;
+	mpc_status_save(mpc, sol_st);
+	mpc->spec_valid = ret != GLP_ETMLIM;
+	return 0;
+}
+
+/*
+ * Speculated solve valid for x0 (see mpc.h)
+ */
+int mpc_speculate_hit(mpc_glpk * mpc, const double * x0)
+{
+	int hit;
+
+	hit = mpc->spec_valid &&
+		mpc_state_dist(mpc, x0, mpc->spec_x0) <= mpc->spec_tol;
+	mpc->spec_valid = 0;
+	return hit;
+}
+
+/*
+ * Id of the problem by FNV-1a hash (see mpc.h)
+ */
+static uint32_t mpc_hash(uint32_t h, const void * data, size_t len)
+{
+	const unsigned char * p = data;
+	size_t i;
+
+	for (i=0; i < len; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+uint32_t mpc_model_id(const mpc_glpk * mpc)
+{
+	uint32_t h = 2166136261u;
+	size_t sizes[6], i, j;
+	double v;
+
+	sizes[0] = mpc->model->n;
+	sizes[1] = mpc->model->m;
+	sizes[2] = mpc->model->H;
+	sizes[3] = mpc->h_ctrl;
+	sizes[4] = (size_t)glp_get_num_rows(mpc->op);
+	sizes[5] = (size_t)glp_get_num_cols(mpc->op);
+	h = mpc_hash(h, sizes, sizeof(sizes));
+	h = mpc_hash(h, &mpc->model->tau, sizeof(mpc->model->tau));
+	for (i=0; i < mpc->model->n; i++) {
+		for (j=0; j < mpc->model->n; j++) {
+			v = gsl_matrix_get(mpc->model->Ad[0], i, j);
+			h = mpc_hash(h, &v, sizeof(v));
+		}
+		for (j=0; j < mpc->model->m; j++) {
+			v = gsl_matrix_get(mpc->model->ABd[0], i, j);
+			h = mpc_hash(h, &v, sizeof(v));
+		}
+	}
+	return h;
+}
+
+/*
+ * Predict the states X(1), ..., X(H) of the plan U (see mpc.h)
+ */
+void mpc_plan_predict(const mpc_glpk * mpc, const double * x0,
+		      const double * U, double * X)
+{
+	size_t k, n, m;
+	gsl_vector_const_view x_prev, u_k;
+	gsl_vector_view x_k;
+
+	n = mpc->model->n;
+	m = mpc->model->m;
+	x_prev = gsl_vector_const_view_array(x0, n);
+	for (k=0; k < mpc->model->H; k++) {
+		/* last input of the plan held after h_ctrl */
+		u_k = gsl_vector_const_view_array(U+m*GSL_MIN(k, mpc->h_ctrl),
+						  m);
+		x_k = gsl_vector_view_array(X+n*k, n);
+		gsl_blas_dgemv(CblasNoTrans, 1, mpc->model->Ad[0],
+			       &x_prev.vector, 0, &x_k.vector);
+		gsl_blas_dgemv(CblasNoTrans, 1, mpc->model->ABd[0],
+			       &u_k.vector, 1, &x_k.vector);
+		x_prev = gsl_vector_const_view_array(X+n*k, n);
+	}
+}
+
 void mpc_status_fprintf(FILE *f,
 			const mpc_glpk * mpc, const mpc_status * sol_st)
 {
@@ -1197,5 +3023,182 @@ void mpc_status_fprintf(FILE *f,
 	fprintf(f, "\nSteps: %d\n", *sol_st->steps_bdg);
 	fprintf(f, "Time: %f\n", *sol_st->time_bdg);
 	fprintf(f, "Primal status: %d\n", *sol_st->prim_stat);
-	fprintf(f, "Dual status: %d\n\n", *sol_st->dual_stat);
+	fprintf(f, "Dual status: %d\n", *sol_st->dual_stat);
+	fprintf(f, "Solution status: %d\n\n", *sol_st->sol_stat);
+}
+
+/*
+ * Build the MPC problem from JSON (see mpc.h)
+ */
+void mpc_startup(mpc_glpk * mpc, struct json_object * in, dyn_plant * plant)
+{
+	/* Cleanup the MPC struct */
+	bzero(mpc, sizeof(*mpc));
+
+	/* Init the solver control parameters */
+	mpc->param = malloc(sizeof(*(mpc->param)));
+	glp_init_smcp(mpc->param);
+	mpc->param->msg_lev = GLP_MSG_OFF; /* no message */
+	mpc->param->meth    = GLP_DUAL;    /* dual simplex */
+	mpc->param->it_lim  = INT_MAX;     /* max num of iterations */
+
+	/* Initialize the plant, unless shared */
+	if (plant == NULL) {
+		plant = malloc(sizeof(*plant));
+		dyn_init_json(plant, in);
+		mpc->model_own = 1;
+	}
+	mpc->model = plant;
+
+	/* Setting up a GLPK problem instance */
+	mpc->op = glp_create_prob();
+	glp_set_prob_name(mpc->op, "Model Predictive Control");
+
+	/* Setting up variables and bounds of control inputs */
+	mpc_input_addvar(mpc, in);
+	mpc_input_set_bnds(mpc, in);
+
+	/* Setting up constraints: bounding input rate, if in JSON */
+	mpc_input_set_delta(mpc, in);
+
+	/* Add a variable for each norm of states X(1), ..., X(H)*/
+	mpc_state_norm_addvar(mpc, in);
+
+	/* Setting bounds to the states X(1), ..., X(H)*/
+	mpc_state_set_bnds(mpc, in);
+
+	/* Set a minimization cost for the MPC */
+	mpc_goal_set(mpc, in);
+
+	/* Initial state, shared with the regions of the obstacle, if any */
+	mpc->x0 = gsl_vector_calloc(mpc->model->n);
+
+	/* Add the obstacle, if any in JSON */
+	mpc_state_obstacle_set(mpc, in);
+
+	/* Skipping solves when state as predicted, if in JSON */
+	mpc_event_trigger_set(mpc, in);
+
+	/* Compensating the computation delay, if in JSON */
+	mpc_delay_comp_set(mpc, in);
+
+	/* Warm the solver up with initial state equal to zero */
+	mpc_warmup(mpc);
+
+	/* Bounded time of the solver, if in JSON */
+	mpc_solver_set_lim(mpc, in);
+
+	/* Fallback law when the deadline is missed, if in JSON */
+	mpc_fallback_init(mpc, in);
+
+	/* Solving the next step ahead, if in JSON */
+	mpc_speculate_set(mpc, in);
+
+	/* Id of the problem, to match offload requests */
+	mpc->model_id = mpc_model_id(mpc);
+}
+
+/*
+ * Dry run of a step (see mpc.h)
+ */
+void mpc_prefault(mpc_glpk * mpc, mpc_status * sol_st)
+{
+	double *X, *u;
+
+	X = calloc(mpc->model->H*mpc->model->n, sizeof(*X));
+	u = calloc(mpc->model->m, sizeof(*u));
+	memcpy(X, sol_st->state, sizeof(*X)*mpc->model->n);
+	mpc_delay_compensate(mpc, X, u, 0);
+	mpc_status_set_x0(mpc, sol_st);
+	mpc_optimize(mpc);
+	mpc_status_save(mpc, sol_st);
+	mpc_plan_predict(mpc, sol_st->state, sol_st->input, X);
+	if (mpc->K_fb != NULL)
+		mpc_fallback_input(mpc, sol_st->state, u);
+	free(X);
+	free(u);
+}
+
+/*
+ * Initial state from JSON (see mpc.h)
+ */
+int mpc_state_init(mpc_glpk * mpc, struct json_object * in)
+{
+	struct json_object *tmp_elem, *elem;
+	size_t i;
+
+	if (!json_object_object_get_ex(in, "state_init", &tmp_elem)) {
+		PRINT_ERROR("missing state_init in JSON");
+		return -1;
+	}
+	if ((size_t)json_object_array_length(tmp_elem) != mpc->model->n) {
+		PRINT_ERROR("wrong size of state_init in JSON");
+		return -1;
+	}
+	if (mpc->x0 == NULL)
+		mpc->x0 = gsl_vector_calloc(mpc->model->n);
+	for (i=0; i < mpc->model->n; i++) {
+		elem = json_object_array_get_idx(tmp_elem, i);
+		mpc->x0->data[i] = json_object_get_double(elem);
+	}
+	mpc_update_x0(mpc);
+	return 0;
+}
+
+/*
+ * Release all memory of the MPC problem (see mpc.h)
+ */
+void mpc_free(mpc_glpk * mpc)
+{
+	struct mpc_regions * regs;
+	size_t k;
+
+	if ((regs = mpc->regs) != NULL) {
+		/* waking up the threads of regions to end them */
+		regs->quit = 1;
+		pthread_barrier_wait(&regs->start);
+		for (k=0; k < regs->num; k++) {
+			if (k > 0)
+				pthread_join(regs->reg[k].thread, NULL);
+			glp_delete_prob(regs->reg[k].mpc.op);
+			if (regs->reg[k].mpc.x_free != NULL)
+				gsl_matrix_free(regs->reg[k].mpc.x_free);
+			free(regs->reg[k].mpc.face_axis);
+			free(regs->reg[k].mpc.face_up);
+		}
+		pthread_barrier_destroy(&regs->start);
+		pthread_barrier_destroy(&regs->done);
+		free(regs->reg);
+		free(regs);
+	}
+	glp_delete_prob(mpc->op);
+	free(mpc->param);
+	free(mpc->mip_param);
+	free(mpc->mip_sol);
+	free(mpc->mip_seed);
+	if (mpc->x0 != NULL) gsl_vector_free(mpc->x0);
+	if (mpc->x_lo != NULL) gsl_vector_free(mpc->x_lo);
+	if (mpc->x_up != NULL) gsl_vector_free(mpc->x_up);
+	if (mpc->u_lo != NULL) gsl_vector_free(mpc->u_lo);
+	if (mpc->u_up != NULL) gsl_vector_free(mpc->u_up);
+	if (mpc->w != NULL) gsl_vector_free(mpc->w);
+	if (mpc->max_rate != NULL) gsl_vector_free(mpc->max_rate);
+	if (mpc->obst_center != NULL) gsl_matrix_free(mpc->obst_center);
+	if (mpc->obst_size != NULL) gsl_matrix_free(mpc->obst_size);
+	if (mpc->obst_size_max != NULL) gsl_vector_free(mpc->obst_size_max);
+	if (mpc->obst_M != NULL) gsl_vector_free(mpc->obst_M);
+	if (mpc->x_free != NULL) gsl_matrix_free(mpc->x_free);
+	if (mpc->x_ref != NULL) gsl_matrix_free(mpc->x_ref);
+	if (mpc->u_ref != NULL) gsl_matrix_free(mpc->u_ref);
+	if (mpc->K_fb != NULL) gsl_matrix_free(mpc->K_fb);
+	free(mpc->spec_x0);
+	if (mpc->delay_cache != NULL) {
+		dyn_prop_cache_free(mpc->delay_cache);
+		free(mpc->delay_cache);
+	}
+	if (mpc->model_own) {
+		dyn_free(mpc->model);
+		free(mpc->model);
+	}
+	bzero(mpc, sizeof(*mpc));
 }
@@ -2,6 +2,7 @@
 #define _MPC_H_
 #include <glpk.h>
 #include "dyn.h"
+#include "mpc_sched.h"
 
 /*
  * Formulating a  Model-Predictive Control  (MPC) problem as  a Linear
@@ -13,6 +14,8 @@ typedef struct {
 	gsl_vector *x0;   /* initial state */
 	gsl_vector *x_lo; /* state lower bounds */
 	gsl_vector *x_up; /* state upper bounds */
+	gsl_vector *u_lo; /* input lower bounds */
+	gsl_vector *u_up; /* input upper bounds */
 	gsl_vector *w;    /* weight to the (final) state */
 	size_t h_ctrl;    /* length of control horizon */
 	glp_prob *op;     /* the optimization problem */
@@ -22,11 +25,48 @@ typedef struct {
 	int v_Ninf_X;     /* index of the 1st state norm-infty vars */
 	int v_absU;       /* index of the 1st variable of abs(input) */
 	int v_B;          /* index of binary vars (to model obstacles) */
+	int v_slack;      /* index of slack of soft state bnds (0: hard) */
 	int id_deltaU;    /* index of the 1st constraint on max delta U */
 	int id_norm;      /* index of the 1st constraint on state norm */
 	int id_absU;      /* index of the 1st constraint of abs(input) */
 	int id_state_bnds;/* index of the 1st constraint on state bounds */
 	int id_obstacle;  /* index of the 1st constraint of the obstacle */
+	size_t obst_num;  /* num of obstacle constraints per step (2 per axis) */
+	gsl_matrix *obst_center; /* center of the obstacle, one row per step */
+	gsl_matrix *obst_size;   /* half-edges of the obstacle, one row per step */
+	gsl_vector *obst_size_max; /* half-edges set when adding the obstacle */
+	gsl_vector *obst_M;      /* per-axis big-M of the obstacle constraints */
+	glp_iocp *mip_param; /* param of the MIP solver (only with obstacles) */
+	int mip_node_lim; /* max num of branch-and-bound nodes per solve */
+	int mip_tm_lim;   /* max msec of branch-and-bound (0: budget only) */
+	int mip_has_sol;  /* 1 if mip_sol holds the incumbent of last solve */
+	int mip_seeded;   /* 1 if mip_seed holds a feasible starting solution */
+	double *mip_sol;  /* last incumbent, indexed as GLPK columns from 1 */
+	double *mip_seed; /* shifted incumbent used to seed branch-and-bound */
+	struct mpc_regions *regs; /* convex regions around obstacle, or NULL */
+	int id_face;      /* index of the 1st constraint on an obstacle face */
+	size_t *face_axis;/* axis of the obstacle face at each step (H long) */
+	int *face_up;     /* at each step, 1: above the face, 0: below it */
+	gsl_matrix *x_free; /* free evolution Ad^k*x0, one row per step */
+	gsl_matrix *x_ref;  /* state reference, one row per step (NULL: zero) */
+	gsl_matrix *u_ref;  /* input reference, one row per step (NULL: zero) */
+	uint32_t cmd_seq;   /* sequence number of the last command applied */
+	double ev_threshold; /* max distance of state from prediction to skip */
+	size_t ev_max_skip;  /* max consecutive skipped solves (0: never) */
+	int delay_comp;      /* 1: x0 propagated by the expected delay */
+	double delay_est;    /* estimate of the solve delay (sec) */
+	double delay_act;    /* actuation delay (sec) */
+	double delay_alpha;  /* weight of the last solve delay in delay_est */
+	dyn_prop_cache *delay_cache; /* scratch of the propagation by delay */
+	gsl_matrix *K_fb;    /* m*n gain of the fallback law (NULL: none) */
+	double fb_deadline;  /* max time (sec) of a solve before fallback */
+	int spec;            /* 1: next step solved ahead (speculation) */
+	int spec_valid;      /* 1: the problem holds the speculated solve */
+	double spec_tol;     /* max distance of x0 from spec_x0 to use it */
+	double *spec_x0;     /* x0 speculated, n long */
+	int model_own;       /* 1: model allocated (and freed) by mpc */
+	uint32_t model_id;   /* id of the current model (see mpc_model_id) */
+	int tm_lim_tau;      /* 1: each solve within the sampling period */
 } mpc_glpk;
 
 /*
@@ -41,17 +81,29 @@ typedef struct {
  */
 typedef struct {
 	double * state;       /* Initial state x0 */
-	double * input;       /* Input found */
+	double * input;       /* Input plan found: U(0), ..., U(h_ctrl).
+			       * Before solving: last applied input in U(0) */
 	uint32_t * row_stat;  /* Basic/non-basic status of rows */
 	uint32_t * col_stat;  /* Basic/non-basic status of columns */
 	int * steps_bdg;      /* steps budget. recv: avail. sent: consumed */
 	double * time_bdg;    /* time budget (sec). recv: avail. sent: cons */
 	int * prim_stat;      /* primal status of the basis */
 	int * dual_stat;      /* dual status of the basis */
+	int * sol_stat;       /* outcome of the solve MPC_SOL_* */
+	double * ref;         /* reference: H*n of state, (h_ctrl+1)*m of input */
+	uint32_t * cmd;       /* last command: seq, type, index */
+	double * cmd_val;     /* values of last command (2 doubles) */
+	double * conf;        /* bounds, weights, tau (see mpc_status_conf_save) */
 	size_t size;          /* Size of allocated block */
 	void * block;         /* all data which is then sent if needed  */
 } mpc_status;
 
+/* Layout of the command in mpc_status (types in mpc_interface.h) */
+#define MPC_CMD_SEQ    0   /* sequence number, new command if changed */
+#define MPC_CMD_TYPE   1   /* type of command */
+#define MPC_CMD_INDEX  2   /* index of the input/state component */
+#define MPC_CMD_LEN    3
+
 /*
  * Adding  the variables  for  the  control input  to  the MPC  problem
  * pointed  by  mpc. A successful invocation needs:
@@ -80,21 +132,22 @@ void mpc_input_set_bnds(mpc_glpk * mpc, struct json_object * in);
  * Add constraints on maximum admissible rate of inputs. A successful
  * invocation needs:
  * - GLPK control control variables of mpc->op be initialized
- * - the JSON object in have the following fields:
- *     "input_rate_max", array of max input rates be initiaized
+ * - the JSON object in may have the following field:
+ *     "input_rate_max", array of max input change per step (a negative
+ *       or non-finite value means no max rate of that input)
+ * If "input_rate_max" is missing, the input rates are not bounded.
  */
 void mpc_input_set_delta(mpc_glpk * mpc, struct json_object * in);
 
 /*
- * Add  constraints  on  maximum/minimum  first  input  based  on  max
- * admissible  rate of  inputs and  last applied  input. A  successful
- * invocation needs:
- * - GLPK control control variables of mpc->op be initialized
- * - the JSON object in have the following fields:
- *     "input_rate_max", array of max input rates be initiaized
- * - the parameter u0 be set with last input
+ * Bound the inputs  U(0), U(1), ... based on  the max admissible rate
+ * of inputs and on the last applied input u0 (m long): U(i) is within
+ * u0 +/- (i+1)*rate and within the input bounds. To be invoked before
+ * every solve. No memory is allocated and  the GLPK bounds of the
+ * O(m*h_ctrl) input columns only are written. Nothing is done if the
+ * input rates are not bounded (see mpc_input_set_delta(...)).
  */
-void mpc_input_set_delta0(mpc_glpk * mpc, const gsl_vector * u0);
+void mpc_input_set_delta0(mpc_glpk * mpc, const double * u0);
 
 /*
  * Add (mpc->model->H)  variables corresponding  to the  infty-norm of
@@ -115,6 +168,12 @@ void mpc_input_norm_addvar(mpc_glpk * mpc);
  * - GLPK state norm constraints initialized  (mpc->v_Ninf_X non zero)
  * - the JSON object in have the following fields:
  *     "state_bounds", array of lower/upper bound of the state
+ *     "state_bounds_penalty", cost of violating the bounds [OPTIONAL]
+ *
+ * If "state_bounds_penalty" is  in JSON, the bounds are soft: two slack
+ * variables  per state component (violation of  the lower and  of the
+ * upper bound over the whole horizon)  are added with such a cost, so
+ * that the LP is feasible even if x0 is far outside the bounds.
  */
 void mpc_state_set_bnds(mpc_glpk * mpc, struct json_object * in);
 
@@ -143,6 +202,30 @@ void mpc_goal_set(mpc_glpk * mpc, struct json_object * in);
  */
 void mpc_warmup(mpc_glpk * mpc);
 
+/*
+ * Build the whole MPC problem from the JSON object in: inputs, bounds,
+ * norms, goal, and all optional features (input rates, obstacle, event
+ * trigger, delay compensation, solver limits, fallback law), then warm
+ * it up. If plant is NULL, the plant is initialized from JSON as well
+ * (and freed by mpc_free), otherwise the given plant is used, and may
+ * be shared with other problems. The solver prints no message: set
+ * mpc->param->msg_lev afterwards to debug.
+ */
+void mpc_startup(mpc_glpk * mpc, struct json_object * in, dyn_plant * plant);
+
+/*
+ * Set the initial state from the field "state_init" of JSON (array of
+ * n numbers) and update the problem. Return 0 if successful, -1
+ * otherwise.
+ */
+int mpc_state_init(mpc_glpk * mpc, struct json_object * in);
+
+/*
+ * Release all the memory of the problem (and stop the threads of the
+ * obstacle regions). The plant is freed only if built by mpc_startup.
+ */
+void mpc_free(mpc_glpk * mpc);
+
 /*
  * Update the initial state of the plant and the goal of the
  * optimization accordingly. The initial state must be previously
@@ -150,6 +233,74 @@ void mpc_warmup(mpc_glpk * mpc);
  */
 void mpc_update_x0(mpc_glpk * mpc);
 
+/*
+ * Update the (discrete-time)  model of the plant, for example  after a
+ * new linearization  of a  time-varying plant (see dyn_update_discrete
+ * for  Ad and Bd).  The  linear operators from the inputs to the state
+ * at every step are recomputed and only the coefficients of the inputs
+ * in the existing  constraints on the state (norm, bounds, obstacle)
+ * are rewritten in place.  No row or column is added,  hence the basis
+ * of the last solution is kept as starting point of the next solve. If
+ * x0 is set, the RHS are updated by mpc_update_x0(...) too.
+ */
+void mpc_update_model(mpc_glpk * mpc, const double *Ad, const double *Bd);
+
+/*
+ * Update the sampling period of a continuous-time plant (for example,
+ * to stretch the period of the controller under load).  The model is
+ * discretized again by dyn_set_tau(...)  and the LP coefficients are
+ * updated in place as in mpc_update_model(...).  Costs, bounds, and
+ * rates per step are not rescaled.
+ */
+void mpc_update_tau(mpc_glpk * mpc, double tau);
+
+/*
+ * Return 1 if mpc_update_tau(mpc, tau) would change the sampling period
+ * (continuous-time model, tau finite and positive), 0 otherwise
+ */
+int mpc_tau_valid(const mpc_glpk * mpc, double tau);
+
+/*
+ * Update the reference trajectory  to be tracked.  Rather than the norm
+ * of  X(k) and U(k),  the cost  becomes the norm  of X(k)-x_ref(k) and
+ * U(k)-u_ref(k).  The array x_ref is mpc->model->H*mpc->model->n long:
+ * the first n elements are the state reference at step 1, the next n
+ * at step 2, etc.  The array u_ref is (mpc->h_ctrl+1)*mpc->model->m
+ * long, with the  same layout.  If x_ref (or u_ref) is  NULL, it is left
+ * unchanged. Without any reference, the state is regulated to zero.
+ *
+ * Only the RHS of the state norm and abs(input) constraints is changed,
+ * hence the LP structure and its basis are untouched. State bounds are
+ * not affected by the reference.  It can be invoked either before or
+ * after mpc_update_x0(...).
+ */
+void mpc_update_ref(mpc_glpk * mpc, const double *x_ref, const double *u_ref);
+
+/*
+ * The following functions  change bounds and weights  while running.
+ * Only the affected column bounds,  RHS, or coefficients are changed,
+ * hence the basis  of the last solution is kept  as starting point of
+ * the next solve. If needed, the basis is repaired by mpc_optimize(...).
+ *
+ * mpc_input_update_bnds(...) sets the bounds [lo, up] of the i-th input
+ * at all steps.  If input rates  are bounded, mpc_input_set_delta0(...)
+ * should be invoked afterwards.
+ *
+ * mpc_state_update_bnds(...) sets the bounds [lo, up] of the i-th state
+ * component.  The big-M of an obstacle along such an axis is computed
+ * again from the new bounds and its coefficients are rewritten.
+ *
+ * mpc_state_update_weight(...)  sets the weight of the  i-th component
+ * of the state in the infty-norm (see mpc_state_norm_addvar(...)).
+ *
+ * mpc_input_update_weight(...) sets the weight of the j-th input (see
+ * "min_state_input_norms" in mpc_goal_set(...)).
+ */
+void mpc_input_update_bnds(mpc_glpk * mpc, size_t i, double lo, double up);
+void mpc_state_update_bnds(mpc_glpk * mpc, size_t i, double lo, double up);
+void mpc_state_update_weight(mpc_glpk * mpc, size_t i, double w);
+void mpc_input_update_weight(mpc_glpk * mpc, size_t j, double w);
+
 /*
  * Model the presence of an obstacle by adding BINARY (not continuous)
  * variables. The obstable is modeled by  an array center and an array
@@ -158,11 +309,163 @@ void mpc_update_x0(mpc_glpk * mpc);
  * box  are 2*size  long. If  size[i] is  equal to  zero, then  no box
  * contraint along the i-th dimension.
  *
- * FUTURE EXTENSION (not too complicated): model a moving obstable,
- * possibly with varying size.
+ * The big-M  coefficient of each  axis is  derived from the  state bounds
+ * (hence mpc_state_set_bnds(...) should be invoked before). The RHS of
+ * the obstacle constraints is set by mpc_update_x0(...).
+ *
+ * The obstacle may then move and change size along the horizon by
+ * mpc_state_obstacle_update(...).
  */
 void mpc_state_obstacle_add(mpc_glpk * mpc, double *center, double *size);
 
+/*
+ * Model the presence of an obstacle  (same center and size as in
+ * mpc_state_obstacle_add(...)) WITHOUT binary variables. The free space
+ * around the box is decomposed into convex regions: one half-space per
+ * face of the box.  The horizon is split into windows (equal number of
+ * steps, at most H) and each region is a copy of the LP with the state
+ * kept beyond one face in each window:  a face, then the same or an
+ * adjacent one in the next window (never the opposite one).  With F
+ * faces (2 per axis with a box constraint), there are F*(F-1)^(windows-1)
+ * regions.  At every mpc_optimize(...), the regions are solved in
+ * parallel, each by its own thread, and the cheapest feasible one is
+ * taken.
+ *
+ * With one window, no plan switches face within the horizon:  going
+ * around a corner of the box is then never planned by a single solve,
+ * but only step by step, as the receding horizon moves the state to
+ * the next face.  More windows plan around corners, at the cost of more
+ * regions, and the switch between faces happens only at the boundaries
+ * of the windows.
+ *
+ * It must be  invoked after the  goal is set,  as the LP is copied, and
+ * after mpc->x0 is allocated,  as the regions share it with mpc.  It
+ * requires GLPK built with thread-local storage (default since 4.50).
+ */
+void mpc_state_obstacle_regions(mpc_glpk * mpc, double *center, double *size,
+				size_t windows);
+
+/*
+ * Move and/or resize the obstacle  along the prediction horizon.  Both
+ * center and size are  mpc->model->H*mpc->model->n long: the first n
+ * elements are the obstacle at step 1, the next n at step 2, etc.  If
+ * center (or size) is NULL, it is left unchanged.  A size equal to zero
+ * at some step means no obstacle at that step.  A size is never larger
+ * than the one the obstacle was added with (since the big-M depends on
+ * it), and  along axes  with no  box constraint the  size is  ignored.
+ *
+ * Only the RHS of the constraints is changed, hence the basis of the
+ * last solution is still a valid starting point.  It can be invoked
+ * either before or after mpc_update_x0(...).
+ */
+void mpc_state_obstacle_update(mpc_glpk * mpc,
+			       const double *center, const double *size);
+
+/*
+ * Add the obstacle described in JSON, if any. The JSON object in may
+ * have the following (optional) field:
+ *     "obstacle", an object with fields
+ *       "center", array of the center of the obstacle
+ *       "size", array of half-edges of the obstacle
+ *       "method", "milp" (default) for binary variables solved by
+ *         branch-and-bound, "regions" for parallel convex regions
+ *       "windows", time windows of "regions" (default 1, see
+ *         mpc_state_obstacle_regions(...)) [OPTIONAL]
+ *       "mip_time_limit", max msec of branch-and-bound, also within
+ *         the budget of the solve (see mpc_optimize(...)) [OPTIONAL]
+ *       "mip_node_limit", max nodes of branch-and-bound [OPTIONAL]
+ * If "obstacle" is missing, the problem is left untouched.
+ */
+void mpc_state_obstacle_set(mpc_glpk * mpc, struct json_object * in);
+
+/*
+ * Several modes  of the plant (for example, hover and  cruise)  may be
+ * described in the same JSON by the optional field
+ *     "modes", array of objects, one per mode.  The fields of the i-th
+ *       object replace the ones with the same name of the root object
+ *       (typically "state_Ad" and "input_Bd", but also bounds, weights,
+ *       etc.) in the i-th mode.
+ *
+ * mpc_json_mode_num(...) returns the number of modes (1 if there is no
+ * "modes" field).  mpc_json_mode(...) returns a new JSON object with
+ * the fields of the given mode, to  be used to initialize the MPC of
+ * such a mode.  The returned object must be released by json_object_put.
+ */
+int mpc_json_mode_num(struct json_object * in);
+struct json_object * mpc_json_mode(struct json_object * in, int mode);
+
+/*
+ * How to wait (see MPC_WAIT_* in mpc_interface.h) from the optional
+ * field of name name (typically "ctrl_wait" or "plant_wait"):
+ *     "mode", one of "poll", "spin" (polling for "spin_us" usec, then
+ *       sleeping), "block", or "periodic" (only if period is not NULL)
+ *     "spin_us", usec of polling of "spin", or before the release of
+ *       "periodic" (MPC_WAIT_SPIN_US if absent)
+ *     "period", period (sec) of "periodic" (*period set to 0 if absent)
+ * *mode, *spin and *period are left untouched if the field is absent.
+ */
+void mpc_json_wait(struct json_object * in, const char * name,
+		   uint32_t * mode, double * spin, double * period);
+
+/*
+ * Scheduling (see mpc_sched.h) from the optional field of name name
+ * (typically "ctrl_sched" or "server_sched"), an object with optional
+ * fields
+ *     "policy", one of "other", "fifo" or "deadline"
+ *     "prio", SCHED_FIFO priority (the max if absent)
+ *     "cpus", list of CPUs, such as "1,3-4" ("" for any CPU)
+ *     "period", period of "deadline" (sec)
+ *     "runtime", runtime of "deadline" (sec). If absent, it is
+ *       "margin" (MPC_SCHED_MARGIN if absent) times the "percentile"
+ *       (MPC_SCHED_PCT if absent) of the first "profile" solve times
+ *       (MPC_SCHED_PROFILE if absent)
+ * The fields of s which are absent are left untouched.
+ */
+void mpc_json_sched(struct json_object * in, const char * name,
+		    mpc_sched * s);
+
+/*
+ * Solve the  MPC problem. Without obstacles, this  is just the Simplex
+ * method. With obstacles, the MIP is  solved by branch-and-bound with a
+ * bounded  time/number of nodes.  The incumbent of the  previous solve,
+ * shifted by one step, is used as starting solution.  The seed, the LP
+ * relaxation and  branch-and-bound share one budget  (param->tm_lim,
+ * possibly bounded by the sampling period, see mpc_solver_set_lim(...)):
+ * if it is over before branch-and-bound, the seed is the incumbent.
+ * Without a budget, branch-and-bound is bounded by "mip_time_limit" or
+ * a default.  With obstacle regions, all regions are solved in parallel.
+ * The return value is the one of the last GLPK solver invoked
+ * (GLP_ENOPFS if no region is feasible).
+ */
+int mpc_optimize(mpc_glpk * mpc);
+
+/*
+ * Return the value of the GLPK column id in the last solution found,
+ * either by the Simplex method or by branch-and-bound.
+ */
+double mpc_sol_col(const mpc_glpk * mpc, int id);
+
+/*
+ * Return the outcome of the last solve (MPC_SOL_* in mpc_interface.h):
+ * MPC_SOL_INFEAS if no feasible solution was found (the problem is
+ * infeasible, or the budget of the solver is over before; with binary
+ * variables, also if branch-and-bound ended with no incumbent, as the
+ * LP relaxation may cross the obstacle), MPC_SOL_SOFT
+ * if feasible by violating the soft state bounds, MPC_SOL_OK otherwise.
+ */
+int mpc_sol_status(const mpc_glpk * mpc);
+
+/*
+ * Set the budget of each solve by the JSON object in, which may have
+ * the following (optional) fields:
+ *     "solver_it_lim", max number of Simplex iterations
+ *     "solver_tm_lim", max time (msec) of each solve (all the solves
+ *       of mpc_optimize(...)). If absent, the sampling period of the
+ *       plant (if continuous-time) bounds each solve.
+ * To be invoked after mpc_warmup(...), which solves with no limit.
+ */
+void mpc_solver_set_lim(mpc_glpk * mpc, struct json_object * in);
+
 
 /*
  * Allocate and return the struct for storing/re-storing the status of
@@ -176,10 +479,31 @@ void mpc_status_free(mpc_status * sol_st);
 
 /*
  * Set the  initial state x0  from sol_st->state to  the corresponding
- * field in mpc
+ * field in mpc. Also the reference is taken from sol_st->ref, the
+ * last command in sol_st is applied, and the input rates are bounded
+ * from the last applied input U(0) in sol_st->input
  */
 void mpc_status_set_x0(mpc_glpk * mpc, const mpc_status * sol_st);
 
+/*
+ * Apply the  command  in sol_st->cmd  and sol_st->cmd_val (bounds or
+ * weights to be  changed, see MPC_CMD_* in mpc_interface.h),  unless
+ * its sequence number is the one of the last command applied to mpc.
+ */
+void mpc_status_cmd_apply(mpc_glpk * mpc, const mpc_status * sol_st);
+
+/*
+ * mpc_status_conf_save(...) stores in sol_st->conf all the settings
+ * which commands may change:  state lower and upper bounds, state
+ * weights (n each), input lower and upper bounds,  input weights (m
+ * each), and the sampling period.  mpc_status_conf_apply(...) applies
+ * to mpc the ones of sol_st->conf which differ, by the update functions
+ * above.  Hence, a problem which missed some commands (for example, the
+ * one of the MPC server) is brought in sync by the status.
+ */
+void mpc_status_conf_save(const mpc_glpk * mpc, mpc_status * sol_st);
+void mpc_status_conf_apply(mpc_glpk * mpc, const mpc_status * sol_st);
+
 /*
  * Store the status of the solver in the corresponding struct. In case
  * GLPK is  used, the solver  state is the  row/column basic/non-basic
@@ -195,6 +519,144 @@ void mpc_status_save(const mpc_glpk * mpc, mpc_status * sol_st);
  */
 void mpc_status_resume(mpc_glpk * mpc, const mpc_status * sol_st);
 
+/*
+ * Dry run of a step of the MPC loop from the status sol_st (delay
+ * compensation, solve, save of the status, plan prediction, fallback
+ * input), to prefault all the memory touched by a step before running.
+ * The solution is left in sol_st, as after a solve.
+ */
+void mpc_prefault(mpc_glpk * mpc, mpc_status * sol_st);
+
+/*
+ * Set up the event-triggered MPC from the JSON object in, which may
+ * have the following (optional) field:
+ *     "event_trigger", an object with fields
+ *       "threshold", max distance (see mpc_state_dist) between the
+ *         state (predicted by the delay, if compensated) and its
+ *         prediction by the last plan to skip a solve
+ *       "max_skip", max number of consecutive skipped solves (less
+ *         than the horizon)
+ * If  the state  follows the prediction,  the next input of  the last
+ * plan may then be applied without solving. If "event_trigger" is
+ * missing, every step is solved.
+ */
+void mpc_event_trigger_set(mpc_glpk * mpc, struct json_object * in);
+
+/*
+ * Return the distance between the states x and y (n long) as weighted
+ * infty-norm of x-y, with the weights "state_weight" of the cost.
+ */
+double mpc_state_dist(const mpc_glpk * mpc, const double * x, const double * y);
+
+/*
+ * Set up the compensation of  the computation delay from the JSON
+ * object in, which may have the following (optional) field:
+ *     "delay_comp", an object with (optional) fields
+ *       "initial_delay", initial estimate of the solve delay (sec)
+ *       "actuation_delay", delay from the input written to the input
+ *         applied by the plant (sec)
+ *       "alpha", weight in (0,1] of the last measured delay in the
+ *         moving average of the solve delay (default 0.1)
+ *       "exp_tolerance", change of the fraction of step of the delay,
+ *         relative to the sampling period, below which its matrix
+ *         exponential is reused (default DYN_PROP_TOL, 0: always
+ *         computed)
+ * The scratch of the propagation is allocated here, so no memory is
+ * allocated at every step.  If "delay_comp" is missing, the state is
+ * not compensated.  A known sampling period of the model is needed.
+ */
+void mpc_delay_comp_set(mpc_glpk * mpc, struct json_object * in);
+
+/*
+ * Propagate in place the state x by the expected delay until the input
+ * is applied: the age of the state (sec, time elapsed since the state
+ * was sampled) plus the  estimated solve delay plus the  actuation
+ * delay. The input u (m long) being applied is held meanwhile. Return
+ * the delay (sec) by which x was propagated, 0 if no compensation.
+ */
+double mpc_delay_compensate(const mpc_glpk * mpc, double * x,
+			    const double * u, double age);
+
+/*
+ * Update the estimate of the solve delay with the measured one (sec)
+ * by exponentially weighted moving average.
+ */
+void mpc_delay_update(mpc_glpk * mpc, double delay);
+
+/*
+ * Set up the speculative solve from the JSON object in, which may have
+ * the following (optional) field:
+ *     "speculate", an object with field
+ *       "tolerance", max distance (see mpc_state_dist) between the
+ *         actual x0 and the speculated one to use the speculated solve
+ * If "speculate" is missing, no step is solved ahead.
+ */
+void mpc_speculate_set(mpc_glpk * mpc, struct json_object * in);
+
+/*
+ * Solve ahead the next step, while waiting for its state: x0 of the
+ * next step is predicted by one sampling period of Ad[0] and ABd[0]
+ * from the state x0 (n long) with the input u (m long) applied. The
+ * status sol_st is set to the predicted x0 and to u, then the solution
+ * is saved in sol_st.  The solve  takes at most budget (sec, INFINITY
+ * for the budget of any solve): if stopped by it, the speculation is
+ * not valid, though its basis warm starts the next solve. Return 0 if
+ * solved, -1 if no speculation (also if budget is below 1 msec).
+ */
+int mpc_speculate(mpc_glpk * mpc, mpc_status * sol_st,
+		  const double * x0, const double * u, double budget);
+
+/*
+ * Return 1 if the actual state x0 (n long) is within the tolerance of
+ * the speculated one: the solution of the last mpc_speculate, in its
+ * status, is then valid as it is. Otherwise 0, and the problem is to
+ * be solved again, warm started from the speculated basis. The
+ * speculation is used once: any later call returns 0 until the next
+ * mpc_speculate.
+ */
+int mpc_speculate_hit(mpc_glpk * mpc, const double * x0);
+
+/*
+ * Set up the fallback feedback law  from the JSON object in, which may
+ * have the following (optional) field:
+ *     "fallback", an object with field
+ *       "deadline", max time (sec) of a solve
+ * The LQR gain K is computed  by iterating the Riccati equation over
+ * Ad and Bd, with Q diagonal by the squared state weights and R by the
+ * squared input weights (1 if the input has no weight). The Simplex
+ * is also stopped at the deadline. The gain is not recomputed when the
+ * model changes. To be invoked after mpc_solver_set_lim(...).
+ */
+void mpc_fallback_init(mpc_glpk * mpc, struct json_object * in);
+
+/*
+ * Compute in u (m long) the input of the fallback law from the state x
+ * (n long): u = u_ref-K*(x-x_ref), with the reference at the first step,
+ * saturated to the input bounds. It costs an m*n product, no memory
+ * allocated. Only if mpc->K_fb is not NULL.
+ */
+void mpc_fallback_input(const mpc_glpk * mpc, const double * x, double * u);
+
+/*
+ * Return an id of the problem built by mpc_startup, as a hash of its
+ * sizes (n, m, H, h_ctrl, rows and columns of the LP) and of its model
+ * (sampling period, Ad[0], ABd[0]). Two processes building the same
+ * JSON get the same id, used to match offload requests to problems.
+ * mpc->model_id is computed again whenever the model changes (by
+ * mpc_update_model(...) or mpc_update_tau(...)).
+ */
+uint32_t mpc_model_id(const mpc_glpk * mpc);
+
+/*
+ * Predict the states X(1), ..., X(H) from the initial state x0 (n long)
+ * when the plan U = U(0), ..., U(h_ctrl) (as in mpc_status->input) is
+ * applied, with U(h_ctrl) held until the end of the horizon. The array
+ * X must be H*n long: the first n elements are X(1), etc. No memory is
+ * allocated.
+ */
+void mpc_plan_predict(const mpc_glpk * mpc, const double * x0,
+		      const double * U, double * X);
+
 /*
  * Print the solver status (mostly for debugging purpose)
  */
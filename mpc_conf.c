@@ -1,25 +1,149 @@
+/*
+ * mpc_conf.c
+ *
+ * Change the configuration of a running MPC controller. Options:
+ *
+ *   -n <instance>, name of the MPC controller (MPC_SHM_DEFAULT if not
+ *   given)
+ *
+ *   -l, list the running MPC controllers and exit
+ *
+ * Without arguments, it asks whether the MPC should run locally or on
+ * the server. Otherwise, a command is sent to the MPC controller by:
+ *
+ *   argv[1], the command: input_bnds, state_bnds, state_weight,
+ *   input_weight, or tau
+ *
+ *   argv[2], index of the input/state component (ignored by tau)
+ *
+ *   argv[3], argv[4], new lower/upper bounds (bounds), or new weight
+ *   or sampling period (argv[3] only)
+ */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <errno.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
 #include "mpc_interface.h"
+#include "mpc_plant.h"
 
 /* Put this macro where debugging is needed */
 #define PRINT_ERROR(x) {fprintf(stderr, "%s:%d errno=%i, %s\n",	\
 				__FILE__, __LINE__, errno, (x));}
 
+#define MPC_CONF_LIST_MAX 64  /* max controllers listed */
+
+
+/*
+ * Send the command  in argv to the MPC controller  and wait until it
+ * is acknowledged. Return 0 if successful, -1 otherwise.
+ */
+static int mpc_conf_cmd(struct shared_data * mpc_data,
+			int argc, char * argv[])
+{
+	uint32_t type;
+	int i;
+
+	if (strcmp(argv[1], "input_bnds") == 0 && argc >= 5) {
+		type = MPC_CMD_INPUT_BNDS;
+	} else if (strcmp(argv[1], "state_bnds") == 0 && argc >= 5) {
+		type = MPC_CMD_STATE_BNDS;
+	} else if (strcmp(argv[1], "state_weight") == 0) {
+		type = MPC_CMD_STATE_WEIGHT;
+	} else if (strcmp(argv[1], "input_weight") == 0) {
+		type = MPC_CMD_INPUT_WEIGHT;
+	} else if (strcmp(argv[1], "tau") == 0) {
+		type = MPC_CMD_TAU;
+	} else {
+		PRINT_ERROR("unknown command or too few arguments");
+		return -1;
+	}
+	if (mpc_data->cmd_seq != mpc_data->cmd_ack) {
+		PRINT_ERROR("previous command not yet acknowledged");
+		return -1;
+	}
+	mpc_data->cmd_type = type;
+	mpc_data->cmd_index = (uint32_t)atoi(argv[2]);
+	mpc_data->cmd_val[0] = atof(argv[3]);
+	mpc_data->cmd_val[1] = argc >= 5 ? atof(argv[4]) : 0;
+	/* fields must be written before the sequence number */
+	__sync_synchronize();
+	mpc_data->cmd_seq++;
+
+	/* Waiting up to 1 sec for the controller */
+	for (i=0; i < 1000 && mpc_data->cmd_seq != mpc_data->cmd_ack; i++) {
+		usleep(1000);
+	}
+	if (mpc_data->cmd_seq != mpc_data->cmd_ack) {
+		PRINT_ERROR("command not acknowledged (is the plant running?)");
+		return -1;
+	}
+	/* outcome written before the ack */
+	__sync_synchronize();
+	if (mpc_data->cmd_err) {
+		PRINT_ERROR("command rejected by the controller");
+		return -1;
+	}
+	printf("Command %s acknowledged\n", argv[1]);
+	return 0;
+}
+
+/*
+ * Print the running MPC controllers
+ */
+static void mpc_conf_list(void)
+{
+	char names[MPC_CONF_LIST_MAX][MPC_SHM_NAME_LEN];
+	struct shared_data * mpc_data;
+	int i, num;
+
+	num = mpc_shm_list(names, MPC_CONF_LIST_MAX);
+	for (i=0; i < num; i++) {
+		if ((mpc_data = mpc_plant_attach(names[i])) == NULL)
+			continue;
+		printf("%-20s pid %6d, %zu states, %zu inputs, %s\n", names[i],
+		       (int)mpc_data->ctrl_pid, mpc_data->state_num,
+		       mpc_data->input_num,
+		       MPC_OFFLOAD_IS_ENABLED(mpc_data) ? "SERVER" : "LOCAL");
+		mpc_plant_detach(mpc_data);
+	}
+}
 
 int main(int argc, char * argv[]) {
-	int mpc_shmid;
 	struct shared_data * mpc_data;
+	const char * name = NULL;
 	char choice;
+	int opt, ret;
+
+	/* Options before the command, then argv[1] is the command */
+	while ((opt = getopt(argc, argv, "n:l")) != -1) {
+		switch (opt) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'l':
+			mpc_conf_list();
+			return 0;
+		default:
+			PRINT_ERROR("Usage: mpc_conf [-l] [-n <instance>] [<command> <index> <values>]");
+			return EXIT_FAILURE;
+		}
+	}
+	argc -= optind-1;
+	argv += optind-1;
 	
 	/* Getting the MPC data */
-	mpc_shmid = shmget(MPC_SHM_KEY, 0, 0);
-	if (mpc_shmid == -1) {
-		PRINT_ERROR("shmget of MPC failed");
+	if ((mpc_data = mpc_plant_attach(name)) == NULL) {
+		PRINT_ERROR("MPC instance not found (try mpc_conf -l)");
+		return EXIT_FAILURE;
+	}
+
+	if (argc >= 4) {
+		/* Command to the MPC */
+		ret = mpc_conf_cmd(mpc_data, argc, argv);
+		mpc_plant_detach(mpc_data);
+		return ret ? EXIT_FAILURE : 0;
 	}
-	mpc_data = (struct shared_data *)shmat(mpc_shmid, NULL, 0);
 
 	printf("Currently executing MPC: %s\n",
 	       MPC_OFFLOAD_IS_ENABLED(mpc_data) ? "SERVER" : "LOCAL");
@@ -37,6 +161,7 @@ int main(int argc, char * argv[]) {
 	}
 	printf("Currently executing MPC: %s\n",
 	       MPC_OFFLOAD_IS_ENABLED(mpc_data) ? "SERVER" : "LOCAL");
+	mpc_plant_detach(mpc_data);
 }
 
 
@@ -5,16 +5,40 @@
  * be passed as first parameter (argv[1]).
  * Below the invocation arguments:
  *
+ *   mpc_ctrl [-n <instance>] [-H] [-L] <JSON> [<server IP>]
+ *
+ *   -n <instance>, name of the shared memory  (/mpc.<instance>) to be
+ *   used  by  the plant  [OPTIONAL].  If  not  specified, the  macro
+ *   MPC_SHM_DEFAULT of mpc_interface.h is assumed
+ *
+ *   -H, shared memory on huge pages (hugetlbfs at MPC_HUGETLB_DIR)
+ *
+ *   -L, shared memory locked in RAM
+ *
  *   argv[1], filename of the JSON file describing th problem [MANDATORY]
  *
  *   argv[2],  IP  address  of  the  MPC  server  [OPTIONAL].  If  not
  *   specified,  the  value  of  the macro  MPC_SOLVER_IP  defined  in
  *   mpc_interface.h is assumed
+ *
+ * If the JSON describes several modes ("modes" field), one problem per
+ * mode is built at startup and the mode is selected at every step by
+ * the plant. The MPC server holds the problems of all modes.
+ *
+ * If the JSON has the field "ctrl_pipeline", the loop is split in
+ * stages on their own threads: the ingest of the state (with its
+ * prediction, reference and command) and the output of the input (with
+ * the plan and the log) run while the main thread solves, as in
+ *
+ *   "ctrl_pipeline": {"ingest": {"cpus": "2"}, "output": {"cpus": "3"}}
+ *
+ * with the fields of "ctrl_sched" for each stage (by default SCHED_OTHER
+ * on any CPU). The stages hand the steps over by single-slot buffers,
+ * waiting for them as set by "ctrl_wait".
  */
 
 #define _GNU_SOURCE
 #include "mpc_interface.h"
-#define STRLEN_COMMAND 100
 
 #define PRINT_LOG
 #define MPC_STATUS_X0_ONLY
@@ -36,8 +60,6 @@
 #define MPC_STATUS_X0_ONLY
 */
 
-#include <sys/ipc.h>
-#include <sys/shm.h>
 #include <signal.h>
 #include <sched.h>
 #include <errno.h>
@@ -49,31 +71,194 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
+#include <math.h>
 #include <fcntl.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 #include "mpc.h"
+#include "mpc_plant.h"
+#include "mpc_sched.h"
+#include "mpc_step.h"
 
 /* Put this macro where debugging is needed */
 #define PRINT_ERROR(x) {fprintf(stderr, "%s:%d errno=%i, %s\n",	\
 				__FILE__, __LINE__, errno, (x));}
 
 /* GLOBAL VARIABLES (used in handler) */
-int shm_id;
+const char * shm_name = MPC_SHM_DEFAULT;
+struct shared_data * shm_data = NULL;
+
+#define LOCAL_TIME_DECAY 0.1 /* weight of a faster solve in local_time */
+
+#define LOG_REC_SIZE(data) (2*(30)+			\
+			   15*(data)->state_num+	\
+			   15*(data)->input_num)
+
+/* A step of the MPC loop, handed over from a stage to the next one */
+struct mpc_ctrl_job {
+	uint64_t state_seq;          /* seq of the state answered */
+	int mode;                    /* mode of the plant */
+	size_t skip;                 /* >0: input from the last plan */
+	int cmd_new;                 /* 1: new command in cmd, cmd_val */
+	uint32_t cmd[MPC_CMD_LEN];
+	double cmd_val[2];
+	int plan_new;                /* 1: plan to be published */
+	double time_x0;              /* time (CLOCK_MONOTONIC) of x0 */
+	double time_wake;            /* state taken (CLOCK_MONOTONIC) */
+	struct timespec after_wait;  /* state taken (CLOCK_REALTIME) */
+	struct timespec before_post; /* input ready (CLOCK_REALTIME) */
+	double * state;              /* state taken from the plant */
+	double * x0;                 /* state when the input is applied */
+	double * ref;                /* reference, as in mpc_status */
+	double * input;              /* input to be written to the plant */
+	double * plan;               /* inputs U(0), ..., U(h_ctrl) solved */
+};
 
+/* Single-slot handoff of jobs between two stages, with no lock */
+struct mpc_ctrl_slot {
+	uint32_t full;               /* 1: job put, not taken yet (futex) */
+	uint32_t put_waiting;        /* 1: the putting stage is sleeping */
+	uint32_t take_waiting;       /* 1: the taking stage is sleeping */
+	struct mpc_ctrl_job job;
+};
 
 /*
- * Set prio priority (high number => high priority) and pin the
- * invoking process to CPU cpu_id
+ * The MPC loop, made of three stages: ingest (state taken, predicted by
+ * the delay, reference, command, event trigger), solve (local or
+ * offloaded, then the input chosen), and output (plan and input
+ * published, log). The stages run one after the other in the main
+ * thread or, if pipelined, the ingest and output stages in their own
+ * threads, so that only the solve is in the main thread.
  */
-void sched_set_prio_affinity(uint32_t prio, int cpu_id);
+struct mpc_ctrl_loop {
+	struct shared_data * data;
+	mpc_glpk * mode_mpc;         /* problem of each mode */
+	mpc_status ** mode_st;       /* status of the solver of each mode */
+	int mode_num;
+	size_t ref_size;             /* bytes of the reference */
+	size_t job_len;              /* doubles of the arrays of a job */
+	int sockfd;                  /* UDP socket to the MPC server */
+	uint64_t offload_seq;        /* seq of the last offload request */
+	struct mpc_offload_hdr * offload_buf; /* reply: header, then status */
+	size_t offload_len;          /* bytes of offload_buf */
+	mpc_sched sched;             /* of the solve stage (main thread) */
+	double spec_time;            /* last speculative solve (sec) */
+	double * local_time;         /* per mode, expected local solve (sec) */
+	int pipelined;               /* 1: ingest and output in threads */
+	mpc_sched stage_sched[2];    /* of the ingest and output stages */
+	struct mpc_ctrl_slot to_solve, to_output;
+	uint32_t jobs;               /* jobs made by the ingest stage */
+	uint32_t done;               /* jobs ended by the output stage (futex) */
+	uint32_t drain_waiting;      /* 1: ingest sleeping until done == jobs */
+	uint64_t u_seq;              /* seqlock of u_last: odd if writing */
+	double * u_last;             /* last input, written by solve stage */
+
+	/* Used by the ingest stage only */
+	int period_tau;              /* 1: MPC_WAIT_PERIODIC with period tau */
+	uint64_t state_seq;          /* seq of the last state taken */
+	double * state_rd;           /* last state taken */
+	double time_plant, time_posted;
+	int mode, prev_mode;
+	size_t skip;
+	uint32_t cmd_sent;           /* seq of the last command handed */
+
+	/* Written by the output stage only */
+	uint64_t plan_num;           /* plans published */
+#ifdef PRINT_LOG
+	char * log_rec;
+#endif
+};
 
 /*
- * Initializing the model with JSON file
+ * Allocate the arrays of the job
  */
-int model_mpc_startup(mpc_glpk * mpc, struct json_object * in);
+static void mpc_ctrl_job_alloc(const struct mpc_ctrl_loop * loop,
+			       struct mpc_ctrl_job * job);
+
+/*
+ * Copy the job src in dst, arrays included
+ */
+static void mpc_ctrl_job_copy(const struct mpc_ctrl_loop * loop,
+			      struct mpc_ctrl_job * dst,
+			      const struct mpc_ctrl_job * src);
+
+/*
+ * Wait while *word is val, as MPC waits for the state (ctrl_wait of the
+ * shared memory): by polling, by polling for ctrl_spin usec and then
+ * sleeping on the futex word, or by sleeping at once (also if
+ * periodic). The sleep is announced in *waiting. mpc_ctrl_wake sets
+ * *word to val and wakes up the stage sleeping on it, if any.
+ */
+static void mpc_ctrl_wait_while(const struct mpc_ctrl_loop * loop,
+				uint32_t * word, uint32_t val,
+				uint32_t * waiting);
+static void mpc_ctrl_wake(uint32_t * word, uint32_t val,
+			  const uint32_t * waiting);
+
+/*
+ * Wait until the output stage ended all jobs made by the ingest stage
+ */
+static void mpc_ctrl_drain(struct mpc_ctrl_loop * loop);
+
+/*
+ * Put the job in the slot, once empty, and take the job from the slot,
+ * once full. Both stages wait by mpc_ctrl_wait_while.
+ */
+static void mpc_ctrl_put(const struct mpc_ctrl_loop * loop,
+			 struct mpc_ctrl_slot * slot,
+			 const struct mpc_ctrl_job * job);
+static void mpc_ctrl_take(const struct mpc_ctrl_loop * loop,
+			  struct mpc_ctrl_slot * slot,
+			  struct mpc_ctrl_job * job);
+
+/*
+ * The stages of the MPC loop. mpc_ctrl_ingest returns -1 if there is
+ * no state yet (MPC_WAIT_PERIODIC), 0 if the job is made.
+ */
+static int mpc_ctrl_ingest(struct mpc_ctrl_loop * loop,
+			   struct mpc_ctrl_job * job);
+static void mpc_ctrl_solve(struct mpc_ctrl_loop * loop,
+			   struct mpc_ctrl_job * job);
+static void mpc_ctrl_output(struct mpc_ctrl_loop * loop,
+			    struct mpc_ctrl_job * job);
+
+/*
+ * Offload the solve of the step of job to the server, whose input is
+ * due by end (CLOCK_MONOTONIC). The reply is waited until the local
+ * solve (local_time of the mode) still fits before end or, if it does
+ * not fit anyway, until end.  Return 0 if the reply came by then
+ * (solution in the status of the mode), -1 otherwise
+ * (stats_int[MPC_STATS_INT_TIMEOUT] set, status unchanged).
+ */
+static int mpc_ctrl_offload(struct mpc_ctrl_loop * loop,
+			    const struct mpc_ctrl_job * job, double end);
+
+/*
+ * Time (sec) of CLOCK_MONOTONIC
+ */
+static double mpc_ctrl_clock(void);
+
+/*
+ * Solve ahead the next step of the mode of job, if "speculate" is in
+ * the JSON of the mode, after its input is written. It runs in the
+ * solve stage, while the next state is awaited: not after a skipped
+ * step (the next one is likely skipped too), and only until the next
+ * state is expected (one sampling period after the state of job).
+ */
+static void mpc_ctrl_speculate(struct mpc_ctrl_loop * loop,
+			       const struct mpc_ctrl_job * job);
+
+/*
+ * Threads of the ingest and output stages, if pipelined
+ */
+static void * mpc_ctrl_ingest_thread(void * arg);
+static void * mpc_ctrl_output_thread(void * arg);
+
 
 /*
  * Signal handler. This process will terminate only on Ctrl-C. It will
@@ -90,38 +275,50 @@ void term_handler(int signum);
 void seg_fault_handler(int signum);
 
 
+
 int main(int argc, char * argv[]) {
+	struct mpc_ctrl_loop loop;
+	struct mpc_ctrl_job job;
 	struct shared_data * data;
-	double * shared_state;
-	double * shared_input;
+	struct json_object * pipe_json;
+	pthread_t ingest_thread, output_thread;
 	int model_fd;
 	char * buffer;
 	ssize_t size;
-	size_t i;
+	int opt, shm_opts = 0;
 
 	struct json_object *model_json;
 	struct json_tokener * tok;
 
 	struct sigaction sa;
 
-	mpc_status * mpc_st;
-	mpc_glpk my_mpc;
+	mpc_status **mode_st;
+	mpc_glpk * my_mpc, *mode_mpc;
+	struct json_object *mode_json;
+	int mode, mode_num, k;
 	int sockfd;
 	struct sockaddr_in servaddr;
-#ifdef PRINT_PROBLEM
-	char s_sol[100] = SOL_FILENAME;
-	char tmp[100];
-#endif
-#ifdef PRINT_LOG
-	char * log_rec;
-	size_t offset_rec;
-	struct timespec after_wait, before_post;
-#define LOG_REC_SIZE (2*(30)+                   \
-		      15*data->state_num+	\
-		      15*data->input_num)	 
-#endif /* PRINT_LOG */
-	
 
+
+	/* Options before the JSON, then argv[1] is the JSON again */
+	while ((opt = getopt(argc, argv, "n:HL")) != -1) {
+		switch (opt) {
+		case 'n':
+			shm_name = optarg;
+			break;
+		case 'H':
+			shm_opts |= MPC_SHM_HUGETLB;
+			break;
+		case 'L':
+			shm_opts |= MPC_SHM_MLOCK;
+			break;
+		default:
+			PRINT_ERROR("Usage: mpc_ctrl [-n <instance>] [-H] [-L] <JSON model> [<server IP>]");
+			return -1;
+		}
+	}
+	argc -= optind-1;
+	argv += optind-1;
 	if (argc <= 1) {
 		PRINT_ERROR("Too few arguments. At least 1 needed: <JSON model>");
 		return -1;
@@ -153,63 +350,106 @@ int main(int argc, char * argv[]) {
 	sigaction(SIGTERM, &sa, NULL);
 	sigaction(SIGSEGV, &sa, NULL);
 
-	/* Pinning MPC to a fixed CPU */
-	sched_set_prio_affinity(sched_get_priority_max(SCHED_FIFO),
-				MPC_CPU_ID);
+	/* Pinning MPC to its CPUs ("ctrl_sched" of JSON, or MPC_CPU_ID) */
+	bzero(&loop, sizeof(loop));
+	mpc_sched_init(&loop.sched, MPC_CPU_ID);
+	mpc_json_sched(model_json, "ctrl_sched", &loop.sched);
+	mpc_sched_start(&loop.sched);
 
-	/* Initializing the model */
-	model_mpc_startup(&my_mpc, model_json);
+	/* Memory locked and prefaulted before building the problems */
+	mpc_sched_mem_lock();
 
- 	/* 
+	/* Initializing the model of each mode (same sizes) */
+	mode_num = mpc_json_mode_num(model_json);
+	mode_mpc = calloc((size_t)mode_num, sizeof(*mode_mpc));
+	for (mode=0; mode < mode_num; mode++) {
+		mode_json = mpc_json_mode(model_json, mode);
+		mpc_startup(mode_mpc+mode, mode_json, NULL);
+#ifdef DEBUG_SIMPLEX
+		mode_mpc[mode].param->msg_lev = GLP_MSG_DBG; /* all messages */
+#endif
+		json_object_put(mode_json);
+		if (mode_mpc[mode].model->n != mode_mpc[0].model->n ||
+		    mode_mpc[mode].model->m != mode_mpc[0].model->m ||
+		    mode_mpc[mode].model->H != mode_mpc[0].model->H ||
+		    mode_mpc[mode].h_ctrl != mode_mpc[0].h_ctrl) {
+			PRINT_ERROR("modes with different sizes");
+			exit(EXIT_FAILURE);
+		}
+	}
+	my_mpc = mode_mpc;
+	if (loop.sched.period <= 0)
+		loop.sched.period = my_mpc->model->tau;
+
+ 	/*
 	 * Shared memory is used to read state from and write input to
 	 * the  plant. Allocating  enough  space for  both the  struct
-	 * shared_data and the two arrays for state/input.
+	 * shared_data and the arrays for state/input/reference/plan.
 	 */
-	shm_id = shmget(MPC_SHM_KEY,
-			sizeof(*data)+
-			sizeof(*shared_state)*my_mpc.model->n+
-			sizeof(*shared_input)*my_mpc.model->m,
-			MPC_SHM_FLAGS | IPC_CREAT | IPC_EXCL);
-	if (shm_id == -1) {
-		PRINT_ERROR("Unable to create shared memory. Maybe key in use (try ipcs)");
+	data = mpc_shm_create(shm_name,
+			      MPC_SHM_SIZE(my_mpc->model->n, my_mpc->model->m,
+					   my_mpc->model->H, my_mpc->h_ctrl+1,
+					   MPC_RING_LEN), shm_opts);
+	if (data == NULL) {
+		PRINT_ERROR("Unable to create shared memory. Maybe instance in use (try mpc_conf -l)");
 		exit(EXIT_FAILURE);
 	}
-	data = (struct shared_data *)shmat(shm_id, NULL, 0);
-	shared_state = (double*)(data+1); /* starts just after *data */
-	shared_input = shared_state+my_mpc.model->n;
-	bzero(data, sizeof(*data)+
-	      sizeof(*shared_state)*my_mpc.model->n+
-	      sizeof(*shared_input)*my_mpc.model->m);
-	data->state_num = my_mpc.model->n;
-	data->input_num = my_mpc.model->m;
+	shm_data = data;
+	data->state_num = my_mpc->model->n;
+	data->input_num = my_mpc->model->m;
+	data->ref_len = my_mpc->model->H;
+	data->plan_len = my_mpc->h_ctrl+1;
+	data->ring_len = MPC_RING_LEN;
 	MPC_OFFLOAD_ENABLE(data);
-	
-	/* Resetting all semaphores */
-	for (i=0; i<MPC_SEM_NUM; i++) {
-		if (sem_init(data->sems+i,1,0) < 0) {
-			PRINT_ERROR("issue in sem_init");
+	data->ctrl_wait = MPC_WAIT_SPIN;
+	data->ctrl_spin = MPC_WAIT_SPIN_US;
+	mpc_json_wait(model_json, "ctrl_wait",
+		      &data->ctrl_wait, &data->ctrl_spin, &data->ctrl_period);
+	/* periodic: with the sampling period of the mode, if not given */
+	loop.period_tau = data->ctrl_period <= 0;
+	for (k=0; data->ctrl_wait == MPC_WAIT_PERIODIC && k < mode_num; k++) {
+		if (mpc_ctrl_period_set(data, loop.period_tau ?
+					mode_mpc[k].model->tau :
+					data->ctrl_period) != 0) {
+			PRINT_ERROR("periodic wait needs a positive period (or sampling_period of all modes)");
 			exit(EXIT_FAILURE);
 		}
 	}
-	
+
 #ifdef PRINT_PROBLEM
-	glp_print_sol(my_mpc.op, "000glpk_sol.txt");
+	glp_print_sol(my_mpc->op, "000glpk_sol.txt");
 #endif
 
 	/* Allocating struct of solver status after problem defined */
-	mpc_st = mpc_status_alloc(&my_mpc);
-	  
+	mode_st = calloc((size_t)mode_num, sizeof(*mode_st));
+	for (k=0; k < mode_num; k++) {
+		mode_st[k] = mpc_status_alloc(mode_mpc+k);
+	}
+
+	/*
+	 * Dry step of each mode: no page fault at the first real steps,
+	 * and a first estimate of its local solve
+	 */
+	loop.local_time = calloc((size_t)mode_num, sizeof(*loop.local_time));
+	for (k=0; k < mode_num; k++) {
+		loop.local_time[k] = mpc_ctrl_clock();
+		mpc_prefault(mode_mpc+k, mode_st[k]);
+		loop.local_time[k] = mpc_ctrl_clock()-loop.local_time[k];
+	}
+	mpc_sched_faults(&loop.sched, data->stats_int+MPC_STATS_INT_MINFLT,
+			 data->stats_int+MPC_STATS_INT_MAJFLT);
+
 #ifdef PRINT_PROBLEM
 	/* Save initial status */
-	mpc_status_save(&my_mpc, mpc_st);
+	mpc_status_save(my_mpc, mode_st[0]);
 	fprintf(stdout, "Initial status\n");
-	mpc_status_fprintf(stdout, &my_mpc, mpc_st);
- 	glp_write_lp(my_mpc.op, NULL, "initial_mpc.txt");
-	glp_print_sol(my_mpc.op, "initial_sol.txt");
+	mpc_status_fprintf(stdout, my_mpc, mode_st[0]);
+ 	glp_write_lp(my_mpc->op, NULL, "initial_mpc.txt");
+	glp_print_sol(my_mpc->op, "initial_sol.txt");
 #endif
 
 	/* Setting up the socket to server */
-	bzero(&servaddr, sizeof(servaddr)); 
+	bzero(&servaddr, sizeof(servaddr));
 	if (argc >= 3) {
 		/* using command-line arg as IP address */
 		servaddr.sin_addr.s_addr = inet_addr(argv[2]);
@@ -223,208 +463,629 @@ int main(int argc, char * argv[]) {
 	}
 	servaddr.sin_port = htons(MPC_SOLVER_PORT);
 	servaddr.sin_family = AF_INET;
-      
+
 	/* create and connect UPD socket */
-	sockfd = socket(AF_INET, SOCK_DGRAM, 0); 
+	sockfd = socket(AF_INET, SOCK_DGRAM, 0);
 	if(connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
 		PRINT_ERROR("client: error in connect");
 
+	/* The loop and its stages */
+	loop.data = data;
+	loop.mode_mpc = mode_mpc;
+	loop.mode_st = mode_st;
+	loop.mode_num = mode_num;
+	loop.sockfd = sockfd;
+	/* replies received apart, in the largest status of the modes */
+	for (k=0; k < mode_num; k++) {
+		if (mode_st[k]->size > loop.offload_len)
+			loop.offload_len = mode_st[k]->size;
+	}
+	loop.offload_len += sizeof(*loop.offload_buf);
+	loop.offload_buf = malloc(loop.offload_len);
+	loop.ref_size = sizeof(double)*(data->ref_len*data->state_num+
+					data->plan_len*data->input_num);
+	loop.job_len = 2*data->state_num+loop.ref_size/sizeof(double)+
+		(1+data->plan_len)*data->input_num;
+	loop.state_rd = calloc(data->state_num, sizeof(*loop.state_rd));
+	loop.u_last = calloc(data->input_num, sizeof(*loop.u_last));
 #ifdef PRINT_LOG
-	log_rec = malloc(LOG_REC_SIZE);
-	bzero(log_rec, LOG_REC_SIZE);
+	loop.log_rec = malloc(LOG_REC_SIZE(data));
+	bzero(loop.log_rec, LOG_REC_SIZE(data));
 #endif
+	mpc_ctrl_job_alloc(&loop, &job);
+	if (json_object_object_get_ex(model_json, "ctrl_pipeline",
+				      &pipe_json)) {
+		/* Stages in their threads, not pinned if not in JSON */
+		loop.pipelined = 1;
+		mpc_ctrl_job_alloc(&loop, &loop.to_solve.job);
+		mpc_ctrl_job_alloc(&loop, &loop.to_output.job);
+		for (k=0; k < 2; k++) {
+			mpc_sched_init(loop.stage_sched+k, -1);
+			loop.stage_sched[k].policy = MPC_SCHED_OTHER;
+		}
+		mpc_json_sched(pipe_json, "ingest", loop.stage_sched);
+		mpc_json_sched(pipe_json, "output", loop.stage_sched+1);
+		if (pthread_create(&ingest_thread, NULL,
+				   mpc_ctrl_ingest_thread, &loop) != 0 ||
+		    pthread_create(&output_thread, NULL,
+				   mpc_ctrl_output_thread, &loop) != 0) {
+			PRINT_ERROR("Unable to create the threads of stages");
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	/* 
+	/*
 	 * Cycling forever to get the state of the plant. Ctrl-C will
 	 * terminate
 	 */
 	while (1) {
-		/* Blocked until the system wrote the state in shared_state */
-		sem_wait(data->sems+MPC_SEM_STATE_WRITTEN);
-		clock_gettime(CLOCK_REALTIME, &after_wait);
+		if (loop.pipelined)
+			mpc_ctrl_take(&loop, &loop.to_solve, &job);
+		else if (mpc_ctrl_ingest(&loop, &job) != 0)
+			continue;
+		mpc_ctrl_solve(&loop, &job);
+		if (loop.pipelined)
+			mpc_ctrl_put(&loop, &loop.to_output, &job);
+		else
+			mpc_ctrl_output(&loop, &job);
+		mpc_ctrl_speculate(&loop, &job);
+	}
+}
+
+/*
+ * Allocate the arrays of a job, in one block
+ */
+static void mpc_ctrl_job_point(const struct mpc_ctrl_loop * loop,
+			       struct mpc_ctrl_job * job, double * block)
+{
+	job->state = block;
+	job->x0 = job->state+loop->data->state_num;
+	job->ref = job->x0+loop->data->state_num;
+	job->input = job->ref+loop->ref_size/sizeof(double);
+	job->plan = job->input+loop->data->input_num;
+}
+
+static void mpc_ctrl_job_alloc(const struct mpc_ctrl_loop * loop,
+			       struct mpc_ctrl_job * job)
+{
+	bzero(job, sizeof(*job));
+	mpc_ctrl_job_point(loop, job, calloc(loop->job_len, sizeof(double)));
+}
+
+static void mpc_ctrl_job_copy(const struct mpc_ctrl_loop * loop,
+			      struct mpc_ctrl_job * dst,
+			      const struct mpc_ctrl_job * src)
+{
+	double * block = dst->state;
+
+	memcpy(block, src->state, sizeof(double)*loop->job_len);
+	*dst = *src;
+	mpc_ctrl_job_point(loop, dst, block);
+}
+
+/*
+ * Bounded spin, then futex sleep
+ */
+static void mpc_ctrl_wait_while(const struct mpc_ctrl_loop * loop,
+				uint32_t * word, uint32_t val,
+				uint32_t * waiting)
+{
+	struct shared_data * data = loop->data;
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (1) {
+		__sync_synchronize();
+		if (*word != val)
+			return;
+		if (data->ctrl_wait == MPC_WAIT_POLL)
+			continue;
+		if (data->ctrl_wait == MPC_WAIT_SPIN) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if ((double)(now.tv_sec-start.tv_sec)+
+			    (double)(now.tv_nsec-start.tv_nsec)*1e-9 <
+			    data->ctrl_spin*1e-6)
+				continue;
+		}
+		/* Announce the sleep, then check again before it */
+		*waiting = 1;
+		__sync_synchronize();
+		if (*word == val)
+			mpc_futex_wait(word, val, 0);
+		*waiting = 0;
+	}
+}
 
-		/* Store the lastest solver status in mpc_st */
+static void mpc_ctrl_wake(uint32_t * word, uint32_t val,
+			  const uint32_t * waiting)
+{
+	*word = val;
+	__sync_synchronize();
+	if (*waiting)
+		mpc_futex_wake(word);
+}
+
+/*
+ * Wait for the jobs in the pipeline
+ */
+static void mpc_ctrl_drain(struct mpc_ctrl_loop * loop)
+{
+	uint32_t done;
+
+	while ((done = loop->done) != loop->jobs)
+		mpc_ctrl_wait_while(loop, &loop->done, done,
+				    &loop->drain_waiting);
+}
+
+/*
+ * Handoff of a job between stages
+ */
+static void mpc_ctrl_put(const struct mpc_ctrl_loop * loop,
+			 struct mpc_ctrl_slot * slot,
+			 const struct mpc_ctrl_job * job)
+{
+	mpc_ctrl_wait_while(loop, &slot->full, 1, &slot->put_waiting);
+	mpc_ctrl_job_copy(loop, &slot->job, job);
+	__sync_synchronize();
+	mpc_ctrl_wake(&slot->full, 1, &slot->take_waiting);
+}
+
+static void mpc_ctrl_take(const struct mpc_ctrl_loop * loop,
+			  struct mpc_ctrl_slot * slot,
+			  struct mpc_ctrl_job * job)
+{
+	mpc_ctrl_wait_while(loop, &slot->full, 0, &slot->take_waiting);
+	mpc_ctrl_job_copy(loop, job, &slot->job);
+	__sync_synchronize();
+	mpc_ctrl_wake(&slot->full, 0, &slot->put_waiting);
+}
+
+/*
+ * Ingest stage: state, prediction by the delay, reference, command,
+ * event trigger
+ */
+static int mpc_ctrl_ingest(struct mpc_ctrl_loop * loop,
+			   struct mpc_ctrl_job * job)
+{
+	struct shared_data * data = loop->data;
+	mpc_glpk * my_mpc;
+	struct timespec state_time;
+	uint64_t seq;
+
+	/* The last command must be applied before using the model */
+	if (data->cmd_ack != loop->cmd_sent)
+		mpc_ctrl_drain(loop);
+
+	/*
+	 * Waiting until the plant wrote a new state (the newest),
+	 * or until the release if periodic (then the last state is
+	 * used again, if no new one)
+	 */
+	if (loop->period_tau)
+		mpc_ctrl_period_set(data, loop->mode_mpc[loop->mode].model->tau);
+	seq = mpc_ctrl_state_wait(data, loop->state_rd,
+				  &loop->time_plant, &loop->time_posted);
+	if (seq != 0)
+		loop->state_seq = seq;
+	else if (loop->state_seq == 0)
+		return -1; /* periodic, no state written yet */
+	clock_gettime(CLOCK_REALTIME, &job->after_wait);
+	clock_gettime(CLOCK_MONOTONIC, &state_time);
+
+	/* Switching to the mode requested by the plant, if any */
+	if (data->mode < (uint32_t)loop->mode_num)
+		loop->mode = (int)data->mode;
+	my_mpc = loop->mode_mpc+loop->mode;
+	data->stats_int[MPC_STATS_INT_MODE] = loop->mode;
+	job->mode = loop->mode;
+	job->state_seq = loop->state_seq;
+	memcpy(job->state, loop->state_rd, sizeof(double)*data->state_num);
+	memcpy(job->x0, loop->state_rd, sizeof(double)*data->state_num);
+
+	/* Last input written (by the solve stage), being applied */
+	do {
+		seq = loop->u_seq;
+		__sync_synchronize();
+		memcpy(job->input, loop->u_last,
+		       sizeof(double)*data->input_num);
+		__sync_synchronize();
+	} while ((seq & 1) || loop->u_seq != seq);
+
+	/* Predicting the state when the input will be applied */
+	job->time_wake = (double)state_time.tv_sec+
+		(double)state_time.tv_nsec*1e-9;
+	job->time_x0 = mpc_step_ingest(data, my_mpc, job->x0, job->input,
+				       job->ref, job->time_wake,
+				       loop->time_plant, loop->time_posted);
+	job->cmd_new = mpc_step_cmd_read(data, job->cmd, job->cmd_val);
+	if (job->cmd_new) {
+		loop->cmd_sent = job->cmd[MPC_CMD_SEQ];
+		/* applied when no other stage uses the model */
+		mpc_ctrl_drain(loop);
+	}
+
+	/*
+	 * Event trigger: if the state is close to the one predicted
+	 * by the last plan, then its next input is applied without
+	 * solving. As X(0) of the plan, the state compared is the one
+	 * predicted by the delay. Any change of mode or command forces
+	 * a solve, and so does a plan still to be published.
+	 */
+	if (loop->done == loop->jobs && loop->plan_num > 0 &&
+	    job->mode == loop->prev_mode && !job->cmd_new &&
+	    mpc_step_trigger(data, my_mpc, job->x0, loop->skip)) {
+		loop->skip++;
+	} else {
+		loop->skip = 0;
+	}
+	loop->prev_mode = job->mode;
+	job->skip = loop->skip;
+	data->stats_int[MPC_STATS_INT_SKIP] = job->skip > 0;
+	loop->jobs++;
+	return 0;
+}
+
+/*
+ * Solve stage: local or offloaded solve, then the input to be written
+ */
+static void mpc_ctrl_solve(struct mpc_ctrl_loop * loop,
+			   struct mpc_ctrl_job * job)
+{
+	struct shared_data * data = loop->data;
+	mpc_glpk * my_mpc = loop->mode_mpc+job->mode;
+	mpc_status * mpc_st = loop->mode_st[job->mode];
+	size_t m = data->input_num;
+	int k, spec_hit, cmd_err, tm_lim;
+	double end, t;
+#ifdef PRINT_PROBLEM
+	char s_sol[100] = SOL_FILENAME;
+	char tmp[100];
+#endif
+
+	/* input due within the sampling period, or deadline of fallback */
+	end = my_mpc->model->tau > 0 ?
+		my_mpc->model->tau : MPC_OFFLOAD_TIMEOUT;
+	if (my_mpc->K_fb != NULL && my_mpc->fb_deadline < end)
+		end = my_mpc->fb_deadline;
+	end += mpc_ctrl_clock();
+
+	/*
+	 * Speculated solve of this step valid, if x0 as predicted with
+	 * the same reference and no command since then
+	 */
+	spec_hit = job->skip == 0 && !job->cmd_new &&
+		memcmp(mpc_st->ref, job->ref, loop->ref_size) == 0 &&
+		mpc_speculate_hit(my_mpc, job->x0);
+	for (k=0; k < loop->mode_num; k++) {
+		loop->mode_mpc[k].spec_valid = 0;
+	}
+	data->stats_int[MPC_STATS_INT_SPEC] = spec_hit;
+	data->stats_int[MPC_STATS_INT_TIMEOUT] = 0;
+
+	/* Store the lastest solver status in mpc_st */
 #ifndef MPC_STATUS_X0_ONLY
-		mpc_status_save(&my_mpc, mpc_st);
-		*mpc_st->steps_bdg = INT_MAX;  /* max iterations */
-		*mpc_st->time_bdg = INT_MAX;   /* max seconds */
-		/* Setting the status of cur solution */
-		*mpc_st->prim_stat = GLP_INFEAS;
-		*mpc_st->dual_stat = GLP_FEAS;
+	mpc_status_save(my_mpc, mpc_st);
+	*mpc_st->steps_bdg = INT_MAX;  /* max iterations */
+	*mpc_st->time_bdg = INT_MAX;   /* max seconds */
+	/* Setting the status of cur solution */
+	*mpc_st->prim_stat = GLP_INFEAS;
+	*mpc_st->dual_stat = GLP_FEAS;
 #endif /* MPC_STATUS_X0_ONLY */
-		memcpy(mpc_st->state, shared_state,
-		       sizeof(*shared_state)*data->state_num);
-		if (data->flags & MPC_OFFLOAD) {
-			/* MPC offloaded to server */
-			data->stats_int[MPC_STATS_INT_OFFLOAD] = 1;
-			
-			/* Sending/receiving status to/from server */
-			send(sockfd, mpc_st->block, mpc_st->size, 0);
-			recv(sockfd, mpc_st->block, mpc_st->size, 0);
-			/* 
-			 * After recv, the optimal input found by the
-			 * server is saved in mpc_st->input
-			 */
+	memcpy(mpc_st->state, job->x0, sizeof(double)*data->state_num);
+	memcpy(mpc_st->ref, job->ref, loop->ref_size);
+	if (job->cmd_new) {
+		/* a tau not valid for some mode is applied to none */
+		cmd_err = !mpc_step_cmd_valid(loop->mode_mpc,
+					      (size_t)loop->mode_num,
+					      job->cmd, job->cmd_val);
+		/* local MPC of all modes updated, server by status */
+		for (k=0; !cmd_err && k < loop->mode_num; k++) {
+			memcpy(loop->mode_st[k]->cmd, job->cmd,
+			       sizeof(*job->cmd)*MPC_CMD_LEN);
+			memcpy(loop->mode_st[k]->cmd_val, job->cmd_val,
+			       sizeof(job->cmd_val));
+			mpc_status_cmd_apply(loop->mode_mpc+k,
+					     loop->mode_st[k]);
+		}
+		mpc_step_cmd_ack(data, job->cmd[MPC_CMD_SEQ], cmd_err);
+	}
+	/* last applied input, to bound the input rate */
+	if (!spec_hit)
+		memcpy(mpc_st->input, loop->u_last, sizeof(double)*m);
+	if (job->skip > 0) {
+		/* next input of the last plan, nothing to solve */
+	} else if (spec_hit) {
+		/* solved ahead: the solution is in mpc_st already */
+		data->stats_int[MPC_STATS_INT_OFFLOAD] = 0;
+	} else if ((data->flags & MPC_OFFLOAD) &&
+		   mpc_ctrl_offload(loop, job, end) == 0) {
+		/*
+		 * MPC offloaded to server: the optimal input found by
+		 * the server is saved in mpc_st->input
+		 */
+		data->stats_int[MPC_STATS_INT_OFFLOAD] = 1;
 #ifdef PRINT_PROBLEM
-			sprintf(tmp, "%02luA", k);
-			strcat(tmp, s_sol);
-			glp_print_sol(my_mpc.op, tmp);
+		sprintf(tmp, "%02luA", (unsigned long)job->state_seq);
+		strcat(tmp, s_sol);
+		glp_print_sol(my_mpc->op, tmp);
 #endif
-		} else {
-			/* MPC runs locally */
-			data->stats_int[MPC_STATS_INT_OFFLOAD] = 0;
+	} else if ((data->flags & MPC_OFFLOAD) && my_mpc->K_fb != NULL &&
+		   mpc_ctrl_clock()+loop->local_time[job->mode] > end) {
+		/* no reply, no time to solve locally: fallback law */
+		data->stats_int[MPC_STATS_INT_OFFLOAD] = 0;
+		*mpc_st->sol_stat = MPC_SOL_INFEAS;
+	} else {
+		/*
+		 * MPC runs locally (warm from the speculated basis, if
+		 * any), also if the server did not reply: then within the
+		 * time left
+		 */
+		data->stats_int[MPC_STATS_INT_OFFLOAD] = 0;
 #ifdef PRINT_PROBLEM
-			sprintf(tmp, "%02luB", k);
-			strcat(tmp, s_sol);
-			glp_print_sol(my_mpc.op, tmp);
+		sprintf(tmp, "%02luB", (unsigned long)job->state_seq);
+		strcat(tmp, s_sol);
+		glp_print_sol(my_mpc->op, tmp);
 #endif
 #ifndef MPC_STATUS_X0_ONLY
-			mpc_status_resume(&my_mpc, mpc_st);
+		mpc_status_resume(my_mpc, mpc_st);
 #else
-			/* update initial state */
-			mpc_status_set_x0(&my_mpc, mpc_st);
+		/* update initial state */
+		mpc_status_set_x0(my_mpc, mpc_st);
 #endif /* MPC_STATUS_X0_ONLY */
-			glp_simplex(my_mpc.op, my_mpc.param);
-			mpc_status_save(&my_mpc, mpc_st);
-		}
-		clock_gettime(CLOCK_REALTIME, &before_post);
-		data->stats_dbl[MPC_STATS_DBL_TIME] =
-			(double)(before_post.tv_sec-after_wait.tv_sec);
-		data->stats_dbl[MPC_STATS_DBL_TIME] +=
-			((double)(before_post.tv_nsec-after_wait.tv_nsec))*1e-9;
+		t = mpc_ctrl_clock();
+		tm_lim = my_mpc->param->tm_lim;
+		if (data->flags & MPC_OFFLOAD)
+			my_mpc->param->tm_lim = GSL_MIN(tm_lim,
+				GSL_MAX(1, (int)((end-t)*1e3)));
+		mpc_optimize(my_mpc);
+		my_mpc->param->tm_lim = tm_lim;
+		mpc_status_save(my_mpc, mpc_st);
+		/* slower solves at once, faster ones slowly */
+		t = mpc_ctrl_clock()-t;
+		if (t > loop->local_time[job->mode])
+			loop->local_time[job->mode] = t;
+		else
+			loop->local_time[job->mode] += LOCAL_TIME_DECAY*
+				(t-loop->local_time[job->mode]);
+	}
+	clock_gettime(CLOCK_REALTIME, &job->before_post);
+	data->stats_dbl[MPC_STATS_DBL_TIME] =
+		(double)(job->before_post.tv_sec-job->after_wait.tv_sec);
+	data->stats_dbl[MPC_STATS_DBL_TIME] +=
+		((double)(job->before_post.tv_nsec-job->after_wait.tv_nsec))*1e-9;
+	if (job->skip == 0) {
+		/* solve delay expected at the next step */
+		mpc_delay_update(my_mpc,
+				 data->stats_dbl[MPC_STATS_DBL_TIME]);
+		data->stats_int[MPC_STATS_INT_SOL] = *mpc_st->sol_stat;
+		/* to SCHED_DEADLINE, if so, after the profile */
+		mpc_sched_profile(&loop->sched,
+				  data->stats_dbl[MPC_STATS_DBL_TIME]+
+				  loop->spec_time);
+	}
+
+	/*
+	 * Input to be written: of the plan, if skipping, or solved. If no
+	 * solution, the fallback law is used or the last valid input
+	 * stays there.
+	 */
+	memcpy(job->input, loop->u_last, sizeof(double)*m);
+	job->plan_new = mpc_step_input(data, my_mpc, mpc_st, job->skip,
+				       job->input);
+	if (job->plan_new)
+		memcpy(job->plan, mpc_st->input,
+		       sizeof(double)*data->plan_len*m);
+	loop->u_seq++; /* odd: being written */
+	__sync_synchronize();
+	memcpy(loop->u_last, job->input, sizeof(double)*m);
+	__sync_synchronize();
+	loop->u_seq++;
+	mpc_sched_faults(&loop->sched, data->stats_int+MPC_STATS_INT_MINFLT,
+			 data->stats_int+MPC_STATS_INT_MAJFLT);
 
 #ifdef PRINT_PROBLEM
-		sprintf(tmp, "%02luC", k);
-		strcat(tmp, s_sol);
-		glp_print_sol(my_mpc.op, tmp);
-		mpc_status_save(&my_mpc, mpc_st);
-		mpc_status_fprintf(stdout, &my_mpc, mpc_st);
+	sprintf(tmp, "%02luC", (unsigned long)job->state_seq);
+	strcat(tmp, s_sol);
+	glp_print_sol(my_mpc->op, tmp);
+	mpc_status_save(my_mpc, mpc_st);
+	mpc_status_fprintf(stdout, my_mpc, mpc_st);
+#endif
+}
+
+/*
+ * Output stage: plan and input published, log
+ */
+static void mpc_ctrl_output(struct mpc_ctrl_loop * loop,
+			    struct mpc_ctrl_job * job)
+{
+	struct shared_data * data = loop->data;
+#ifdef PRINT_LOG
+	size_t i, offset_rec;
 #endif
 
-		/* Write solution and stats to shared mem and let the plant know */
-		memcpy(shared_input, mpc_st->input,
-		       sizeof(*shared_state)*data->input_num);
-		/* FIXME: add writing stats */
-		sem_post(data->sems+MPC_SEM_INPUT_WRITTEN);
+	/* Publishing the full plan (if new) in the buffer not in use */
+	if (job->plan_new)
+		mpc_step_plan_publish(data, loop->mode_mpc+job->mode,
+				      ++loop->plan_num, job->time_x0,
+				      job->x0, job->plan);
+
+	/* Write the input to shared mem and let the plant know */
+	mpc_ctrl_input_write(data, job->input, job->state_seq);
+	__sync_synchronize();
+	mpc_ctrl_wake(&loop->done, loop->done+1, &loop->drain_waiting);
 #ifdef PRINT_LOG
-		offset_rec = 0;
-		offset_rec += snprintf(log_rec+offset_rec,
-				       (LOG_REC_SIZE)-offset_rec,
-				       "%ld.%09ld,%ld.%09ld,",
-				       after_wait.tv_sec, after_wait.tv_nsec,
-				       before_post.tv_sec, before_post.tv_nsec);
-		for (i=0; i<data->state_num ; i++) {
-			offset_rec += snprintf(log_rec+offset_rec,
-					       (LOG_REC_SIZE)-offset_rec,
-					       "%6.3f,", shared_state[i]);
-		}
-		for (i=0; i<data->input_num ; i++) {
-			offset_rec += snprintf(log_rec+offset_rec,
-					       (LOG_REC_SIZE)-offset_rec,
-					       "%6.3f,", shared_input[i]);
-		}
-		printf("%s\n", log_rec);
+	offset_rec = 0;
+	offset_rec += snprintf(loop->log_rec+offset_rec,
+			       LOG_REC_SIZE(data)-offset_rec,
+			       "%ld.%09ld,%ld.%09ld,",
+			       job->after_wait.tv_sec, job->after_wait.tv_nsec,
+			       job->before_post.tv_sec, job->before_post.tv_nsec);
+	for (i=0; i<data->state_num ; i++) {
+		offset_rec += snprintf(loop->log_rec+offset_rec,
+				       LOG_REC_SIZE(data)-offset_rec,
+				       "%6.3f,", job->state[i]);
+	}
+	for (i=0; i<data->input_num ; i++) {
+		offset_rec += snprintf(loop->log_rec+offset_rec,
+				       LOG_REC_SIZE(data)-offset_rec,
+				       "%6.3f,", job->input[i]);
+	}
+	printf("%s\n", loop->log_rec);
 #endif /* PRINT_LOG */
+}
+
+/*
+ * Request to the server, reply waited until the deadline
+ */
+static int mpc_ctrl_offload(struct mpc_ctrl_loop * loop,
+			    const struct mpc_ctrl_job * job, double end)
+{
+	mpc_glpk * my_mpc = loop->mode_mpc+job->mode;
+	mpc_status * mpc_st = loop->mode_st[job->mode];
+	struct mpc_offload_hdr hdr, *rep = loop->offload_buf;
+	struct iovec req[2];
+	struct pollfd pfd;
+	struct timespec left;
+	double deadline, wait;
+	ssize_t len;
+
+	/* all settings, in case the server missed some commands */
+	mpc_status_conf_save(my_mpc, mpc_st);
+	hdr.version = MPC_OFFLOAD_VERSION;
+	hdr.model_id = my_mpc->model_id;
+	hdr.mode = (uint32_t)job->mode;
+	hdr.reserved = 0;
+	hdr.seq = ++loop->offload_seq;
+	hdr.time_sent = mpc_ctrl_clock();
+
+	/* time left for the local solve, if it may end by then */
+	deadline = end-loop->local_time[job->mode];
+	if (deadline <= hdr.time_sent)
+		deadline = end;
+	req[0].iov_base = &hdr;
+	req[0].iov_len = sizeof(hdr);
+	req[1].iov_base = mpc_st->block;
+	req[1].iov_len = mpc_st->size;
+	if (writev(loop->sockfd, req, 2) < 0)
+		PRINT_ERROR("client: error in sending the request");
+
+	pfd.fd = loop->sockfd;
+	pfd.events = POLLIN;
+	while (1) {
+		wait = deadline-mpc_ctrl_clock();
+		if (wait <= 0)
+			break;
+		left.tv_sec = (time_t)wait;
+		left.tv_nsec = (long)((wait-(double)left.tv_sec)*1e9);
+		if (ppoll(&pfd, 1, &left, NULL) <= 0)
+			continue; /* deadline checked again */
+		len = recv(loop->sockfd, rep, loop->offload_len, MSG_DONTWAIT);
+		/* replies of other requests (late, duplicated) discarded */
+		if (len != (ssize_t)(sizeof(*rep)+mpc_st->size) ||
+		    rep->version != MPC_OFFLOAD_VERSION ||
+		    rep->model_id != hdr.model_id || rep->mode != hdr.mode ||
+		    rep->seq != hdr.seq)
+			continue;
+		memcpy(mpc_st->block, rep+1, mpc_st->size);
+		return 0;
 	}
+	/* no reply by the deadline */
+	loop->data->stats_int[MPC_STATS_INT_TIMEOUT] = 1;
+	return -1;
 }
 
-	
-int model_mpc_startup(mpc_glpk * mpc, struct json_object * in)
+/*
+ * Time (sec) of CLOCK_MONOTONIC
+ */
+static double mpc_ctrl_clock(void)
 {
-	/* Cleanup the MPC struct */
-	bzero(mpc,sizeof(*mpc));
-	
-	/* Init the solver control parameters */
-	mpc->param = malloc(sizeof(*(mpc->param)));
-	glp_init_smcp(mpc->param);
-#ifdef DEBUG_SIMPLEX
-	mpc->param->msg_lev = GLP_MSG_DBG; /* all messages */
-#else
-	mpc->param->msg_lev = GLP_MSG_OFF; /* no message */
-#endif
-	mpc->param->meth    = GLP_DUAL;    /* dual simplex */
-	mpc->param->it_lim  = INT_MAX;     /* max num of iterations */
+	struct timespec now;
 
-	/* Initialize the plant */
-	mpc->model = malloc(sizeof(*(mpc->model)));
-	dyn_init_discrete(mpc->model, in);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec+(double)now.tv_nsec*1e-9;
+}
 
-	/* Setting up a GLPK problem instance */
-	mpc->op = glp_create_prob();
-	glp_set_prob_name(mpc->op, "Model Predictive Control");
+/*
+ * Speculative solve of the next step
+ */
+static void mpc_ctrl_speculate(struct mpc_ctrl_loop * loop,
+			       const struct mpc_ctrl_job * job)
+{
+	mpc_glpk * my_mpc = loop->mode_mpc+job->mode;
+	struct timespec start, end;
+	double slack;
 
-	/* Setting up variables and bounds of control inputs */
-	mpc_input_addvar(mpc, in);
-	mpc_input_set_bnds(mpc, in);
+	/* the server solves, if offloaded; skips come in runs */
+	loop->spec_time = 0;
+	if (!my_mpc->spec || (loop->data->flags & MPC_OFFLOAD) ||
+	    job->skip > 0)
+		return;
+	slack = my_mpc->model->tau > 0 ?
+		job->time_wake+my_mpc->model->tau-mpc_ctrl_clock() : INFINITY;
+	clock_gettime(CLOCK_REALTIME, &start);
+	if (mpc_speculate(my_mpc, loop->mode_st[job->mode], job->x0,
+			  job->input, slack) != 0)
+		return;
+	clock_gettime(CLOCK_REALTIME, &end);
+	/* also in the runtime of SCHED_DEADLINE, if profiled */
+	loop->spec_time = (double)(end.tv_sec-start.tv_sec)+
+		(double)(end.tv_nsec-start.tv_nsec)*1e-9;
+}
 
-	/* Setting up constraints: bounding input variation */
-	/*	mpc_input_set_delta(mpc, in); */
+/*
+ * Threads of the stages, if pipelined
+ */
+static void * mpc_ctrl_ingest_thread(void * arg)
+{
+	struct mpc_ctrl_loop * loop = arg;
+	struct mpc_ctrl_job job;
 
-	/* Add a variable for each norm of states X(1), ..., X(H)*/
-	mpc_state_norm_addvar(mpc, in);
-	
-	/* Setting bounds to the states X(1), ..., X(H)*/
-	mpc_state_set_bnds(mpc, in);
-	
-	/* Set a minimization cost for the MPC */
-	mpc_goal_set(mpc, in);
+	mpc_sched_start(loop->stage_sched);
+	mpc_ctrl_job_alloc(loop, &job);
+	while (1) {
+		/* state taken when the solve stage is ready for it */
+		mpc_ctrl_wait_while(loop, &loop->to_solve.full, 1,
+				    &loop->to_solve.put_waiting);
+		if (mpc_ctrl_ingest(loop, &job) == 0)
+			mpc_ctrl_put(loop, &loop->to_solve, &job);
+	}
+	return NULL;
+}
 
-	mpc_warmup(mpc);
+static void * mpc_ctrl_output_thread(void * arg)
+{
+	struct mpc_ctrl_loop * loop = arg;
+	struct mpc_ctrl_job job;
 
-	return 0;
+	mpc_sched_start(loop->stage_sched+1);
+	mpc_ctrl_job_alloc(loop, &job);
+	while (1) {
+		mpc_ctrl_take(loop, &loop->to_output, &job);
+		mpc_ctrl_output(loop, &job);
+	}
+	return NULL;
 }
 
+
+
 void term_handler(int signum)
 {
-	/* Removing shared memory object */
-	shmctl(shm_id, IPC_RMID, NULL);
+	/* Removing shared memory object, if created by us */
+	if (shm_data != NULL)
+		mpc_shm_remove(shm_name, shm_data);
 	switch (signum) {
 	case SIGINT:
-		printf("Got SIGINT (Ctrl-C). Removed IPC object with key %X\n",
-		       MPC_SHM_KEY);
+		printf("Got SIGINT (Ctrl-C). Removed shared memory of instance %s\n",
+		       shm_name);
 		exit(0);
 	case SIGHUP:
 	case SIGPIPE:
 	case SIGTERM:
 	case SIGSEGV:
 		fprintf(stderr,
-			"Got unexpected terminating signal %d. Still removing IPC object with key %X\n",
+			"Got unexpected terminating signal %d. Still removing shared memory of instance %s\n",
 			signum,
-			MPC_SHM_KEY);
-		exit(-1);
-	}
-}
-
-void sched_set_prio_affinity(uint32_t prio, int cpu_id)
-{
-	cpu_set_t  mask;
-
-	/* Set CPU affinity */
-	CPU_ZERO(&mask);
-	CPU_SET(cpu_id, &mask);
-	if (sched_setaffinity(0, sizeof(mask), &mask) != 0) {
-		PRINT_ERROR("sched_setaffinity");
+			shm_name);
 		exit(-1);
 	}
-
-	/* Set priority */
-#if SCHED_SETATTR_IN_SCHED_H
-	/* EB: TO BE TESTED */
-	struct sched_attr attr;
-	
-	bzero(&attr, sizeof(attr));
-	attr.size = sizeof(attr);
-	attr.sched_policy = SCHED_FIFO;
-	attr.sched_priority = prio;
-	if (sched_setattr(0, &attr, 0) != 0) {
-		PRINT_ERROR("sched_setattr");
-		exit(-1);
-	}
-#else
-	char launched[STRLEN_COMMAND];  /* String with launched command */
-
-	snprintf(launched, STRLEN_COMMAND,
-		 "sudo chrt -f -p %d %d", prio, getpid());
-	system(launched);
-#endif
 }
@@ -0,0 +1,343 @@
+/*
+ * mpc_daemon.c
+ *
+ * MPC daemon serving several plants, each through its own shared
+ * memory (channel). Each channel is served by a worker thread pinned
+ * to a CPU, with its own MPC problem.  Channels with the same model
+ * file share the parsed JSON and the plant dynamics (dyn_plant), which
+ * are read-only.  It must be initialized with a JSON configuration
+ * passed as first parameter (argv[1]), such as
+ *
+ *   {
+ *     "model": "uav.json",
+ *     "shm_hugetlb": false,
+ *     "shm_mlock": true,
+ *     "channels": [
+ *       {"name": "uav1", "cpu": 2},
+ *       {"name": "uav2", "cpu": 3},
+ *       {"name": "ugv1", "cpu": 4, "model": "ugv.json"},
+ *       {"name": "ugv2", "sched": {"policy": "deadline", "cpus": "5"}}
+ *     ]
+ *   }
+ *
+ * where "model" of a channel overrides the one of the root, "name" is
+ * the instance of the shared memory (see mpc_interface.h), and "cpu"
+ * is the CPU of its worker, at the max SCHED_FIFO priority. The
+ * optional "sched" overrides it, as "ctrl_sched" of mpc_ctrl (see
+ * mpc_json_sched in mpc.h).  Each channel is equivalent to an mpc_ctrl
+ * always solving locally, with the first mode only, and the same step
+ * (see mpc_step.h). The sampling period of a shared model cannot be
+ * changed by commands. If the setup of a worker fails, the daemon
+ * exits with an error.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <json-c/json.h>
+#include "mpc_interface.h"
+#include "mpc_plant.h"
+#include "mpc_sched.h"
+#include "mpc.h"
+#include "mpc_step.h"
+
+/* Put this macro where debugging is needed */
+#define PRINT_ERROR(x) {fprintf(stderr, "%s:%d errno=%i, %s\n",	\
+				__FILE__, __LINE__, errno, (x));}
+
+/* A model, possibly shared by several channels */
+struct mpc_daemon_model {
+	const char * file;           /* JSON file of the model */
+	struct json_object * json;   /* JSON of the model (first mode) */
+	dyn_plant * plant;           /* dynamics, read-only */
+	size_t users;                /* channels using it */
+};
+
+/* A channel: a plant served by a worker thread */
+struct mpc_daemon_chan {
+	const char * name;           /* instance of the shared memory */
+	mpc_sched sched;             /* CPUs and policy of the worker */
+	int shm_opts;                /* MPC_SHM_HUGETLB, MPC_SHM_MLOCK */
+	struct mpc_daemon_model * model;
+	struct shared_data * data;   /* NULL until created by the worker */
+	int failed;                  /* 1: setup of the worker failed */
+	pthread_t thread;
+};
+
+/*
+ * Setup of the worker of ch failed: the main thread is told (by
+ * SIGUSR1) and the daemon exits
+ */
+static void * mpc_daemon_fail(struct mpc_daemon_chan * ch)
+{
+	ch->failed = 1;
+	__sync_synchronize();
+	kill(getpid(), SIGUSR1);
+	return NULL;
+}
+
+/*
+ * Worker of a channel: it builds its own MPC problem and shared memory
+ * (on its own CPU, hence in its local memory) and then serves the plant
+ * forever, as the main loop of mpc_ctrl.c.
+ */
+static void * mpc_daemon_worker(void * arg)
+{
+	struct mpc_daemon_chan * ch = arg;
+	struct shared_data * data;
+	mpc_glpk mpc;
+	mpc_status * st;
+	struct timespec t_wake, t_done;
+	double * state_rd, * input_wr;
+	double time_x0, time_plant, time_posted, cmd_val[2];
+	uint64_t seq, state_seq = 0, plan_num = 0;
+	uint32_t cmd[MPC_CMD_LEN];
+	size_t skip = 0;
+	int cmd_new, cmd_err, period_tau;
+
+	mpc_sched_start(&ch->sched);
+	mpc_startup(&mpc, ch->model->json, ch->model->plant);
+	if (ch->sched.period <= 0)
+		ch->sched.period = mpc.model->tau;
+	data = mpc_shm_create(ch->name,
+			      MPC_SHM_SIZE(mpc.model->n, mpc.model->m,
+					   mpc.model->H, mpc.h_ctrl+1,
+					   MPC_RING_LEN), ch->shm_opts);
+	if (data == NULL) {
+		PRINT_ERROR("Unable to create shared memory of channel");
+		return mpc_daemon_fail(ch);
+	}
+	data->state_num = mpc.model->n;
+	data->input_num = mpc.model->m;
+	data->ref_len = mpc.model->H;
+	data->plan_len = mpc.h_ctrl+1;
+	data->ring_len = MPC_RING_LEN;
+	data->ctrl_wait = MPC_WAIT_SPIN;
+	data->ctrl_spin = MPC_WAIT_SPIN_US;
+	mpc_json_wait(ch->model->json, "ctrl_wait",
+		      &data->ctrl_wait, &data->ctrl_spin, &data->ctrl_period);
+	period_tau = data->ctrl_period <= 0;
+	if (data->ctrl_wait == MPC_WAIT_PERIODIC &&
+	    mpc_ctrl_period_set(data, period_tau ?
+				mpc.model->tau : data->ctrl_period) != 0) {
+		PRINT_ERROR("periodic wait needs a positive period (or sampling_period)");
+		mpc_shm_remove(ch->name, data);
+		return mpc_daemon_fail(ch);
+	}
+	st = mpc_status_alloc(&mpc);
+	state_rd = calloc(data->state_num, sizeof(*state_rd));
+	input_wr = calloc(data->input_num, sizeof(*input_wr));
+	mpc_prefault(&mpc, st);
+	mpc_sched_faults(&ch->sched, data->stats_int+MPC_STATS_INT_MINFLT,
+			 data->stats_int+MPC_STATS_INT_MAJFLT);
+	__sync_synchronize();
+	ch->data = data;
+
+	while (1) {
+		/* New state, or release if periodic, as in mpc_ctrl.c */
+		if (period_tau)
+			mpc_ctrl_period_set(data, mpc.model->tau);
+		seq = mpc_ctrl_state_wait(data, state_rd,
+					  &time_plant, &time_posted);
+		if (seq != 0)
+			state_seq = seq;
+		else if (state_seq == 0)
+			continue;
+		clock_gettime(CLOCK_MONOTONIC, &t_wake);
+		memcpy(st->state, state_rd, sizeof(*state_rd)*data->state_num);
+		time_x0 = mpc_step_ingest(data, &mpc, st->state, input_wr,
+					  st->ref,
+					  (double)t_wake.tv_sec+
+					  (double)t_wake.tv_nsec*1e-9,
+					  time_plant, time_posted);
+		cmd_new = mpc_step_cmd_read(data, cmd, cmd_val);
+		if (cmd_new) {
+			cmd_err = 1;
+			if (cmd[MPC_CMD_TYPE] == MPC_CMD_TAU &&
+			    ch->model->users > 1) {
+				PRINT_ERROR("tau of a shared model not changed");
+			} else if (mpc_step_cmd_valid(&mpc, 1, cmd, cmd_val)) {
+				/* applied with the solve, by the status */
+				memcpy(st->cmd, cmd, sizeof(cmd));
+				memcpy(st->cmd_val, cmd_val, sizeof(cmd_val));
+				cmd_err = 0;
+			}
+			mpc_step_cmd_ack(data, cmd[MPC_CMD_SEQ], cmd_err);
+		}
+
+		/* Event trigger, as in mpc_ctrl.c */
+		if (plan_num > 0 && !cmd_new &&
+		    mpc_step_trigger(data, &mpc, st->state, skip))
+			skip++;
+		else
+			skip = 0;
+		data->stats_int[MPC_STATS_INT_SKIP] = skip > 0;
+		data->stats_int[MPC_STATS_INT_OFFLOAD] = 0;
+
+		/* last applied input, to bound the input rate */
+		memcpy(st->input, input_wr, sizeof(*input_wr)*data->input_num);
+		if (skip == 0) {
+			mpc_status_set_x0(&mpc, st);
+			mpc_optimize(&mpc);
+			mpc_status_save(&mpc, st);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t_done);
+		data->stats_dbl[MPC_STATS_DBL_TIME] =
+			(double)(t_done.tv_sec-t_wake.tv_sec)+
+			(double)(t_done.tv_nsec-t_wake.tv_nsec)*1e-9;
+		if (skip == 0) {
+			mpc_delay_update(&mpc,
+					 data->stats_dbl[MPC_STATS_DBL_TIME]);
+			data->stats_int[MPC_STATS_INT_SOL] = *st->sol_stat;
+			mpc_sched_profile(&ch->sched,
+					  data->stats_dbl[MPC_STATS_DBL_TIME]);
+		}
+
+		/* Input of the plan, solved, fallback, or last valid one */
+		if (mpc_step_input(data, &mpc, st, skip, input_wr))
+			mpc_step_plan_publish(data, &mpc, ++plan_num, time_x0,
+					      st->state, st->input);
+		mpc_sched_faults(&ch->sched,
+				 data->stats_int+MPC_STATS_INT_MINFLT,
+				 data->stats_int+MPC_STATS_INT_MAJFLT);
+		mpc_ctrl_input_write(data, input_wr, state_seq);
+	}
+	return NULL;
+}
+
+/*
+ * Model of file in models[0..*num-1], parsed (and added) if new
+ */
+static struct mpc_daemon_model * mpc_daemon_model_get(
+	struct mpc_daemon_model * models, size_t * num, const char * file)
+{
+	struct json_object * root;
+	struct mpc_daemon_model * mod;
+	size_t i;
+
+	for (i=0; i < *num; i++) {
+		if (strcmp(models[i].file, file) == 0) {
+			models[i].users++;
+			return models+i;
+		}
+	}
+	if ((root = json_object_from_file(file)) == NULL) {
+		PRINT_ERROR("Missing/wrong JSON model");
+		return NULL;
+	}
+	mod = models+(*num)++;
+	mod->file = file;
+	mod->json = mpc_json_mode(root, 0);
+	json_object_put(root);
+	mod->plant = malloc(sizeof(*mod->plant));
+	dyn_init_json(mod->plant, mod->json);
+	mod->users = 1;
+	return mod;
+}
+
+int main(int argc, char * argv[]) {
+	struct json_object * conf, *chans, *elem, *tmp;
+	struct mpc_daemon_model * models;
+	struct mpc_daemon_chan * ch;
+	const char * file, *def_file = NULL;
+	size_t i, chan_num, model_num = 0;
+	int shm_opts = 0, signum;
+	sigset_t sigs;
+
+	if (argc <= 1) {
+		PRINT_ERROR("Too few arguments. 1 needed: <JSON configuration>");
+		return -1;
+	}
+	if ((conf = json_object_from_file(argv[1])) == NULL) {
+		PRINT_ERROR("Missing/wrong JSON configuration");
+		return -1;
+	}
+	if (!json_object_object_get_ex(conf, "channels", &chans) ||
+	    (chan_num = json_object_array_length(chans)) == 0) {
+		PRINT_ERROR("No channels in JSON configuration");
+		return -1;
+	}
+	if (json_object_object_get_ex(conf, "model", &tmp))
+		def_file = json_object_get_string(tmp);
+	if (json_object_object_get_ex(conf, "shm_hugetlb", &tmp) &&
+	    json_object_get_boolean(tmp))
+		shm_opts |= MPC_SHM_HUGETLB;
+	if (json_object_object_get_ex(conf, "shm_mlock", &tmp) &&
+	    json_object_get_boolean(tmp))
+		shm_opts |= MPC_SHM_MLOCK;
+
+	/*
+	 * Termination signals handled by the main thread only, as well
+	 * as SIGUSR1 from a worker whose setup failed
+	 */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGPIPE);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	/* Memory (also of the workers to come) locked and prefaulted */
+	mpc_sched_mem_lock();
+
+	/* Models parsed once, then one worker per channel */
+	models = calloc(chan_num, sizeof(*models));
+	ch = calloc(chan_num, sizeof(*ch));
+	for (i=0; i < chan_num; i++) {
+		elem = json_object_array_get_idx(chans, i);
+		ch[i].name = MPC_SHM_DEFAULT;
+		if (json_object_object_get_ex(elem, "name", &tmp))
+			ch[i].name = json_object_get_string(tmp);
+		mpc_sched_init(&ch[i].sched, 0);
+		if (json_object_object_get_ex(elem, "cpu", &tmp))
+			mpc_sched_init(&ch[i].sched, json_object_get_int(tmp));
+		mpc_json_sched(elem, "sched", &ch[i].sched);
+		file = def_file;
+		if (json_object_object_get_ex(elem, "model", &tmp))
+			file = json_object_get_string(tmp);
+		if (file == NULL) {
+			PRINT_ERROR("No model of channel");
+			return -1;
+		}
+		if ((ch[i].model = mpc_daemon_model_get(models, &model_num,
+							file)) == NULL)
+			return -1;
+		ch[i].shm_opts = shm_opts;
+	}
+	for (i=0; i < chan_num; i++) {
+		if (pthread_create(&ch[i].thread, NULL,
+				   mpc_daemon_worker, ch+i) != 0) {
+			PRINT_ERROR("pthread_create");
+			return -1;
+		}
+	}
+
+	/*
+	 * Waiting for termination, then removing all shared memories
+	 * (still mapped by the workers, which end with the process)
+	 */
+	sigwait(&sigs, &signum);
+	for (i=0; i < chan_num; i++) {
+		if (ch[i].failed)
+			fprintf(stderr, "Setup of channel %s failed\n",
+				ch[i].name);
+		if (ch[i].data != NULL)
+			mpc_shm_remove(ch[i].name, NULL);
+	}
+	if (signum == SIGUSR1) {
+		PRINT_ERROR("Worker failed: all channels stopped");
+		return EXIT_FAILURE;
+	}
+	printf("Got signal %d. Removed shared memory of %zu channels\n",
+	       signum, chan_num);
+	return 0;
+}
@@ -1,54 +1,153 @@
 /*
  * The interaction  between the MPC  controller and the  plant happens
- * via shared memory. It is  expected that the interaction follows the
- * steps:
+ * via shared memory, with no  system call and no lock. It is expected
+ * that the interaction follows the steps:
  *
- * 1. the  plant writes  the state  in the state  field of  the shared
- * struct
+ * 1. the plant writes the state in the state slot, together with the
+ * time (CLOCK_MONOTONIC)  when the state  was sampled.  The slot is
+ * protected by the seqlock state_seq: odd while the plant writes it,
+ * then incremented again.  A state may be written at any time:  MPC
+ * always takes the newest one and the older ones are skipped
  *
- * 2.  the  plant notifies  a  fresh  state  by sem_post(...)  on  the
- * semaphore MPC_SEM_STATE_WRITTEN
+ * 2.  the  MPC controller polls  state_seq, copies the  state (again if
+ * state_seq changed while copying), and solves
  *
- * 3.  the plant  then waits  for the  input by  sem_wait(...) on  the
- * semaphore  MPC_SEM_INPUT_WRITTEN. Also  sem_timedwait may  be used,
- * with care.
+ * 3. MPC writes  the input in the  next record of the ring of inputs,
+ * with the seq of the state it answers, and then increments input_head.
+ * The ring is never full: the oldest records are overwritten
  *
- * 4. the input is available in the struct to be fed to the plant
+ * 4. the  plant reads the newest  input of the ring (see struct
+ * mpc_input_rec), and sets input_read
  *
- * The shared memory is created and  removed by the MPC controller. In
- * case, the  default shared  memory key 0xC1A0  is already  used (for
- * example, because  another MPC controller  is up and  running), then
- * macro MPC_SHM_KEY must also be set  to another unused key agreed by
- * the MPC controller and the plant.
+ * The helper library mpc_plant.h implements the plant side of these
+ * steps.  The plant-written and the MPC-written fields of struct
+ * shared_data are in separate cache lines.
+ *
+ * Both MPC (waiting for the state) and the plant (waiting for the input)
+ * may busy poll, poll for a while and then sleep in a futex wait, or
+ * sleep at once (MPC_WAIT_*). The writer increments the futex word
+ * (state_futex or input_futex) after the data, and wakes up the reader
+ * only if it is sleeping (state_waiting or input_waiting).
+ *
+ * With MPC_WAIT_PERIODIC, MPC is not triggered by the plant: it is
+ * released every ctrl_period seconds of CLOCK_MONOTONIC (next release
+ * at ctrl_release), takes the newest state, if any (otherwise it
+ * solves again from the last one), and writes an input at every
+ * release.
+ *
+ * By default, the MPC  regulates the state to zero.  To track a
+ * reference, before step 1 the plant writes the reference in the ref
+ * area of the shared memory and sets the flag MPC_REF (see below).  The
+ * reference can change at every step, once the input answering the
+ * previous state is read.
+ *
+ * If the JSON of the MPC describes several modes of the plant ("modes"
+ * field), the plant  selects the mode  of the next MPC computation by
+ * the field mode.  Each mode has its own prebuilt problem, hence the
+ * switch is immediate and every mode keeps its own warm start.
+ *
+ * If the JSON of the MPC has the "delay_comp" field, the MPC predicts
+ * the state when the input will be applied (from state_time, the
+ * estimated solve time, and the actuation delay) and solves from there.
+ * If state_time is zero, the state is assumed sampled when MPC reads it.
+ *
+ * Bounds and weights of the MPC  may be changed while running by the
+ * command channel of the shared memory: the writer of the command sets
+ * cmd_type, cmd_index, and cmd_val[], then increments cmd_seq. The MPC
+ * controller applies the command before the next solve and then sets
+ * cmd_ack equal to cmd_seq.  A command which cannot be applied (such as
+ * a non-positive tau, or the tau of a model shared by several channels
+ * of mpc_daemon) is acknowledged with cmd_err set to 1, written before
+ * cmd_ack; cmd_err is 0 if applied.  A new command should be written
+ * only after the previous one is acknowledged.
+ *
+ * The shared memory is the POSIX object /mpc.<instance> (the file
+ * MPC_SHM_DIR/mpc.<instance>), created and removed by the MPC
+ * controller. The instance name (MPC_SHM_DEFAULT if not given) is
+ * passed on the command line of the controller and of the tools, so
+ * several controllers may run on the same host.  If created on huge
+ * pages, the object is the file MPC_HUGETLB_DIR/mpc.<instance> instead.
+ * The files mpc.* of both directories are the registry of the running
+ * controllers (see mpc_shm_list in mpc_plant.h): ctrl_pid tells if the
+ * controller is still alive.
  */
 
 #ifndef _MPC_INTERFACE_H_
 #define _MPC_INTERFACE_H_
 
-#include <semaphore.h>
+#include <stddef.h>
 #include <stdint.h>
 
-#define MPC_SHM_KEY 0xC1A0  /* hard-coded key of shared mem SysV object */
+#define MPC_SHM_DIR "/dev/shm"  /* where POSIX shm objects are */
+#define MPC_HUGETLB_DIR "/dev/hugepages" /* hugetlbfs mount point */
+#define MPC_SHM_PREFIX "mpc."   /* file of instance: MPC_SHM_PREFIX<name> */
+#define MPC_SHM_DEFAULT "default" /* instance if no name is given */
+#define MPC_SHM_NAME_LEN 64     /* max length of an instance name */
 #define MPC_SHM_FLAGS 0666  /* we go easy: everybody reads and writes */
+#define MPC_HUGE_PAGE (2*1024*1024) /* bytes of a huge page */
+
+/* Options of the shared memory, when created */
+#define MPC_SHM_HUGETLB 0x01 /* on huge pages (hugetlbfs) */
+#define MPC_SHM_MLOCK   0x02 /* locked in RAM */
 
 #define MPC_CPU_ID 1        /* CPU where processes sharing memory reside */
 
 
-/* Semapohore stuff */
-#define MPC_SEM_NUM            2   /* how many semaphores used */
-#define MPC_SEM_STATE_WRITTEN  0   /* +1: plant; -1 MPC controller */
-#define MPC_SEM_INPUT_WRITTEN  1   /* +1: MPC controller; -1 plant */
+/* Lock-free handshake */
+#define MPC_CACHE_LINE  64   /* bytes of a cache line */
+#define MPC_RING_LEN    8    /* records in the ring of inputs */
+#define MPC_ALIGNED     __attribute__((aligned(MPC_CACHE_LINE)))
+#define MPC_ALIGN(x)    (((x)+MPC_CACHE_LINE-1) & \
+			 ~((size_t)MPC_CACHE_LINE-1))
+
+/* Waiting for the state (MPC) or for the input (plant) */
+#define MPC_WAIT_POLL   0    /* busy polling, lowest latency */
+#define MPC_WAIT_SPIN   1    /* polling for some usec, then futex wait */
+#define MPC_WAIT_BLOCK  2    /* futex wait, CPU left to others */
+#define MPC_WAIT_PERIODIC 3  /* MPC only: released periodically */
+#define MPC_WAIT_SPIN_US 50  /* default usec of polling of MPC_WAIT_SPIN,
+				or before a release of MPC_WAIT_PERIODIC */
 
 /* Configuration flags */
 #define MPC_OFFLOAD 0x01     /* if set, off-load MPC computation */
+#define MPC_REF     0x02     /* if set, track the reference in shared mem */
+
+/* Commands */
+#define MPC_CMD_INPUT_BNDS    1  /* cmd_val[0..1]: lo/up of input cmd_index */
+#define MPC_CMD_STATE_BNDS    2  /* cmd_val[0..1]: lo/up of state cmd_index */
+#define MPC_CMD_STATE_WEIGHT  3  /* cmd_val[0]: weight of state cmd_index */
+#define MPC_CMD_INPUT_WEIGHT  4  /* cmd_val[0]: weight of input cmd_index */
+#define MPC_CMD_TAU           5  /* cmd_val[0]: sampling period (sec) */
 
 /* Statistics */
-#define MPC_STATS_DBL_LEN  1   /* how many double statistics */
-#define MPC_STATS_INT_LEN  1   /* how many int statistics */
+#define MPC_STATS_DBL_LEN  4   /* how many double statistics */
+#define MPC_STATS_INT_LEN  11  /* how many int statistics */
 
 /* Statistics IDs */
 #define MPC_STATS_DBL_TIME 0      /* time taken for MPC computation */
+#define MPC_STATS_DBL_DELAY 1     /* delay (sec) compensated in the state */
+#define MPC_STATS_DBL_WAKE  2     /* from state written to MPC awake (sec) */
+#define MPC_STATS_DBL_JITTER 3    /* from periodic release to MPC awake */
 #define MPC_STATS_INT_OFFLOAD 0   /* 1: offloaded, 0: local */
+#define MPC_STATS_INT_MODE    1   /* mode of the last MPC computation */
+#define MPC_STATS_INT_SKIP    2   /* 1: input from last plan, no solve */
+#define MPC_STATS_INT_SOL     3   /* outcome of the last solve MPC_SOL_* */
+#define MPC_STATS_INT_FALLBACK 4  /* 1: input by the fallback law */
+#define MPC_STATS_INT_LOST    5   /* states overwritten before MPC read */
+#define MPC_STATS_INT_MINFLT  6   /* minor page faults of MPC in the step */
+#define MPC_STATS_INT_MAJFLT  7   /* major page faults of MPC in the step */
+#define MPC_STATS_INT_OVERRUN 8   /* periodic steps ended after the next
+				     release (MPC_WAIT_PERIODIC) */
+#define MPC_STATS_INT_SPEC    9   /* 1: solution speculated at the last
+				     step used, no solve */
+#define MPC_STATS_INT_TIMEOUT 10  /* 1: no reply of the server by the
+				     deadline, solved locally */
+
+/* Outcome of the solve */
+#define MPC_SOL_OK     0   /* solution within all constraints */
+#define MPC_SOL_SOFT   1   /* solution violating the soft state bounds */
+#define MPC_SOL_INFEAS 2   /* no solution (or deadline missed): input by
+			      fallback law, or last valid one written again */
  
 /*
  * MPC server configuration parameters. The server IP may be
@@ -57,29 +156,181 @@
 #define MPC_SOLVER_IP   "127.0.0.1"  /* default IP is localhost */
 #define MPC_SOLVER_PORT 6001         /* default port is something random */
 
+/*
+ * Offload protocol. A request is the header below followed by the
+ * block of the mpc_status (see mpc.h) of the problem to be solved, and
+ * the reply is the same header followed by the block solved. The reply
+ * is waited until the sampling period of the model (or the deadline of
+ * the fallback law, if shorter) after the request. Replies of other
+ * requests, late or duplicated, are discarded by their seq. If no
+ * reply by then, MPC solves locally. The server holds the problems of
+ * all modes and solves the one of the mode of the request. The status
+ * carries all the settings changed by commands (bounds, weights, tau),
+ * which the server applies first: it keeps in sync also if it missed
+ * some commands (offload disabled, datagrams lost). Then, the request
+ * is dropped if the model_id of the mode (computed again if tau
+ * changed) is not the one of the request.
+ */
+#define MPC_OFFLOAD_VERSION 2         /* version of the header */
+#define MPC_OFFLOAD_TIMEOUT 0.1       /* deadline (sec) if no sampling period */
+struct mpc_offload_hdr {
+	uint32_t version;            /* MPC_OFFLOAD_VERSION */
+	uint32_t model_id;           /* id of the problem (mpc_glpk->model_id) */
+	uint32_t mode;               /* mode of the problem */
+	uint32_t reserved;           /* zero */
+	uint64_t seq;                /* seq of the request, echoed in reply */
+	double time_sent;            /* request sent (CLOCK_MONOTONIC), echoed */
+};
+
 struct shared_data {
-	sem_t  sems[MPC_SEM_NUM];    /* semaphores to regulate communication */
+	/* Written at creation by MPC, then by configuring processes */
 	size_t state_num;            /* number of states */
 	size_t input_num;            /* number of inputs */
+	size_t ref_len;              /* steps of state reference (horizon) */
+	size_t plan_len;             /* steps of input plan (len_ctrl+1) */
+	size_t ring_len;             /* records in the ring of inputs */
+	size_t shm_size;             /* bytes of the mapped shared memory */
+	int32_t ctrl_pid;            /* PID of the MPC controller */
+	uint32_t flags;
+	uint32_t cmd_seq;            /* incremented when a command is written */
+	uint32_t cmd_ack;            /* equal to cmd_seq once applied by MPC */
+	uint32_t cmd_err;            /* 1: command acknowledged not applied */
+	uint32_t cmd_type;           /* type of command MPC_CMD_* */
+	uint32_t cmd_index;          /* index of input/state component */
+	uint32_t mode;               /* mode of the plant (written by plant) */
+	double cmd_val[2];           /* values of the command */
+
+	/* Written by the plant only */
+	uint64_t state_seq MPC_ALIGNED; /* seqlock of state: odd if writing */
+	double state_time;           /* CLOCK_MONOTONIC (sec) of state, or 0 */
+	double state_posted;         /* CLOCK_MONOTONIC (sec) of state written */
+	uint64_t input_read;         /* input_head when the plant last read */
+	uint32_t state_futex;        /* futex word, incremented at each state */
+	uint32_t input_waiting;      /* 1: plant in futex wait on input_futex */
+	uint32_t plant_wait;         /* how the plant waits: MPC_WAIT_* */
+	double plant_spin;           /* usec of polling if MPC_WAIT_SPIN */
+	double input_wake;           /* from input written to plant awake */
+
+	/* Written by MPC only */
+	uint64_t state_taken MPC_ALIGNED; /* state_seq of the last state read */
+	uint64_t input_head;         /* number of inputs written in the ring */
+	uint32_t input_futex;        /* futex word, incremented at each input */
+	uint32_t state_waiting;      /* 1: MPC in futex wait on state_futex */
+	uint32_t ctrl_wait;          /* how MPC waits: MPC_WAIT_* */
+	double ctrl_spin;            /* usec of polling if MPC_WAIT_SPIN */
+	double ctrl_period;          /* period (sec) if MPC_WAIT_PERIODIC */
+	double ctrl_release;         /* next release (sec), 0: at once */
+	uint32_t plan_cur;           /* plan buffer (0 or 1) last written */
 #if MPC_STATS_INT_LEN
 	int stats_int[MPC_STATS_INT_LEN];
 #endif
 #if MPC_STATS_DBL_LEN
 	double stats_dbl[MPC_STATS_DBL_LEN];
 #endif
-	uint32_t flags;
 	/*
-	 * The shared memory then continues with two arrays of double
-	 * whose size is dynamic:
+	 * The shared memory then continues with the following arrays,
+	 * whose size is dynamic, each starting at a new cache line:
 	 *
 	 *   double state[state_num]
-	 *     used by the application to communicate the state to MPC
+	 *     state slot written by the plant (see state_seq)
 	 *
-	 *   double input[input_num]
-	 *     used by MPC to communicate the input to the application
+	 *   ring_len records, each with a struct mpc_input_rec followed by
+	 *     double input[input_num]
+	 *     written by MPC (see struct mpc_input_rec)
+	 *
+	 *   double ref_state[ref_len*state_num]
+	 *     reference of the state at steps 1, ..., ref_len written
+	 *     by the application (read by MPC only if MPC_REF is set)
+	 *
+	 *   double ref_input[plan_len*input_num]
+	 *     reference of the input at steps 0, ..., plan_len-1 (the
+	 *     last one held until the end of the horizon) written by the
+	 *     application (read by MPC only if MPC_REF is set)
+	 *
+	 *   two plan buffers, each with a struct mpc_plan followed by
+	 *     double input[plan_len*input_num], U(0), ..., U(plan_len-1)
+	 *     double state[ref_len*state_num], X(1), ..., X(ref_len)
+	 *     written by MPC after each solve (see struct mpc_plan)
 	 */
+} MPC_ALIGNED;
+
+/*
+ * Record of  the ring of inputs.  The k-th input (k  from 0) is in the
+ * record k%ring_len, whose seq is odd while MPC writes it and 2*(k+1)
+ * when written.  Hence, the plant reads the newest input by:
+ * 1. h = input_head, if equal to input_read there is no new input
+ * 2. s = seq of the record (h-1)%ring_len, retry if not 2*h
+ * 3. copy the input, then if seq of the record is not s anymore, the
+ *    record was overwritten while copying: start again
+ * 4. input_read = h
+ */
+struct mpc_input_rec {
+	uint64_t seq;                /* 2*(k+1) for the k-th input */
+	uint64_t state_seq;          /* state_seq of the state answered */
+	double time;                 /* CLOCK_MONOTONIC (sec) when written */
+};
+
+/*
+ * Full plan of the last  MPC solve: the inputs U(0), U(1), ...  (the
+ * last one held until the end of  the horizon) and the predicted states
+ * X(1), X(2), ... of the plant  if the plan is applied. The plant may
+ * apply U(1), U(2), ... if a new solve is late, or interpolate.
+ *
+ * MPC writes the plan in the buffer not indicated by plan_cur and then
+ * switches plan_cur to it.  The seq of a buffer is odd while MPC writes
+ * it.  Hence, the plant reads a plan by:
+ * 1. i = plan_cur, then s = seq of buffer i (retry if odd)
+ * 2. copy the plan of buffer i
+ * 3. if seq of buffer i is not s anymore, the plan was overwritten
+ *    while copying: start again
+ */
+struct mpc_plan {
+	uint64_t seq;                /* sequence number of the solve */
+	double time;                 /* time (CLOCK_MONOTONIC, sec) of X(0) */
 };
 
+/*
+ * Pointers to the  arrays following the  struct shared_data pointed by
+ * var, to the records of the ring (any k, taken modulo ring_len), to
+ * the plan buffers (i is 0 or 1) with their arrays, and overall size
+ * of the shared memory.  Each array, record, and plan buffer starts at
+ * a new cache line.
+ */
+#define MPC_SHM_STATE(var)      ((double *)((var)+1))
+#define MPC_RING_SIZE(m)        MPC_ALIGN(sizeof(struct mpc_input_rec)+ \
+					  sizeof(double)*(m))
+#define MPC_SHM_RING(var, k)    ((struct mpc_input_rec *)((char *)	\
+				 MPC_SHM_STATE(var)+			\
+				 MPC_ALIGN(sizeof(double)*(var)->state_num)+ \
+				 ((k)%(var)->ring_len)*			\
+				 MPC_RING_SIZE((var)->input_num)))
+#define MPC_RING_INPUT(rec)     ((double *)((rec)+1))
+#define MPC_SHM_REF_STATE(var)  ((double *)((char *)MPC_SHM_RING(var, 0)+ \
+				 (var)->ring_len*			\
+				 MPC_RING_SIZE((var)->input_num)))
+#define MPC_SHM_REF_INPUT(var)  ((double *)((char *)MPC_SHM_REF_STATE(var)+ \
+				 MPC_ALIGN(sizeof(double)*		\
+					   (var)->ref_len*(var)->state_num)))
+#define MPC_PLAN_SIZE_NM(n, m, len, plan_len)				\
+	MPC_ALIGN(sizeof(struct mpc_plan)+				\
+		  sizeof(double)*((plan_len)*(m)+(len)*(n)))
+#define MPC_PLAN_SIZE(var)      MPC_PLAN_SIZE_NM((var)->state_num,	\
+				 (var)->input_num, (var)->ref_len,	\
+				 (var)->plan_len)
+#define MPC_SHM_PLAN(var, i)    ((struct mpc_plan *)((char *)		\
+				 MPC_SHM_REF_INPUT(var)+		\
+				 MPC_ALIGN(sizeof(double)*(var)->plan_len* \
+					   (var)->input_num)+		\
+				 (i)*MPC_PLAN_SIZE(var)))
+#define MPC_PLAN_INPUT(plan)    ((double *)((plan)+1))
+#define MPC_PLAN_STATE(var, plan) (MPC_PLAN_INPUT(plan)+	\
+				   (var)->plan_len*(var)->input_num)
+#define MPC_SHM_SIZE(n, m, len, plan_len, ring_len)			\
+	(sizeof(struct shared_data)+MPC_ALIGN(sizeof(double)*(n))+	\
+	 (ring_len)*MPC_RING_SIZE(m)+MPC_ALIGN(sizeof(double)*(len)*(n))+ \
+	 MPC_ALIGN(sizeof(double)*(plan_len)*(m))+			\
+	 2*MPC_PLAN_SIZE_NM(n, m, len, plan_len))
+
 /*
  * The  following  two  macros  rispectively enable  and  disable  the
  * offloading to the MPC server.  The  macro parameter is the "var" is
@@ -90,5 +341,12 @@ struct shared_data {
 #define MPC_OFFLOAD_DISABLE(var)      var->flags &= ~((uint32_t)MPC_OFFLOAD);
 #define MPC_OFFLOAD_IS_ENABLED(var)   (var->flags & MPC_OFFLOAD)
 
+/*
+ * The  following  two  macros  rispectively enable  and  disable  the
+ * tracking of the reference written in the shared memory.
+ */
+#define MPC_REF_ENABLE(var)           var->flags |= MPC_REF;
+#define MPC_REF_DISABLE(var)          var->flags &= ~((uint32_t)MPC_REF);
+
 
 #endif /* _MPC_INTERFACE_H_ */
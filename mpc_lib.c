@@ -0,0 +1,193 @@
+/*
+ * mpc_lib.c
+ *
+ * In-process MPC controller (see mpc_lib.h)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <json-c/json.h>
+#include "mpc_interface.h"
+#include "mpc.h"
+#include "mpc_lib.h"
+
+/* Put this macro where debugging is needed */
+#define PRINT_ERROR(x) {fprintf(stderr, "%s:%d errno=%i, %s\n",	\
+				__FILE__, __LINE__, errno, (x));}
+
+struct mpc_ctx {
+	mpc_glpk mpc;        /* the problem */
+	mpc_status * st;     /* state, reference, plan of the last solve */
+	double * u_last;     /* last input returned */
+	int warm;            /* 1: solve from the basis of the last solve */
+};
+
+/*
+ * Create the controller (see mpc_lib.h)
+ */
+mpc_ctx * mpc_create(const char * json,
+		     const void * snapshot, size_t snapshot_size)
+{
+	struct json_tokener * tok;
+	struct json_object * root, *mode_json;
+	mpc_ctx * ctx;
+	int it_lim, tm_lim;
+
+	tok = json_tokener_new();
+	root = json_tokener_parse_ex(tok, json, (int)strlen(json));
+	json_tokener_free(tok);
+	if (root == NULL) {
+		PRINT_ERROR("error parsing JSON");
+		return NULL;
+	}
+	ctx = calloc(1, sizeof(*ctx));
+	mode_json = mpc_json_mode(root, 0);
+	mpc_startup(&ctx->mpc, mode_json, NULL);
+	json_object_put(mode_json);
+	json_object_put(root);
+	ctx->st = mpc_status_alloc(&ctx->mpc);
+	ctx->u_last = calloc(ctx->mpc.model->m, sizeof(*ctx->u_last));
+	ctx->warm = 1;
+	if (snapshot == NULL)
+		return ctx;
+	if (snapshot_size != ctx->st->size) {
+		PRINT_ERROR("snapshot not of the same JSON: ignored");
+		return ctx;
+	}
+	memcpy(ctx->st->block, snapshot, snapshot_size);
+	/* the budgets are the ones of JSON, not of the snapshot */
+	it_lim = ctx->mpc.param->it_lim;
+	tm_lim = ctx->mpc.param->tm_lim;
+	mpc_status_resume(&ctx->mpc, ctx->st);
+	ctx->mpc.param->it_lim = it_lim;
+	ctx->mpc.param->tm_lim = tm_lim;
+	memcpy(ctx->u_last, ctx->st->input,
+	       sizeof(*ctx->u_last)*ctx->mpc.model->m);
+	return ctx;
+}
+
+/*
+ * Solve for the state x0 (see mpc_lib.h)
+ */
+int mpc_solve(mpc_ctx * ctx, const double * x0, double * u_out)
+{
+	mpc_glpk * mpc = &ctx->mpc;
+	mpc_status * st = ctx->st;
+	size_t m = mpc->model->m;
+
+	memcpy(st->state, x0, sizeof(*x0)*mpc->model->n);
+	/* last input returned, to bound the input rate */
+	memcpy(st->input, ctx->u_last, sizeof(*u_out)*m);
+	mpc_status_set_x0(mpc, st);
+	if (!ctx->warm)
+		glp_std_basis(mpc->op);
+	mpc_optimize(mpc);
+	mpc_status_save(mpc, st);
+	if (*st->sol_stat != MPC_SOL_INFEAS)
+		memcpy(ctx->u_last, st->input, sizeof(*u_out)*m);
+	else if (mpc->K_fb != NULL)
+		mpc_fallback_input(mpc, st->state, ctx->u_last);
+	memcpy(u_out, ctx->u_last, sizeof(*u_out)*m);
+	return *st->sol_stat;
+}
+
+/*
+ * Reference of the next solves (see mpc_lib.h)
+ */
+void mpc_set_ref(mpc_ctx * ctx, const double * x_ref, const double * u_ref)
+{
+	size_t n, m, H;
+	double * ref_u;
+
+	n = ctx->mpc.model->n;
+	m = ctx->mpc.model->m;
+	H = ctx->mpc.model->H;
+	ref_u = ctx->st->ref+H*n;
+	if (x_ref != NULL)
+		memcpy(ctx->st->ref, x_ref, sizeof(*x_ref)*H*n);
+	else
+		bzero(ctx->st->ref, sizeof(*x_ref)*H*n);
+	/* same layout of the shared memory (MPC_SHM_REF_INPUT) */
+	if (u_ref != NULL)
+		memcpy(ref_u, u_ref, sizeof(*u_ref)*(ctx->mpc.h_ctrl+1)*m);
+	else
+		bzero(ref_u, sizeof(*u_ref)*(ctx->mpc.h_ctrl+1)*m);
+}
+
+/*
+ * Budget of each solve (see mpc_lib.h)
+ */
+void mpc_set_budget(mpc_ctx * ctx, int it_lim, double tm_lim)
+{
+	ctx->mpc.param->it_lim = it_lim > 0 ? it_lim : INT_MAX;
+	ctx->mpc.param->tm_lim = tm_lim > 0 ? (int)(tm_lim*1e3) : INT_MAX;
+	if (ctx->mpc.param->tm_lim == 0)
+		ctx->mpc.param->tm_lim = 1; /* less than 1 msec */
+}
+
+/*
+ * Warm start or not (see mpc_lib.h)
+ */
+void mpc_set_warm(mpc_ctx * ctx, int warm)
+{
+	ctx->warm = warm != 0;
+}
+
+/*
+ * Plan of the last solve (see mpc_lib.h)
+ */
+void mpc_plan(const mpc_ctx * ctx, double * U, double * X)
+{
+	memcpy(U, ctx->st->input, sizeof(*U)*
+	       (ctx->mpc.h_ctrl+1)*ctx->mpc.model->m);
+	if (X != NULL)
+		mpc_plan_predict(&ctx->mpc, ctx->st->state, ctx->st->input, X);
+}
+
+/*
+ * Snapshot of the solver (see mpc_lib.h)
+ */
+size_t mpc_snapshot(const mpc_ctx * ctx, void * buf, size_t size)
+{
+	/* status saved by the last solve */
+	if (size >= ctx->st->size)
+		memcpy(buf, ctx->st->block, ctx->st->size);
+	return ctx->st->size;
+}
+
+/*
+ * Sizes of the controller (see mpc_lib.h)
+ */
+size_t mpc_state_num(const mpc_ctx * ctx)
+{
+	return ctx->mpc.model->n;
+}
+
+size_t mpc_input_num(const mpc_ctx * ctx)
+{
+	return ctx->mpc.model->m;
+}
+
+size_t mpc_steps(const mpc_ctx * ctx)
+{
+	return ctx->mpc.model->H;
+}
+
+size_t mpc_plan_len(const mpc_ctx * ctx)
+{
+	return ctx->mpc.h_ctrl+1;
+}
+
+/*
+ * Release the controller (see mpc_lib.h)
+ */
+void mpc_destroy(mpc_ctx * ctx)
+{
+	mpc_status_free(ctx->st);
+	mpc_free(&ctx->mpc);
+	free(ctx->u_last);
+	free(ctx);
+}
@@ -0,0 +1,90 @@
+#ifndef _MPC_LIB_H_
+#define _MPC_LIB_H_
+#include <stddef.h>
+
+/*
+ * In-process MPC controller (library libmpc). A plant linking libmpc
+ * calls the controller directly, with no shared memory, no MPC process
+ * and no context switch. For example
+ *
+ *	ctx = mpc_create(json_text, NULL, 0);
+ *	while (...) {
+ *		...
+ *		mpc_solve(ctx, x, u);
+ *		...
+ *	}
+ *	mpc_destroy(ctx);
+ *
+ * The JSON is the same of mpc_ctrl (with "modes", the first mode is
+ * used). A context must not be used by several threads at once, while
+ * different contexts are independent.
+ */
+typedef struct mpc_ctx mpc_ctx;
+
+/*
+ * Create the MPC controller described by the JSON text json. If
+ * snapshot is not NULL, the solver is resumed (warm basis, last input,
+ * reference) from the snapshot_size bytes returned by mpc_snapshot for
+ * the same JSON. Return the controller, or NULL on error.
+ */
+mpc_ctx * mpc_create(const char * json,
+		     const void * snapshot, size_t snapshot_size);
+
+/*
+ * Compute in u_out (input_num long) the input for the state x0
+ * (state_num long). The input rate, if bounded, is taken from the last
+ * input returned. Return the outcome of the solve (MPC_SOL_* of
+ * mpc_interface.h): if MPC_SOL_INFEAS, u_out is the input of the
+ * fallback law, if any, or else the last valid input.
+ */
+int mpc_solve(mpc_ctx * ctx, const double * x0, double * u_out);
+
+/*
+ * Set the reference of the next solves: x_ref (steps*state_num long)
+ * is the state at steps 1, 2, ..., u_ref (plan_len*input_num long) the
+ * input at steps 0, 1, ..., plan_len-1, the last one held until the end
+ * of the horizon (as MPC_SHM_REF_INPUT of mpc_interface.h). NULL is
+ * zero.
+ */
+void mpc_set_ref(mpc_ctx * ctx, const double * x_ref, const double * u_ref);
+
+/*
+ * Budget of each solve: at most it_lim Simplex iterations and tm_lim
+ * seconds (unbounded if <= 0).
+ */
+void mpc_set_budget(mpc_ctx * ctx, int it_lim, double tm_lim);
+
+/*
+ * If warm is zero, each solve starts from the standard basis (constant
+ * solve time). Otherwise (the default) from the basis of the last
+ * solve (less iterations).
+ */
+void mpc_set_warm(mpc_ctx * ctx, int warm);
+
+/*
+ * Copy in U (plan_len*input_num long) the inputs U(0), U(1), ... of the
+ * last solve and, if X is not NULL, in X (steps*state_num long) the
+ * predicted states X(1), X(2), ...
+ */
+void mpc_plan(const mpc_ctx * ctx, double * U, double * X);
+
+/*
+ * Copy the snapshot of the solver in buf, if size is large enough.
+ * Return the size of the snapshot.
+ */
+size_t mpc_snapshot(const mpc_ctx * ctx, void * buf, size_t size);
+
+/*
+ * Sizes of the controller
+ */
+size_t mpc_state_num(const mpc_ctx * ctx);
+size_t mpc_input_num(const mpc_ctx * ctx);
+size_t mpc_steps(const mpc_ctx * ctx);      /* of the state prediction */
+size_t mpc_plan_len(const mpc_ctx * ctx);   /* of the input plan */
+
+/*
+ * Release the controller
+ */
+void mpc_destroy(mpc_ctx * ctx);
+
+#endif /* _MPC_LIB_H_ */
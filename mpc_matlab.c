@@ -3,18 +3,21 @@
  *
  *	input = mpc_matlab(state);
  *	[input, time] = mpc_matlab(state);
+ *	input = mpc_matlab(state, instance);
+ *
+ * where instance  is the name of the MPC controller (the default one if
+ * absent).
  *
  * To compile, invoke just
  *
  *    make matlab
  */
 #include <sys/types.h>
-#include <sys/shm.h>
 #include <time.h>
 #include <string.h>
-#include <semaphore.h>
 #include <errno.h>
 #include "mpc_interface.h"
+#include "mpc_plant.h"
 #include "mex.h"
 
 #define STRING_ERROR(x) "%s:%d errno=%i, %s\n",	\
@@ -26,17 +29,21 @@ void mexFunction( int nlhs, mxArray *plhs[],
 {
 	size_t state_num, input_num, n, m;
 	double *state_rd, *input_wr, time;
-	int shm_id, offloaded;
+	int offloaded;
 	struct shared_data * data;
 	char error_string[1024];
-	double * shared_state;
-	double * shared_input;
+	char instance[MPC_SHM_NAME_LEN];
 	
 	/* check for proper number of arguments */
-	if(nrhs!=1) {
+	if(nrhs < 1 || nrhs > 2) {
 		mexErrMsgIdAndTxt("MyToolbox:mpc_matlab:nrhs",
 				  "The state is a necessary argument.");
 	}
+	if(nrhs == 2 && (!mxIsChar(prhs[1]) ||
+			 mxGetString(prhs[1], instance, sizeof(instance)))) {
+		mexErrMsgIdAndTxt("MyToolbox:mpc_matlab:notString",
+				  "Instance must be a string.");
+	}
 	if(nlhs < 1) {
 		mexErrMsgIdAndTxt("MyToolbox:mpc_matlab:nlhs",
 				  "At least one output required.");
@@ -63,14 +70,10 @@ void mexFunction( int nlhs, mxArray *plhs[],
 	 * Now we have all data. We can open the shared memory. 
 	 * Must be created earlier (by mpc_ctrl.c)
 	 */
-	shm_id = shmget(MPC_SHM_KEY, 0, 0);
-	if (shm_id == -1) {
+	if ((data = mpc_plant_attach(nrhs == 2 ? instance : NULL)) == NULL) {
 		mexErrMsgIdAndTxt("MyToolbox:mpc_matlab:shmget",
 				  "Unable to open shared memory");
 	}
-	data = (struct shared_data *)shmat(shm_id, NULL, 0);
-	shared_state = (double*)(data+1); /* starts just after *data */
-	shared_input = shared_state+data->state_num;
 	
 	/* State must have the same dimension as in mpc_interface.h */
 	if(n == 1) {
@@ -80,9 +83,9 @@ void mexFunction( int nlhs, mxArray *plhs[],
 		state_num = n;
 	}
 	if (state_num != data->state_num) {
+		mpc_plant_detach(data);
 		mexErrMsgIdAndTxt("MyToolbox:mpc_matlab:wrongSize",
 				  "Wrong size of the state.");
-		shmdt(data);
 	}
 
 	/* Create a pointer to the real data in the state vector  */
@@ -91,12 +94,6 @@ void mexFunction( int nlhs, mxArray *plhs[],
 #else
 	state_rd = mxGetPr(prhs[0]);
 #endif
-	memcpy(shared_state, state_rd, sizeof(state_rd[0])*state_num);
-
-	/* Now asking MPC to compute the optimal input for us... */
-	sem_post(data->sems+MPC_SEM_STATE_WRITTEN);
-	/* ... and waiting to get a response */
-	sem_wait(data->sems+MPC_SEM_INPUT_WRITTEN);
 
 	/* Create a Matlab vector to pass the MPC input */
 	plhs[0] = mxCreateDoubleMatrix(1, (mwSize)data->input_num, mxREAL);
@@ -107,7 +104,11 @@ void mexFunction( int nlhs, mxArray *plhs[],
 #else
 	input_wr = mxGetPr(plhs[0]);
 #endif
-	memcpy(input_wr, shared_input, sizeof(input_wr[0])*data->input_num);
+
+	/* Now asking MPC to compute the optimal input and waiting it */
+	mpc_plant_input_wait(data, input_wr,
+			     mpc_plant_state_write(data, state_rd, 0), 0);
+
 	if(nlhs >= 2) {
 		time = data->stats_dbl[MPC_STATS_DBL_TIME];
 		plhs[1] = mxCreateDoubleScalar(time);
@@ -118,5 +119,5 @@ void mexFunction( int nlhs, mxArray *plhs[],
 	}
 	
 	/* Finally detaching shared memory */
-	shmdt(data);
+	mpc_plant_detach(data);
 }
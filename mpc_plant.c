@@ -0,0 +1,515 @@
+/*
+ * mpc_plant.c
+ *
+ * Named shared memory of the MPC controllers and plant side of the
+ * lock-free protocol (see mpc_plant.h and mpc_interface.h).
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "mpc_plant.h"
+
+/* Put this macro where debugging is needed */
+#define PRINT_ERROR(x) {fprintf(stderr, "%s:%d errno=%i, %s\n",	\
+				__FILE__, __LINE__, errno, (x));}
+
+/* Seconds from a to b */
+static double mpc_plant_elapsed(const struct timespec * a,
+				const struct timespec * b)
+{
+	return (double)(b->tv_sec-a->tv_sec)+
+		(double)(b->tv_nsec-a->tv_nsec)*1e-9;
+}
+
+/*
+ * Sleep while the futex word is val (see mpc_plant.h)
+ */
+void mpc_futex_wait(uint32_t * futex, uint32_t val, double timeout)
+{
+	struct timespec ts;
+
+	if (timeout > 0) {
+		ts.tv_sec  = (time_t)timeout;
+		ts.tv_nsec = (long)((timeout-(double)ts.tv_sec)*1e9);
+	}
+	/* not private: the waker is in another process */
+	syscall(SYS_futex, futex, FUTEX_WAIT, val,
+		timeout > 0 ? &ts : NULL, NULL, 0);
+}
+
+/*
+ * Wake up the process sleeping on the futex word (see mpc_plant.h)
+ */
+void mpc_futex_wake(uint32_t * futex)
+{
+	syscall(SYS_futex, futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+ * Path of the object of instance name: the POSIX shm name, or the file
+ * on hugetlbfs if huge. Return -1 if the name is not valid.
+ */
+static int mpc_shm_path(char * path, size_t len, const char * name,
+			int huge)
+{
+	if (name == NULL)
+		name = MPC_SHM_DEFAULT;
+	if (strlen(name) >= MPC_SHM_NAME_LEN || strchr(name, '/') != NULL) {
+		PRINT_ERROR("invalid instance name");
+		return -1;
+	}
+	snprintf(path, len, "%s/%s%s",
+		 huge ? MPC_HUGETLB_DIR : "", MPC_SHM_PREFIX, name);
+	return 0;
+}
+
+/* Open the object of path (see mpc_shm_path) */
+static int mpc_shm_open(const char * path, int flags, int huge)
+{
+	return huge ? open(path, flags, MPC_SHM_FLAGS) :
+		shm_open(path, flags, MPC_SHM_FLAGS);
+}
+
+/* 1 if the controller of the shared memory is alive */
+static int mpc_shm_alive(const struct shared_data * data)
+{
+	return data->ctrl_pid > 0 &&
+		(kill((pid_t)data->ctrl_pid, 0) == 0 || errno == EPERM);
+}
+
+/* Map the open file fd of the shared memory, size bytes (0: all) */
+static struct shared_data * mpc_shm_map(int fd, size_t size)
+{
+	struct stat st;
+	void * data;
+
+	if (size == 0) {
+		if (fstat(fd, &st) == -1 || st.st_size == 0) {
+			PRINT_ERROR("empty shared memory");
+			return NULL;
+		}
+		size = (size_t)st.st_size;
+	}
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		PRINT_ERROR("mmap failed");
+		return NULL;
+	}
+	return (struct shared_data *)data;
+}
+
+/*
+ * Create the shared memory of an MPC controller (see mpc_plant.h)
+ */
+struct shared_data * mpc_shm_create(const char * name, size_t size,
+				    int opts)
+{
+	char path[sizeof(MPC_HUGETLB_DIR)+sizeof(MPC_SHM_PREFIX)+
+		  MPC_SHM_NAME_LEN];
+	struct shared_data * data;
+	int fd, huge;
+
+	huge = (opts & MPC_SHM_HUGETLB) != 0;
+	if (huge) {
+		/* hugetlbfs files are whole huge pages */
+		size = (size+MPC_HUGE_PAGE-1)/MPC_HUGE_PAGE*MPC_HUGE_PAGE;
+	}
+	if (mpc_shm_path(path, sizeof(path), name, huge) == -1)
+		return NULL;
+	if ((data = mpc_plant_attach(name)) != NULL) {
+		if (mpc_shm_alive(data)) {
+			PRINT_ERROR("instance used by a running MPC controller");
+			mpc_plant_detach(data);
+			return NULL;
+		}
+		/* left by a controller which died: removed */
+		mpc_plant_detach(data);
+		mpc_shm_remove(name, NULL);
+	}
+	fd = mpc_shm_open(path, O_RDWR | O_CREAT | O_EXCL, huge);
+	if (fd == -1) {
+		PRINT_ERROR(huge ? "unable to create shared memory on huge pages"
+			    : "unable to create shared memory");
+		return NULL;
+	}
+	fchmod(fd, MPC_SHM_FLAGS); /* regardless of umask */
+	if (!huge && ftruncate(fd, (off_t)size) == -1) {
+		PRINT_ERROR("ftruncate failed");
+		close(fd);
+		mpc_shm_remove(name, NULL);
+		return NULL;
+	}
+	data = mpc_shm_map(fd, size);
+	close(fd);
+	if (data == NULL) {
+		mpc_shm_remove(name, NULL);
+		return NULL;
+	}
+	memset(data, 0, size);
+	if ((opts & MPC_SHM_MLOCK) && mlock(data, size) == -1) {
+		PRINT_ERROR("mlock failed: shared memory not locked");
+	}
+	data->shm_size = size;
+	data->ctrl_pid = (int32_t)getpid();
+	return data;
+}
+
+/*
+ * Remove the shared memory of an MPC controller (see mpc_plant.h)
+ */
+void mpc_shm_remove(const char * name, struct shared_data * data)
+{
+	char path[sizeof(MPC_HUGETLB_DIR)+sizeof(MPC_SHM_PREFIX)+
+		  MPC_SHM_NAME_LEN];
+
+	if (data != NULL)
+		mpc_plant_detach(data);
+	if (mpc_shm_path(path, sizeof(path), name, 0) == 0)
+		shm_unlink(path);
+	if (mpc_shm_path(path, sizeof(path), name, 1) == 0)
+		unlink(path);
+}
+
+/*
+ * List the running MPC controllers (see mpc_plant.h)
+ */
+int mpc_shm_list(char (*names)[MPC_SHM_NAME_LEN], int max)
+{
+	static const char * const dirs[] = {MPC_SHM_DIR, MPC_HUGETLB_DIR};
+	struct shared_data * data;
+	struct dirent * ent;
+	const char * name;
+	DIR * dir;
+	size_t i;
+	int num = 0;
+
+	for (i=0; i < sizeof(dirs)/sizeof(*dirs); i++) {
+		if ((dir = opendir(dirs[i])) == NULL)
+			continue; /* no hugetlbfs mounted */
+		while ((ent = readdir(dir)) != NULL && num < max) {
+			if (strncmp(ent->d_name, MPC_SHM_PREFIX,
+				    strlen(MPC_SHM_PREFIX)) != 0)
+				continue;
+			name = ent->d_name+strlen(MPC_SHM_PREFIX);
+			if (strlen(name) >= MPC_SHM_NAME_LEN ||
+			    (data = mpc_plant_attach(name)) == NULL)
+				continue;
+			if (mpc_shm_alive(data)) {
+				strcpy(names[num], name);
+				num++;
+			}
+			mpc_plant_detach(data);
+		}
+		closedir(dir);
+	}
+	return num;
+}
+
+/*
+ * Attach the shared memory (see mpc_plant.h)
+ */
+struct shared_data * mpc_plant_attach(const char * name)
+{
+	char path[sizeof(MPC_HUGETLB_DIR)+sizeof(MPC_SHM_PREFIX)+
+		  MPC_SHM_NAME_LEN];
+	struct shared_data * data;
+	int fd, huge;
+
+	for (huge=0; huge <= 1; huge++) {
+		if (mpc_shm_path(path, sizeof(path), name, huge) == -1)
+			return NULL;
+		if ((fd = mpc_shm_open(path, O_RDWR, huge)) != -1)
+			break;
+	}
+	if (fd == -1) {
+		/* quietly: also used to check if an instance exists */
+		return NULL;
+	}
+	data = mpc_shm_map(fd, 0);
+	close(fd);
+	return data;
+}
+
+/*
+ * Detach the shared memory (see mpc_plant.h)
+ */
+void mpc_plant_detach(struct shared_data * data)
+{
+	munmap(data, data->shm_size);
+}
+
+/*
+ * Write the state in the seqlock slot (see mpc_plant.h)
+ */
+uint64_t mpc_plant_state_write(struct shared_data * data,
+			       const double * x, double time)
+{
+	struct timespec now;
+	double posted;
+	uint64_t seq;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	posted = (double)now.tv_sec+(double)now.tv_nsec*1e-9;
+	if (time == 0)
+		time = posted;
+	seq = data->state_seq;
+	data->state_seq = seq+1; /* odd: being written */
+	__sync_synchronize();
+	memcpy(MPC_SHM_STATE(data), x, sizeof(*x)*data->state_num);
+	data->state_time = time;
+	data->state_posted = posted;
+	__sync_synchronize();
+	data->state_seq = seq+2;
+
+	/* Wake up MPC, only if sleeping */
+	data->state_futex++;
+	__sync_synchronize();
+	if (data->state_waiting)
+		mpc_futex_wake(&data->state_futex);
+	return seq+2;
+}
+
+/*
+ * Read the newest input of the ring (see mpc_plant.h)
+ */
+int mpc_plant_input_read(struct shared_data * data,
+			 double * u, uint64_t * state_seq)
+{
+	struct mpc_input_rec * rec;
+	struct timespec now;
+	uint64_t head, seq, st_seq;
+	double time;
+
+	do {
+		__sync_synchronize();
+		head = data->input_head;
+		if (head == data->input_read) {
+			/* nothing new */
+			return 0;
+		}
+		rec = MPC_SHM_RING(data, head-1);
+		seq = rec->seq;
+		__sync_synchronize();
+		memcpy(u, MPC_RING_INPUT(rec), sizeof(*u)*data->input_num);
+		st_seq = rec->state_seq;
+		time = rec->time;
+		__sync_synchronize();
+		/* written again while copying: a newer input is there */
+	} while (seq != 2*head || rec->seq != seq);
+	data->input_read = head;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	data->input_wake = (double)now.tv_sec+(double)now.tv_nsec*1e-9-time;
+	if (state_seq != NULL)
+		*state_seq = st_seq;
+	return 1;
+}
+
+/*
+ * Set how the plant waits for the input (see mpc_plant.h)
+ */
+void mpc_plant_wait_set(struct shared_data * data,
+			uint32_t mode, double spin)
+{
+	data->plant_wait = mode;
+	data->plant_spin = spin;
+}
+
+/* 1 if the input of state_seq (or newer) is copied in u */
+static int mpc_plant_input_got(struct shared_data * data, double * u,
+			       uint64_t state_seq)
+{
+	uint64_t seq;
+
+	return mpc_plant_input_read(data, u, &seq) && seq >= state_seq;
+}
+
+/*
+ * Wait until the input of state_seq (see mpc_plant.h)
+ */
+int mpc_plant_input_wait(struct shared_data * data, double * u,
+			 uint64_t state_seq, double timeout)
+{
+	struct timespec start, now;
+	double elapsed;
+	uint32_t val;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (!mpc_plant_input_got(data, u, state_seq)) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = mpc_plant_elapsed(&start, &now);
+		if (timeout > 0 && elapsed > timeout)
+			return -1;
+		if (data->plant_wait == MPC_WAIT_POLL ||
+		    (data->plant_wait == MPC_WAIT_SPIN &&
+		     elapsed < data->plant_spin*1e-6))
+			continue;
+
+		/* Announce the sleep, then check again before it */
+		val = data->input_futex;
+		data->input_waiting = 1;
+		__sync_synchronize();
+		if (mpc_plant_input_got(data, u, state_seq)) {
+			data->input_waiting = 0;
+			return 0;
+		}
+		mpc_futex_wait(&data->input_futex, val,
+			       timeout > 0 ? timeout-elapsed : 0);
+		data->input_waiting = 0;
+	}
+	return 0;
+}
+
+/*
+ * Take the newest state from the seqlock slot (see mpc_plant.h)
+ */
+uint64_t mpc_ctrl_state_take(struct shared_data * data,
+			     double * x, double * time, double * posted)
+{
+	uint64_t seq;
+
+	do {
+		__sync_synchronize();
+		seq = data->state_seq;
+		if (seq == data->state_taken || (seq & 1)) {
+			/* nothing new, or the plant is writing it */
+			return 0;
+		}
+		__sync_synchronize();
+		memcpy(x, MPC_SHM_STATE(data), sizeof(*x)*data->state_num);
+		*time = data->state_time;
+		*posted = data->state_posted;
+		__sync_synchronize();
+		/* written again while copying: a newer state is there */
+	} while (data->state_seq != seq);
+	if (data->state_taken > 0) {
+		/* states between the last taken and this one never read */
+		data->stats_int[MPC_STATS_INT_LOST] +=
+			(int)((seq-data->state_taken)/2-1);
+	}
+	data->state_taken = seq;
+	return seq;
+}
+
+/*
+ * Periodic release of MPC (MPC_WAIT_PERIODIC): sleep until ctrl_spin
+ * usec before the release, poll until it, and set the next one.  If
+ * late, the releases already passed are skipped.
+ */
+static void mpc_ctrl_release(struct shared_data * data)
+{
+	struct timespec ts, now;
+	double t, release, period = data->ctrl_period;
+	uint64_t missed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	t = (double)now.tv_sec+(double)now.tv_nsec*1e-9;
+	release = data->ctrl_release > 0 ? data->ctrl_release : t;
+	if (t > release && data->ctrl_release > 0) {
+		/* last step ended after this release */
+		data->stats_int[MPC_STATS_INT_OVERRUN]++;
+		missed = (uint64_t)((t-release)/period);
+		release += (double)missed*period;
+	} else if (t < release-data->ctrl_spin*1e-6) {
+		t = release-data->ctrl_spin*1e-6;
+		ts.tv_sec  = (time_t)t;
+		ts.tv_nsec = (long)((t-(double)ts.tv_sec)*1e9);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				       &ts, NULL) == EINTR);
+	}
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		t = (double)now.tv_sec+(double)now.tv_nsec*1e-9;
+	} while (t < release);
+	data->stats_dbl[MPC_STATS_DBL_JITTER] = t-release;
+	data->ctrl_release = release+period;
+}
+
+/*
+ * Period of MPC_WAIT_PERIODIC (see mpc_plant.h)
+ */
+int mpc_ctrl_period_set(struct shared_data * data, double period)
+{
+	if (!isfinite(period) || period <= 0)
+		return -1;
+	data->ctrl_period = period;
+	return 0;
+}
+
+/*
+ * Wait for a new state (see mpc_plant.h)
+ */
+uint64_t mpc_ctrl_state_wait(struct shared_data * data,
+			     double * x, double * time, double * posted)
+{
+	struct timespec start, now;
+	uint64_t seq;
+	uint32_t val;
+
+	if (data->ctrl_wait == MPC_WAIT_PERIODIC) {
+		/* released by time: the state may be the old one */
+		mpc_ctrl_release(data);
+		return mpc_ctrl_state_take(data, x, time, posted);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((seq = mpc_ctrl_state_take(data, x, time, posted)) == 0) {
+		if (data->ctrl_wait == MPC_WAIT_POLL)
+			continue;
+		if (data->ctrl_wait == MPC_WAIT_SPIN) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (mpc_plant_elapsed(&start, &now) <
+			    data->ctrl_spin*1e-6)
+				continue;
+		}
+		/* Announce the sleep, then check again before it */
+		val = data->state_futex;
+		data->state_waiting = 1;
+		__sync_synchronize();
+		if ((seq = mpc_ctrl_state_take(data, x, time, posted)) != 0) {
+			data->state_waiting = 0;
+			break;
+		}
+		mpc_futex_wait(&data->state_futex, val, 0);
+		data->state_waiting = 0;
+	}
+	return seq;
+}
+
+/*
+ * Write the input in the ring (see mpc_plant.h)
+ */
+void mpc_ctrl_input_write(struct shared_data * data,
+			  const double * u, uint64_t state_seq)
+{
+	struct mpc_input_rec * rec;
+	struct timespec now;
+	uint64_t k;
+
+	k = data->input_head;
+	rec = MPC_SHM_RING(data, k);
+	rec->seq = 2*k+1; /* odd: being written */
+	__sync_synchronize();
+	memcpy(MPC_RING_INPUT(rec), u, sizeof(*u)*data->input_num);
+	rec->state_seq = state_seq;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	rec->time = (double)now.tv_sec+(double)now.tv_nsec*1e-9;
+	__sync_synchronize();
+	rec->seq = 2*(k+1);
+	__sync_synchronize();
+	data->input_head = k+1;
+
+	/* Wake up the plant, only if sleeping */
+	data->input_futex++;
+	__sync_synchronize();
+	if (data->input_waiting)
+		mpc_futex_wake(&data->input_futex);
+}
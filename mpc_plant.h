@@ -0,0 +1,128 @@
+#ifndef _MPC_PLANT_H_
+#define _MPC_PLANT_H_
+#include "mpc_interface.h"
+
+/*
+ * Helper library for the named shared memory of the MPC controllers
+ * and for the plant side of it (see mpc_interface.h).  No system call
+ * is made, but when creating/attaching/detaching and for the futex
+ * wait/wake.
+ */
+
+/*
+ * Create the shared memory of size bytes of the MPC controller of
+ * instance name (MPC_SHM_DEFAULT if NULL), zeroed, with options opts
+ * (MPC_SHM_HUGETLB, MPC_SHM_MLOCK). If left by a controller no longer
+ * running, the old one is removed first. Return the pointer to it, or
+ * NULL on error (for example, if the instance is in use).
+ */
+struct shared_data * mpc_shm_create(const char * name, size_t size,
+				    int opts);
+
+/*
+ * Detach (if data is not NULL) and remove the shared memory of the
+ * instance name
+ */
+void mpc_shm_remove(const char * name, struct shared_data * data);
+
+/*
+ * Store in names the instance names of the running MPC controllers, up
+ * to max. Return how many.
+ */
+int mpc_shm_list(char (*names)[MPC_SHM_NAME_LEN], int max);
+
+/*
+ * Attach the shared memory created by the MPC controller of instance
+ * name (MPC_SHM_DEFAULT if NULL). Return the pointer to it, or NULL if
+ * not available.
+ */
+struct shared_data * mpc_plant_attach(const char * name);
+
+/*
+ * Detach the shared memory
+ */
+void mpc_plant_detach(struct shared_data * data);
+
+/*
+ * Write the state x (state_num long) in the state slot, with the time
+ * (CLOCK_MONOTONIC, sec) when it was sampled. If time is zero, the
+ * current time is used. Return the seq of the state written, to be
+ * matched with the one of the input answering it.
+ */
+uint64_t mpc_plant_state_write(struct shared_data * data,
+			       const double * x, double time);
+
+/*
+ * Copy in u (input_num long) the newest input of the ring, if not read
+ * yet. The seq of the state it answers is  stored in *state_seq, if
+ * not NULL. Return 1 if a new input is copied, 0 otherwise.
+ */
+int mpc_plant_input_read(struct shared_data * data,
+			 double * u, uint64_t * state_seq);
+
+/*
+ * Set how mpc_plant_input_wait waits: MPC_WAIT_POLL, MPC_WAIT_SPIN (for
+ * spin usec, then sleeping) or MPC_WAIT_BLOCK. The default is polling.
+ * MPC_WAIT_PERIODIC is for MPC only.
+ */
+void mpc_plant_wait_set(struct shared_data * data,
+			uint32_t mode, double spin);
+
+/*
+ * Wait  until the input answering  the state with seq  state_seq (or a
+ * newer one) is available and copy it in u, as set by mpc_plant_wait_set,
+ * up to timeout seconds (forever if timeout <= 0). Return 0 if the input
+ * is copied, -1 on timeout.  The time from the input written to the
+ * plant awake is stored in data->input_wake.
+ */
+int mpc_plant_input_wait(struct shared_data * data, double * u,
+			 uint64_t state_seq, double timeout);
+
+/*
+ * Futex wait/wake on a word of the shared memory, also used by the MPC
+ * controller. mpc_futex_wait sleeps while *futex == val, up to timeout
+ * seconds (forever if timeout <= 0), or until mpc_futex_wake.
+ */
+void mpc_futex_wait(uint32_t * futex, uint32_t val, double timeout);
+void mpc_futex_wake(uint32_t * futex);
+
+/*
+ * MPC side, used by the MPC controllers
+ */
+
+/*
+ * Copy the newest state written by the plant in x (and its time in
+ * *time, the time it was written in *posted), if not taken yet. Return
+ * its seq (see state_seq in struct shared_data), or 0 if there is no
+ * new state.
+ */
+uint64_t mpc_ctrl_state_take(struct shared_data * data,
+			     double * x, double * time, double * posted);
+
+/*
+ * Wait for a new state as set by data->ctrl_wait, and take it as
+ * mpc_ctrl_state_take. Return its seq. With MPC_WAIT_PERIODIC, wait
+ * for the next release instead (data->ctrl_period, ctrl_spin usec of
+ * polling before it): return 0 if the plant wrote no new state since
+ * the last one taken. The release jitter and the overruns are in the
+ * stats of data.
+ */
+uint64_t mpc_ctrl_state_wait(struct shared_data * data,
+			     double * x, double * time, double * posted);
+
+/*
+ * Set the period (sec) of MPC_WAIT_PERIODIC. Return 0 on success, -1
+ * if period is not finite and positive (such as the NaN sampling
+ * period of a discrete model with no "sampling_period"): the period
+ * is then left unchanged.
+ */
+int mpc_ctrl_period_set(struct shared_data * data, double period);
+
+/*
+ * Write the input u in the next record of the ring of inputs, as the
+ * answer to the state with seq state_seq
+ */
+void mpc_ctrl_input_write(struct shared_data * data,
+			  const double * u, uint64_t state_seq);
+
+#endif /* _MPC_PLANT_H_ */
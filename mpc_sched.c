@@ -0,0 +1,238 @@
+/*
+ * mpc_sched.c
+ *
+ * Scheduling of the MPC processes and threads (see mpc_sched.h)
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "mpc_sched.h"
+
+/* Put this macro where debugging is needed */
+#define PRINT_ERROR(x) {fprintf(stderr, "%s:%d errno=%i, %s\n",	\
+				__FILE__, __LINE__, errno, (x));}
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+#ifndef SCHED_FLAG_RESET_ON_FORK
+#define SCHED_FLAG_RESET_ON_FORK 0x01
+#endif
+
+/* Argument of sched_setattr(2), not in all C libraries */
+struct mpc_sched_attr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t  sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;   /* nsec */
+	uint64_t sched_deadline;  /* nsec */
+	uint64_t sched_period;    /* nsec */
+};
+
+/*
+ * Default scheduling (see mpc_sched.h)
+ */
+void mpc_sched_init(mpc_sched * s, int cpu)
+{
+	bzero(s, sizeof(*s));
+	s->policy = MPC_SCHED_FIFO;
+	if (cpu >= 0)
+		snprintf(s->cpus, sizeof(s->cpus), "%d", cpu);
+	s->pct = MPC_SCHED_PCT;
+	s->margin = MPC_SCHED_MARGIN;
+	s->profile_len = MPC_SCHED_PROFILE;
+}
+
+/*
+ * Set the policy of the invoking thread (see mpc_sched.h)
+ */
+int mpc_sched_setattr(uint32_t policy, uint32_t prio,
+		      double runtime, double deadline, double period)
+{
+	struct mpc_sched_attr attr;
+
+	bzero(&attr, sizeof(attr));
+	attr.size = sizeof(attr);
+	switch (policy) {
+	case MPC_SCHED_FIFO:
+		attr.sched_policy = SCHED_FIFO;
+		attr.sched_priority = prio > 0 ? prio :
+			(uint32_t)sched_get_priority_max(SCHED_FIFO);
+		break;
+	case MPC_SCHED_DEADLINE:
+		attr.sched_policy = SCHED_DEADLINE;
+		/* threads made by the task, if any, are not deadline */
+		attr.sched_flags = SCHED_FLAG_RESET_ON_FORK;
+		attr.sched_runtime  = (uint64_t)(runtime*1e9);
+		attr.sched_deadline = (uint64_t)(deadline*1e9);
+		attr.sched_period   = (uint64_t)(period*1e9);
+		break;
+	default:
+		attr.sched_policy = SCHED_OTHER;
+	}
+	return (int)syscall(SYS_sched_setattr, 0, &attr, 0);
+}
+
+/*
+ * Pin the invoking thread (see mpc_sched.h)
+ */
+int mpc_sched_pin(const char * cpus)
+{
+	cpu_set_t mask;
+	const char * p = cpus;
+	char * end;
+	long first, last;
+
+	CPU_ZERO(&mask);
+	while (*p != '\0') {
+		first = last = strtol(p, &end, 10);
+		if (end == p || first < 0)
+			break;
+		if (*end == '-')
+			last = strtol(end+1, &end, 10);
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET((int)first, &mask);
+		p = *end == ',' ? end+1 : end;
+		if (*end != ',')
+			break;
+	}
+	if (*p != '\0' || CPU_COUNT(&mask) == 0) {
+		PRINT_ERROR("wrong list of CPUs");
+		return -1;
+	}
+	if (sched_setaffinity(0, sizeof(mask), &mask) != 0) {
+		PRINT_ERROR("sched_setaffinity");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Pin and set the initial policy (see mpc_sched.h)
+ */
+int mpc_sched_start(mpc_sched * s)
+{
+	if (s->policy == MPC_SCHED_DEADLINE && s->runtime <= 0)
+		s->profile = calloc(s->profile_len, sizeof(*s->profile));
+	if (s->cpus[0] != '\0' && mpc_sched_pin(s->cpus) != 0)
+		return -1;
+	if (mpc_sched_setattr(s->policy == MPC_SCHED_OTHER ?
+			      MPC_SCHED_OTHER : MPC_SCHED_FIFO,
+			      s->prio, 0, 0, 0) != 0) {
+		PRINT_ERROR("sched_setattr (running as non-RT)");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Percentile by nearest rank (see mpc_sched.h)
+ */
+static int mpc_sched_cmp(const void * a, const void * b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+double mpc_sched_percentile(double * t, size_t n, double pct)
+{
+	size_t rank;
+
+	if (n == 0)
+		return 0;
+	qsort(t, n, sizeof(*t), mpc_sched_cmp);
+	rank = (size_t)(pct/100*(double)n+0.5);
+	return t[rank > 0 ? (rank <= n ? rank-1 : n-1) : 0];
+}
+
+/*
+ * Record a solve time, then SCHED_DEADLINE (see mpc_sched.h)
+ */
+int mpc_sched_profile(mpc_sched * s, double time)
+{
+	if (s->policy != MPC_SCHED_DEADLINE || s->active)
+		return 0;
+	if (s->runtime <= 0) {
+		s->profile[s->profile_num++] = time;
+		if (s->profile_num < s->profile_len)
+			return 0;
+		s->runtime = s->margin*mpc_sched_percentile(
+			s->profile, s->profile_num, s->pct);
+	}
+	if (s->period <= 0) {
+		PRINT_ERROR("no period of SCHED_DEADLINE");
+		s->policy = MPC_SCHED_FIFO;
+		return 0;
+	}
+	if (s->runtime > s->period) {
+		PRINT_ERROR("solve longer than the period: runtime cut");
+		s->runtime = s->period;
+	}
+	if (mpc_sched_setattr(MPC_SCHED_DEADLINE, 0, s->runtime,
+			      s->period, s->period) != 0) {
+		/* EPERM if pinned out of a cpuset, EBUSY if not admitted */
+		PRINT_ERROR("SCHED_DEADLINE not set: staying at SCHED_FIFO");
+		s->policy = MPC_SCHED_FIFO;
+		return 0;
+	}
+	fprintf(stderr, "SCHED_DEADLINE: runtime %.1f usec every %.1f usec\n",
+		s->runtime*1e6, s->period*1e6);
+	s->active = 1;
+	return 1;
+}
+
+/*
+ * Lock and prefault the memory (see mpc_sched.h)
+ */
+int mpc_sched_mem_lock(void)
+{
+	volatile char stack[MPC_SCHED_STACK];
+	size_t i, page;
+
+	/* freed memory kept, no mmap by malloc: no new fault later */
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	page = (size_t)sysconf(_SC_PAGESIZE);
+	for (i=0; i < sizeof(stack); i += page)
+		stack[i] = 0;
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		PRINT_ERROR("mlockall failed: memory not locked");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Page faults since the last call (see mpc_sched.h)
+ */
+void mpc_sched_faults(mpc_sched * s, int * minor, int * major)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	*minor = (int)(ru.ru_minflt-s->minflt);
+	*major = (int)(ru.ru_majflt-s->majflt);
+	s->minflt = ru.ru_minflt;
+	s->majflt = ru.ru_majflt;
+}
+
+/*
+ * Release the profile (see mpc_sched.h)
+ */
+void mpc_sched_free(mpc_sched * s)
+{
+	free(s->profile);
+	s->profile = NULL;
+}
@@ -0,0 +1,125 @@
+#ifndef _MPC_SCHED_H_
+#define _MPC_SCHED_H_
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Scheduling of the MPC processes and threads, by sched_setattr(2)
+ * and sched_setaffinity(2) directly (no sudo/chrt). A controller
+ * either runs at a fixed priority (SCHED_FIFO) or with a reserved
+ * bandwidth (SCHED_DEADLINE): runtime every period, with the deadline
+ * at the end of the period. The runtime may be given or taken from
+ * the measured solve times, as a percentile times a margin.  For
+ * example, the MPC loop is
+ *
+ *	mpc_sched_init(&s, MPC_CPU_ID);
+ *	mpc_sched_start(&s);           (pinned, at SCHED_FIFO)
+ *	if (s.period <= 0) s.period = tau;
+ *	...
+ *	while (...) {
+ *		...solve...
+ *		mpc_sched_profile(&s, solve_time);
+ *	}
+ *
+ * and it moves to SCHED_DEADLINE after profiling. The process and the
+ * other threads of the MPC problem (obstacle regions) are created
+ * before then, since a SCHED_DEADLINE task cannot fork.
+ *
+ * SCHED_DEADLINE requires the task to be allowed all CPUs of its root
+ * domain: to pin a deadline task, start it in an exclusive cpuset
+ * (for example by "cset shield") and give the CPUs of that cpuset. If
+ * not allowed, the task stays at SCHED_FIFO. A deadline task waiting
+ * by polling consumes its runtime: use the "block" waiting mode.
+ */
+
+/* Policies */
+#define MPC_SCHED_OTHER    0   /* not real-time */
+#define MPC_SCHED_FIFO     1   /* fixed priority */
+#define MPC_SCHED_DEADLINE 2   /* reserved runtime every period */
+
+#define MPC_SCHED_CPUS_LEN 64    /* max length of a list of CPUs */
+#define MPC_SCHED_PROFILE  200   /* default solves profiled */
+#define MPC_SCHED_PCT      99.0  /* default percentile of solve times */
+#define MPC_SCHED_MARGIN   1.2   /* default runtime/percentile */
+#define MPC_SCHED_STACK (256*1024) /* bytes of stack pre-touched */
+
+typedef struct {
+	uint32_t policy;     /* MPC_SCHED_* */
+	uint32_t prio;       /* SCHED_FIFO priority, 0: the max */
+	char cpus[MPC_SCHED_CPUS_LEN]; /* such as "1,3-4", "": any CPU */
+	double period;       /* SCHED_DEADLINE period (sec), 0: not set */
+	double runtime;      /* SCHED_DEADLINE runtime (sec), 0: profiled */
+	double pct;          /* percentile of the solve times profiled */
+	double margin;       /* runtime = margin*percentile */
+	size_t profile_len;  /* solves to be profiled */
+	size_t profile_num;  /* solves profiled so far */
+	double * profile;    /* solve times (sec) profiled */
+	int active;          /* 1: at SCHED_DEADLINE */
+	long minflt, majflt; /* page faults of the thread until the last
+				mpc_sched_faults */
+} mpc_sched;
+
+/*
+ * Default scheduling: max SCHED_FIFO priority on CPU cpu (any CPU if
+ * negative). The period of SCHED_DEADLINE, typically the sampling
+ * period of the model, must be set before mpc_sched_profile.
+ */
+void mpc_sched_init(mpc_sched * s, int cpu);
+
+/*
+ * Pin the invoking thread to s->cpus and set it to SCHED_FIFO (also if
+ * s->policy is MPC_SCHED_DEADLINE, until mpc_sched_profile) or
+ * SCHED_OTHER. Return 0 on success, -1 on error (when not allowed).
+ */
+int mpc_sched_start(mpc_sched * s);
+
+/*
+ * Record the solve time (sec) of the invoking thread. If s->policy is
+ * MPC_SCHED_DEADLINE, after profiling s->profile_len solves (at once
+ * if s->runtime is given), the thread is moved to SCHED_DEADLINE with
+ * s->runtime. Return 1 if moved now, 0 otherwise.
+ */
+int mpc_sched_profile(mpc_sched * s, double time);
+
+/*
+ * Percentile pct (in [0,100]) of the n times t, by nearest rank. The
+ * array t is sorted.
+ */
+double mpc_sched_percentile(double * t, size_t n, double pct);
+
+/*
+ * Set the policy of the invoking thread: priority prio for SCHED_FIFO,
+ * runtime/deadline/period (sec) for SCHED_DEADLINE. Return the value of
+ * sched_setattr.
+ */
+int mpc_sched_setattr(uint32_t policy, uint32_t prio,
+		      double runtime, double deadline, double period);
+
+/*
+ * Pin the invoking thread to the list of CPUs cpus (such as "1,3-4").
+ * Return 0 on success, -1 on error.
+ */
+int mpc_sched_pin(const char * cpus);
+
+/*
+ * Prepare the memory of the process for real time, before building the
+ * MPC problems: all its pages, present and future (heap, stacks of the
+ * threads, shared memory), are locked in RAM and populated, malloc
+ * never gives memory back to the system, and MPC_SCHED_STACK bytes of
+ * the stack of the invoking thread are touched. Return 0 on success,
+ * -1 if the memory is not locked (no CAP_IPC_LOCK, RLIMIT_MEMLOCK).
+ */
+int mpc_sched_mem_lock(void);
+
+/*
+ * Store in *minor and *major the page faults of the invoking thread
+ * since the last call (since its start at the first call)
+ */
+void mpc_sched_faults(mpc_sched * s, int * minor, int * major);
+
+/*
+ * Release the profile
+ */
+void mpc_sched_free(mpc_sched * s);
+
+#endif /* _MPC_SCHED_H_ */
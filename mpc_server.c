@@ -22,10 +22,10 @@
 #include "dyn.h"
 #include "mpc.h"
 #include "mpc_interface.h"
+#include "mpc_sched.h"
 
 #define PORT_MATLAB 6004
 /*#define PORT_SOLVER 6001*/
-#define STRLEN_COMMAND 100
 
 #define USE_DUAL
 #define CLIENT_SOLVER
@@ -38,7 +38,9 @@
  * initialization. Otherwise using state zero to initialize the problem
  *
  * CLIENT_SOLVER, expect UDP messages from a solver of the format as
- * in the struct mpc_status defined in mpc.h
+ * in the struct mpc_offload_hdr of mpc_interface.h, followed by the
+ * struct mpc_status defined in mpc.h. The problem of the mode of the
+ * header is solved, if its model_id is the one of the header
  *
  * CLIENT_MATLAB, expect UPD messages from Matlab: receiving the plant
  * state x and sending the MPC optimal input u. That's is
@@ -51,8 +53,8 @@
  *
  * DEBUG_SIMPLEX, turn on all Simplex messages for debugging
  *
- * HAVE_OBSTACLE, allow problem formulation with obstacles (WARNING:
- * not working!!! Consider fixing or removing the obstacle stuff)
+ * HAVE_OBSTACLE, unused: the obstacle in the "obstacle" field of
+ * JSON, if any, is always added
  *
  * PRINT_MAT, print matrices (dont remember really how much stuff is
  * printed)
@@ -75,12 +77,6 @@
 
 #define DONTCARE 0 /* any constant to be ignored */
 
-/*
- * Set prio priority (high number => high priority) and pin the
- * invoking process to CPU cpu_id
- */
-void sched_set_prio_affinity(uint32_t prio, int cpu_id);
-
 /*
  * MPC controller
  *
@@ -90,11 +86,6 @@ void sched_set_prio_affinity(uint32_t prio, int cpu_id);
  */
 void ctrl_by_mpc(const gsl_vector * x, gsl_vector * u, void *param);
 
-/*
- * Initializing the model with JSON file
- */
-int model_mpc_startup(mpc_glpk * mpc, struct json_object * in);
-
 /*
  * This is code should be invoked as:
  *
@@ -105,13 +96,17 @@ int model_mpc_startup(mpc_glpk * mpc, struct json_object * in);
  * the PORT_* #define
  */
 int main(int argc, char *argv[]) {
-	mpc_glpk my_mpc;
+	mpc_glpk * my_mpc, *mode_mpc;
+	int mode, mode_num;
 #ifdef CLIENT_MATLAB
 	gsl_vector *x, *u;	
 	size_t i;
 #endif
 #ifdef CLIENT_SOLVER
-	mpc_status * mpc_st;
+	mpc_status * mpc_st, **mode_st;
+	struct mpc_offload_hdr * hdr;
+	struct timespec t_recv, t_solved;
+	int minflt, majflt;
 #endif
 #ifdef TEST_PARTIAL_OPTIMIZATION
 	struct timespec tic, toc;
@@ -125,12 +120,13 @@ int main(int argc, char *argv[]) {
 	uint16_t port;
 	uint64_t * buf_in, *buf_out; /* as many bytes as double */
 
-	struct json_object *model_json;
+	struct json_object *model_json, *mode_json;
 	struct json_tokener * tok;
 
 	int listenfd;
 	socklen_t len;
 	struct sockaddr_in servaddr, cliaddr;
+	mpc_sched sched;
 	
 	if (argc <= 1) {
 		PRINT_ERROR("Too few arguments. 1 needed: <JSON model>");
@@ -154,8 +150,22 @@ int main(int argc, char *argv[]) {
 	model_json = json_tokener_parse_ex(tok, buffer, (int)size);
 	free(buffer);
 
-	/* Initializing the model */
-	model_mpc_startup(&my_mpc, model_json);
+	/* Memory locked and prefaulted before building the problem */
+	mpc_sched_mem_lock();
+
+	/* Initializing the model of each mode, selected by its id */
+	mode_num = mpc_json_mode_num(model_json);
+	mode_mpc = calloc((size_t)mode_num, sizeof(*mode_mpc));
+	for (mode=0; mode < mode_num; mode++) {
+		mode_json = mpc_json_mode(model_json, mode);
+		mpc_startup(mode_mpc+mode, mode_json, NULL);
+#ifdef DEBUG_SIMPLEX
+		mode_mpc[mode].param->msg_lev = GLP_MSG_DBG; /* all messages */
+		mode_mpc[mode].param->out_frq = 1;   /* output every iteration */
+#endif
+		json_object_put(mode_json);
+	}
+	my_mpc = mode_mpc;
 
 	/* Opening socket and all server stuff */
 #ifdef CLIENT_MATLAB
@@ -172,36 +182,46 @@ int main(int argc, char *argv[]) {
 		PRINT_ERROR("issue in bind");
 	printf("MPC server up and running: listening behind port %d\n", port);
 
-	/* Pin server to a CPU different than client */
-	sched_set_prio_affinity(sched_get_priority_max(SCHED_FIFO),
-				(MPC_CPU_ID-1)%2);
-	/*
-	CPU_ZERO(&my_mask);
-	CPU_SET(0, &my_mask);
-	sched_setaffinity(0, sizeof(my_mask), &my_mask); */
+	/* Pin server to a CPU different than client ("server_sched") */
+	mpc_sched_init(&sched, (MPC_CPU_ID-1)%2);
+	mpc_json_sched(model_json, "server_sched", &sched);
+	mpc_sched_start(&sched);
+	if (sched.period <= 0)
+		sched.period = my_mpc->model->tau;
 	
 	/* Pre-allocating vectors */
 #ifdef CLIENT_MATLAB
-	x = gsl_vector_calloc(my_mpc.model->n);
-	u = gsl_vector_calloc(my_mpc.model->m);
+	x = gsl_vector_calloc(my_mpc->model->n);
+	u = gsl_vector_calloc(my_mpc->model->m);
 	buf_in   = (unsigned long *)x->data;
 	buf_out  = (unsigned long *)u->data;
 	size_in  = sizeof(*buf_in)*x->size;
 	size_out = sizeof(*buf_out)*u->size;
 #endif
 #ifdef CLIENT_SOLVER
-	mpc_st = mpc_status_alloc(&my_mpc);
-	buf_in = buf_out = mpc_st->block;
-	size_in = size_out = mpc_st->size;
+	/* Requests received apart, in the largest status of the modes */
+	mode_st = calloc((size_t)mode_num, sizeof(*mode_st));
+	size_in = 0;
+	for (mode=0; mode < mode_num; mode++) {
+		mode_st[mode] = mpc_status_alloc(mode_mpc+mode);
+		if (mode_st[mode]->size > size_in)
+			size_in = mode_st[mode]->size;
+		/* Dry step: no page fault at the first requests */
+		mpc_prefault(mode_mpc+mode, mode_st[mode]);
+	}
+	size_in += sizeof(*hdr);
+	buf_in = buf_out = malloc(size_in);
+	hdr = (struct mpc_offload_hdr *)buf_in;
+	mpc_sched_faults(&sched, &minflt, &majflt);
 #endif
 	/* Server cycle: Listening forever  */
 	for (k=0; /* never stop */; k++) {
 		len = sizeof(cliaddr);
+		size = recvfrom(listenfd, buf_in, size_in,
+				0, (struct sockaddr*)&cliaddr, &len);
 #ifdef TEST_PARTIAL_OPTIMIZATION
-		num = (int)
+		num = (int)size;
 #endif
-		  recvfrom(listenfd, buf_in, size_in, 
-				    0, (struct sockaddr*)&cliaddr, &len);
 #ifdef CLIENT_MATLAB
 		/* 
 		 * Receiving  the   state  x  via  an   UDP  datagram.
@@ -220,11 +240,11 @@ int main(int argc, char *argv[]) {
 #endif /* PRINT_LOG */
 
 		/* Getting steps and time of simplex */
-		num = (long)glp_get_it_cnt(my_mpc.op);
+		num = (long)glp_get_it_cnt(my_mpc->op);
 		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tic);
-		ctrl_by_mpc(x, u, &my_mpc);
+		ctrl_by_mpc(x, u, my_mpc);
 		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &toc);
-		num = glp_get_it_cnt(my_mpc.op) - num;
+		num = glp_get_it_cnt(my_mpc->op) - num;
 		time =  (double)(toc.tv_sec-tic.tv_sec);
 		time += (double)(toc.tv_nsec-tic.tv_nsec)*1e-9;
 #ifdef PRINT_LOG
@@ -239,10 +259,32 @@ int main(int argc, char *argv[]) {
 		}
 #endif /* CLIENT_MATLAB */
 #ifdef CLIENT_SOLVER
+		/* Problem of the mode of the request */
+		if (size < (ssize_t)sizeof(*hdr) ||
+		    hdr->version != MPC_OFFLOAD_VERSION ||
+		    hdr->mode >= (uint32_t)mode_num ||
+		    (size_t)size != sizeof(*hdr)+mode_st[hdr->mode]->size) {
+			PRINT_ERROR("request of unknown version/mode: dropped");
+			continue;
+		}
+		mode = (int)hdr->mode;
+		my_mpc = mode_mpc+mode;
+		mpc_st = mode_st[mode];
+		memcpy(mpc_st->block, hdr+1, mpc_st->size);
+		/*
+		 * Settings of the client (also if commands missed), tau
+		 * included, then its model checked by the id
+		 */
+		mpc_status_conf_apply(my_mpc, mpc_st);
+		if (my_mpc->model_id != hdr->model_id) {
+			PRINT_ERROR("request of another model: dropped");
+			continue;
+		}
 #ifdef PRINT_LOG
-		printf("MESSAGE: %ld\n", k);
+		printf("MESSAGE: %ld, seq %lu, mode %d\n", k,
+		       (unsigned long)hdr->seq, mode);
 		fprintf(stdout, "status received\n");
-		mpc_status_fprintf(stdout, &my_mpc, mpc_st);
+		mpc_status_fprintf(stdout, my_mpc, mpc_st);
 #endif /* PRINT_LOG */
 		/* 
 		 * Condition to launch MPC server: current solution is
@@ -253,14 +295,14 @@ int main(int argc, char *argv[]) {
 		     *mpc_st->dual_stat != GLP_FEAS) &&
 		    *mpc_st->steps_bdg > 0 && *mpc_st->time_bdg > 0) {
 			/* Resuming the status of the solver just received */
-			mpc_status_resume(&my_mpc, mpc_st);
+			mpc_status_resume(my_mpc, mpc_st);
 		
 			/* Solve it by Simplex and measure time/steps */
-			num = glp_get_it_cnt(my_mpc.op);
+			num = glp_get_it_cnt(my_mpc->op);
 			clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tic);
-			glp_simplex(my_mpc.op, my_mpc.param);
+			mpc_optimize(my_mpc);
 			clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &toc);
-			num = glp_get_it_cnt(my_mpc.op) - num;
+			num = glp_get_it_cnt(my_mpc->op) - num;
 			time =  (double)(toc.tv_sec-tic.tv_sec);
 			time += (double)(toc.tv_nsec-tic.tv_nsec)*1e-9;
 
@@ -269,7 +311,7 @@ int main(int argc, char *argv[]) {
 			*mpc_st->time_bdg  = time;
 
 			/* Saving the updated solver status: ready to send */
-			mpc_status_save(&my_mpc, mpc_st);
+			mpc_status_save(my_mpc, mpc_st);
 		} else {
 			/* Do nothing. Just set to 0 the used budgets */
 			*mpc_st->steps_bdg = 0;
@@ -277,26 +319,35 @@ int main(int argc, char *argv[]) {
 		}
 #else
 		/* update initial state */
-		mpc_status_set_x0(&my_mpc, mpc_st);
-		glp_simplex(my_mpc.op, my_mpc.param);
-		mpc_status_save(&my_mpc, mpc_st);
+		clock_gettime(CLOCK_MONOTONIC, &t_recv);
+		mpc_status_set_x0(my_mpc, mpc_st);
+		mpc_optimize(my_mpc);
+		mpc_status_save(my_mpc, mpc_st);
+		clock_gettime(CLOCK_MONOTONIC, &t_solved);
+		mpc_sched_profile(&sched,
+				  (double)(t_solved.tv_sec-t_recv.tv_sec)+
+				  (double)(t_solved.tv_nsec-t_recv.tv_nsec)*1e-9);
 #endif  /* TEST_PARTIAL_OPTIMIZATION */
+		mpc_sched_faults(&sched, &minflt, &majflt);
 #ifdef PRINT_LOG
 		printf("MESSAGE: %ld\n", k);
 		fprintf(stdout, "status after optimization\n");
-		mpc_status_fprintf(stdout, &my_mpc, mpc_st);
+		mpc_status_fprintf(stdout, my_mpc, mpc_st);
+		printf("page faults: %d minor, %d major\n", minflt, majflt);
 #endif /* PRINT_LOG */
+		/* Reply: the header of the request, then the status solved */
+		memcpy(hdr+1, mpc_st->block, mpc_st->size);
+		size_out = sizeof(*hdr)+mpc_st->size;
 #endif /* CLIENT_SOLVER */
 		sendto(listenfd, buf_out, size_out, 0, 
 		       (struct sockaddr*)&cliaddr, sizeof(cliaddr));
 	}
 
 	/* Free all */
-	free(my_mpc.model);
-	gsl_vector_free(my_mpc.w);
-	gsl_vector_free(my_mpc.x0);
-	glp_delete_prob(my_mpc.op);
-	free(my_mpc.param);
+	for (mode=0; mode < mode_num; mode++) {
+		mpc_free(mode_mpc+mode);
+	}
+	free(mode_mpc);
 
 	return 0;
 }
@@ -317,110 +368,12 @@ void ctrl_by_mpc(const gsl_vector * x, gsl_vector * u, void *param)
 	gsl_vector_memcpy (my_mpc->x0, x);
 	mpc_update_x0(my_mpc);
 
-	/* Solve it by Simplex method */
-	glp_simplex(my_mpc->op, my_mpc->param);
+	/* Solve it by Simplex method (or branch-and-bound if obstacle) */
+	mpc_optimize(my_mpc);
 
 	/* Getting the solution. FIXME: need a more efficient way */
 	for (i = 0; i < my_mpc->model->m; i++) {
 		gsl_vector_set(u, i,
-			       glp_get_col_prim(my_mpc->op,
-						my_mpc->v_U+(int)i));
-	}
-}
-
-int model_mpc_startup(mpc_glpk * mpc, struct json_object * in)
-{
-	/* Cleanup the MPC struct */
-	bzero(mpc,sizeof(*mpc));
-	
-	/* Init the solver control parameters */
-	mpc->param = malloc(sizeof(*(mpc->param)));
-	glp_init_smcp(mpc->param);
-#ifdef DEBUG_SIMPLEX
-	mpc->param->msg_lev = GLP_MSG_DBG; /* all messages */
-	mpc->param->out_frq = 1;           /* output every iteration */
-#else
-	mpc->param->msg_lev = GLP_MSG_OFF; /* no message */
-#endif
-	mpc->param->meth    = GLP_DUAL;    /* dual simplex */
-
-#if 1
-	mpc->param->it_lim  = INT_MAX;     /* max num of iterations */
-#else
-	mpc->param->it_lim  = 15;     /* max num of iterations */
-#endif
-
-	/* Initialize the plant */
-	mpc->model = malloc(sizeof(*(mpc->model)));
-	dyn_init_discrete(mpc->model, in);
-
-	/* Setting up a GLPK problem instance */
-	mpc->op = glp_create_prob();
-	glp_set_prob_name(mpc->op, "Model Predictive Control");
-
-	/* Setting up variables and bounds of control inputs */
-	mpc_input_addvar(mpc, in);
-	mpc_input_set_bnds(mpc, in);
-
-	/* Setting up constraints: bounding input variation */
-	/*	mpc_input_set_delta(mpc, in); */
-
-	/* Add a variable for each norm of states X(1), ..., X(H)*/
-	mpc_state_norm_addvar(mpc, in);
-	
-	/* Setting bounds to the states X(1), ..., X(H)*/
-	mpc_state_set_bnds(mpc, in);
-	
-	/* Set a minimization cost for the MPC */
-	mpc_goal_set(mpc, in);
-
-	/* Warm the solver up with initial state equal to zero */
-	mpc_warmup(mpc);
-	
-	/* 
-	 * Setting the max delta constraint, assuming an initial zero
-	 * input 
-	 */
-	/*
-	u_old = gsl_vector_calloc(mpc->model->m);
-	gsl_vector_set_zero(u_old);
-	mpc_input_set_delta0(mpc, u_old);
-	gsl_vector_free(u_old);
-	*/
-
-	return 0;
-}
-
-void sched_set_prio_affinity(uint32_t prio, int cpu_id)
-{
-	cpu_set_t  mask;
-
-	/* Set CPU affinity */
-	CPU_ZERO(&mask);
-	CPU_SET(cpu_id, &mask);
-	if (sched_setaffinity(0, sizeof(mask), &mask) != 0) {
-		PRINT_ERROR("sched_setaffinity");
-		exit(-1);
+			       mpc_sol_col(my_mpc, my_mpc->v_U+(int)i));
 	}
-
-	/* Set priority */
-#if SCHED_SETATTR_IN_SCHED_H
-	/* EB: TO BE TESTED */
-	struct sched_attr attr;
-	
-	bzero(&attr, sizeof(attr));
-	attr.size = sizeof(attr);
-	attr.sched_policy = SCHED_FIFO;
-	attr.sched_priority = prio;
-	if (sched_setattr(0, &attr, 0) != 0) {
-		PRINT_ERROR("sched_setattr");
-		exit(-1);
-	}
-#else
-	char launched[STRLEN_COMMAND];  /* String with launched command */
-
-	snprintf(launched, STRLEN_COMMAND,
-		 "sudo chrt -f -p %d %d", prio, getpid());
-	system(launched);
-#endif
 }
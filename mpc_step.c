@@ -0,0 +1,153 @@
+/*
+ * mpc_step.c
+ *
+ * A step of the MPC loop of mpc_ctrl and mpc_daemon (see mpc_step.h)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include "mpc_step.h"
+
+/* Put this macro where debugging is needed */
+#define PRINT_ERROR(x) {fprintf(stderr, "%s:%d errno=%i, %s\n",	\
+				__FILE__, __LINE__, errno, (x));}
+
+/*
+ * Ingest of the state (see mpc_step.h)
+ */
+double mpc_step_ingest(struct shared_data * data, const mpc_glpk * mpc,
+		       double * x0, const double * u, double * ref,
+		       double time_wake, double time_plant,
+		       double time_posted)
+{
+	double time_x0;
+
+	/* Predicting the state when the input will be applied */
+	data->stats_dbl[MPC_STATS_DBL_WAKE] = time_wake-time_posted;
+	time_x0 = time_plant > 0 ? time_plant : time_wake;
+	data->stats_dbl[MPC_STATS_DBL_DELAY] =
+		mpc_delay_compensate(mpc, x0, u, time_wake-time_x0);
+	time_x0 += data->stats_dbl[MPC_STATS_DBL_DELAY];
+	if (data->flags & MPC_REF) {
+		/* state reference, then input ref of each step */
+		memcpy(ref, MPC_SHM_REF_STATE(data), sizeof(double)*
+		       data->ref_len*data->state_num);
+		memcpy(ref+data->ref_len*data->state_num,
+		       MPC_SHM_REF_INPUT(data), sizeof(double)*
+		       data->plan_len*data->input_num);
+	} else {
+		/* no reference: regulating to zero */
+		bzero(ref, sizeof(double)*(data->ref_len*data->state_num+
+					   data->plan_len*data->input_num));
+	}
+	return time_x0;
+}
+
+/*
+ * Pending command (see mpc_step.h)
+ */
+int mpc_step_cmd_read(const struct shared_data * data,
+		      uint32_t * cmd, double * cmd_val)
+{
+	uint32_t cmd_seq;
+
+	cmd_seq = data->cmd_seq;
+	if (cmd_seq == data->cmd_ack)
+		return 0;
+	/* new command: read its fields after the seq */
+	cmd[MPC_CMD_SEQ] = cmd_seq;
+	__sync_synchronize();
+	cmd[MPC_CMD_TYPE] = data->cmd_type;
+	cmd[MPC_CMD_INDEX] = data->cmd_index;
+	memcpy(cmd_val, data->cmd_val, sizeof(data->cmd_val));
+	return 1;
+}
+
+/*
+ * Command applicable to all problems (see mpc_step.h)
+ */
+int mpc_step_cmd_valid(const mpc_glpk * mpc, size_t num,
+		       const uint32_t * cmd, const double * cmd_val)
+{
+	size_t k;
+
+	for (k=0; cmd[MPC_CMD_TYPE] == MPC_CMD_TAU && k < num; k++) {
+		if (!mpc_tau_valid(mpc+k, cmd_val[0])) {
+			PRINT_ERROR("tau not changed");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Command acknowledged (see mpc_step.h)
+ */
+void mpc_step_cmd_ack(struct shared_data * data, uint32_t seq, int err)
+{
+	data->cmd_err = (uint32_t)err;
+	/* outcome visible before the ack */
+	__sync_synchronize();
+	data->cmd_ack = seq;
+}
+
+/*
+ * Event trigger (see mpc_step.h)
+ */
+int mpc_step_trigger(struct shared_data * data, const mpc_glpk * mpc,
+		     const double * x0, size_t skip)
+{
+	return skip < mpc->ev_max_skip &&
+		mpc_state_dist(mpc, x0,
+			       MPC_PLAN_STATE(data, MPC_SHM_PLAN(data,
+				       data->plan_cur))+skip*data->state_num)
+		<= mpc->ev_threshold;
+}
+
+/*
+ * Input of the step (see mpc_step.h)
+ */
+int mpc_step_input(struct shared_data * data, const mpc_glpk * mpc,
+		   const mpc_status * st, size_t skip, double * u)
+{
+	size_t m = data->input_num;
+
+	data->stats_int[MPC_STATS_INT_FALLBACK] = 0;
+	if (skip > 0) {
+		memcpy(u, MPC_PLAN_INPUT(MPC_SHM_PLAN(data, data->plan_cur))+
+		       m*(skip < mpc->h_ctrl ? skip : mpc->h_ctrl),
+		       sizeof(double)*m);
+		return 0;
+	}
+	if (*st->sol_stat != MPC_SOL_INFEAS) {
+		memcpy(u, st->input, sizeof(double)*m);
+		return 1;
+	}
+	if (mpc->K_fb != NULL) {
+		mpc_fallback_input(mpc, st->state, u);
+		data->stats_int[MPC_STATS_INT_FALLBACK] = 1;
+	}
+	return 0;
+}
+
+/*
+ * Plan published (see mpc_step.h)
+ */
+void mpc_step_plan_publish(struct shared_data * data, const mpc_glpk * mpc,
+			   uint64_t num, double time, const double * x0,
+			   const double * plan)
+{
+	struct mpc_plan * p;
+
+	p = MPC_SHM_PLAN(data, 1-data->plan_cur);
+	p->seq = 2*num-1; /* odd: being written */
+	__sync_synchronize();
+	p->time = time;
+	memcpy(MPC_PLAN_INPUT(p), plan,
+	       sizeof(double)*data->plan_len*data->input_num);
+	mpc_plan_predict(mpc, x0, plan, MPC_PLAN_STATE(data, p));
+	__sync_synchronize();
+	p->seq++;
+	data->plan_cur = 1-data->plan_cur;
+}
@@ -0,0 +1,95 @@
+#ifndef _MPC_STEP_H_
+#define _MPC_STEP_H_
+#include <stddef.h>
+#include <stdint.h>
+#include "mpc_interface.h"
+#include "mpc.h"
+
+/*
+ * A step of the MPC loop serving a plant through its shared memory,
+ * common to mpc_ctrl and mpc_daemon. After the state is taken (see
+ * mpc_ctrl_state_wait in mpc_plant.h), a step is
+ *
+ *	time_x0 = mpc_step_ingest(data, mpc, x0, u, ref, ...);
+ *	if (mpc_step_cmd_read(data, cmd, cmd_val)) {
+ *		err = !mpc_step_cmd_valid(mpc, 1, cmd, cmd_val);
+ *		...command applied, if no err...
+ *		mpc_step_cmd_ack(data, cmd[MPC_CMD_SEQ], err);
+ *	}
+ *	skip = ...no command... && mpc_step_trigger(data, mpc, x0, skip) ?
+ *		skip+1 : 0;
+ *	...solve, if skip == 0...
+ *	if (mpc_step_input(data, mpc, st, skip, u))
+ *		mpc_step_plan_publish(data, mpc, ++num, time_x0, x0, st->input);
+ *	mpc_ctrl_input_write(data, u, state_seq);
+ *
+ * where the arrays are as in mpc_status.  The shared memory is only
+ * read and written as by mpc_ctrl.
+ */
+
+/*
+ * Ingest of the state x0 (n long) of the plant, taken at time_wake
+ * (CLOCK_MONOTONIC), sampled at time_plant (0 if unknown) and posted at
+ * time_posted: x0 is predicted in place by the delay until the input is
+ * applied (see mpc_delay_compensate), while the input u is held. The
+ * reference is copied in ref (zero if not MPC_REF). Return the time of
+ * x0 (CLOCK_MONOTONIC). The stats of wake-up and delay are set.
+ */
+double mpc_step_ingest(struct shared_data * data, const mpc_glpk * mpc,
+		       double * x0, const double * u, double * ref,
+		       double time_wake, double time_plant,
+		       double time_posted);
+
+/*
+ * Return 1 if a command is pending (not acknowledged yet), then read
+ * in cmd (MPC_CMD_LEN long) and cmd_val (2 long), 0 otherwise
+ */
+int mpc_step_cmd_read(const struct shared_data * data,
+		      uint32_t * cmd, double * cmd_val);
+
+/*
+ * Return 1 if the command may be applied to all the num problems of
+ * mpc, 0 otherwise (a tau not valid for some of them, see
+ * mpc_tau_valid): then it is to be applied to none.
+ */
+int mpc_step_cmd_valid(const mpc_glpk * mpc, size_t num,
+		       const uint32_t * cmd, const double * cmd_val);
+
+/*
+ * Acknowledge the command of seq seq, with its outcome err (1 if not
+ * applied) visible before
+ */
+void mpc_step_cmd_ack(struct shared_data * data, uint32_t seq, int err);
+
+/*
+ * Event trigger: return 1 if the state x0 (predicted by the delay as
+ * X(0) of the plans) is close to the one predicted by the current plan
+ * after skip steps skipped already, and fewer than ev_max_skip were
+ * skipped (see mpc_event_trigger_set). Then the next input of the
+ * plan may be applied without solving. The caller checks that a plan
+ * was published, and that the problem did not change since then.
+ */
+int mpc_step_trigger(struct shared_data * data, const mpc_glpk * mpc,
+		     const double * x0, size_t skip);
+
+/*
+ * Input u to be written at the step: the input of the current plan
+ * after skip steps (if skip > 0), the one solved in st, or, if no
+ * solution, the one of the fallback law (if any, in the stats) or u
+ * itself (the last valid input). Return 1 if the plan of st is new, to
+ * be published, 0 otherwise.
+ */
+int mpc_step_input(struct shared_data * data, const mpc_glpk * mpc,
+		   const mpc_status * st, size_t skip, double * u);
+
+/*
+ * Publish the plan (plan_len*input_num long, as mpc_status->input) of
+ * the num-th solve, from x0 at time time (CLOCK_MONOTONIC), in the plan
+ * buffer not in use, with the states predicted by mpc_plan_predict.
+ * The buffer is then the current one.
+ */
+void mpc_step_plan_publish(struct shared_data * data, const mpc_glpk * mpc,
+			   uint64_t num, double time, const double * x0,
+			   const double * plan);
+
+#endif /* _MPC_STEP_H_ */
@@ -32,6 +32,7 @@
 #include "dyn.h"
 #include "mpc.h"
 #include "mpc_interface.h"
+#include "mpc_plant.h"
 
 #define INIT_X0_JSON
 
@@ -68,11 +69,6 @@
  */
 void ctrl_by_mpc(size_t k, dyn_trace * t, void *param);
 
-/*
- * Initializing the model with JSON file
- */
-int model_mpc_startup(mpc_glpk * mpc, struct json_object * in);
-
 /*
  * GLOBAL VARIABLES
  *
@@ -83,22 +79,22 @@ mpc_status * mpc_st;
 int sockfd;
 gsl_vector *x_k;
 struct shared_data * data;
-double * shared_state;
-double * shared_input;
+double * u_k;
 
 /*
  * This is code should be invoked as:
  *
- * ./sim_plant <JSON model> <number of steps>
+ * ./sim_plant <JSON model> <number of steps> [<instance>]
  *
  * to simulate  a plant described by  the <JSON model> for  <number of
- * steps>.
+ * steps>, controlled by the MPC controller of <instance> (the default
+ * instance if absent).
  */
 int main(int argc, char *argv[]) {
 	mpc_glpk uav_mpc;
 	dyn_trace * uav_trace;
 
-	int model_fd, shm_id;
+	int model_fd;
 	char * buffer;
 	ssize_t size;
 	size_t steps;
@@ -134,7 +130,14 @@ int main(int argc, char *argv[]) {
 	free(buffer);
 
 	/* Initializing the model */
-	model_mpc_startup(&uav_mpc, model_json);
+	mpc_startup(&uav_mpc, model_json, NULL);
+#ifdef DEBUG_SIMPLEX
+	uav_mpc.param->msg_lev = GLP_MSG_DBG; /* all messages */
+#endif
+#ifdef INIT_X0_JSON
+	if (mpc_state_init(&uav_mpc, model_json) != 0)
+		return -1;
+#endif
 #ifdef PRINT_PROBLEM
 	glp_print_sol(uav_mpc.op, "000glpk_sol.txt");
 #endif
@@ -154,14 +157,12 @@ int main(int argc, char *argv[]) {
 	uav_trace = dyn_trace_alloc(uav_mpc.model->n, uav_mpc.model->m, steps);
 
 	/* Getting the shared memory area */
-	shm_id = shmget(MPC_SHM_KEY, 0, 0);
-	if (shm_id == -1) {
-		PRINT_ERROR("shmget failed");
+	if ((data = mpc_plant_attach(argc >= 4 ? argv[3] : NULL)) == NULL) {
+		return -1;
 	}
-	/* Setting up pointers to state/input arrays */
-	data = (struct shared_data *)shmat(shm_id, NULL, 0);
-	shared_state = (double*)(data+1); /* starts just after *data */
-	shared_input = shared_state+data->state_num;
+	u_k = calloc(data->input_num, sizeof(*u_k));
+	mpc_json_wait(model_json, "plant_wait",
+		      &data->plant_wait, &data->plant_spin, NULL);
 
 	/* Computing the system dynamics */
 	dyn_plant_dynamics(uav_mpc.model, uav_mpc.x0, uav_trace,
@@ -176,13 +177,11 @@ int main(int argc, char *argv[]) {
 	gsl_vector_pretty(stdout, uav_trace->time, "%e");
 	printf("\n");
 	/* Free all */
-	free(uav_mpc.model);
-	gsl_vector_free(uav_mpc.w);
-	gsl_vector_free(uav_mpc.x0);
-	glp_delete_prob(uav_mpc.op);
-	free(uav_mpc.param);
+	mpc_free(&uav_mpc);
 	dyn_trace_free(uav_trace);
 	gsl_vector_free(x_k);
+	free(u_k);
+	mpc_plant_detach(data);
 
 	return 0;
 }
@@ -197,111 +196,15 @@ void ctrl_by_mpc(size_t k, dyn_trace * t, void *param)
 	gsl_matrix_get_col(x_k, t->x, k);
 
 	/* Invoke MPC by writing state and then reading input */
-	memcpy(shared_state, x_k->data,
-	       sizeof(*shared_state)*data->state_num);
 	clock_gettime(CLOCK_REALTIME, &before_post);
-	sem_post(data->sems+MPC_SEM_STATE_WRITTEN);
-	sem_wait(data->sems+MPC_SEM_INPUT_WRITTEN);
+	mpc_plant_input_wait(data, u_k,
+			     mpc_plant_state_write(data, x_k->data, 0), 0);
 	clock_gettime(CLOCK_REALTIME, &after_wait);
 	for (i = 0; i < t->m; i++) {
-		gsl_matrix_set(t->u, i, k, shared_input[i]);
+		gsl_matrix_set(t->u, i, k, u_k[i]);
 	}
 	
 	cur_time =  (double)(after_wait.tv_sec-before_post.tv_sec);
 	cur_time += 1e-9*(double)(after_wait.tv_nsec-before_post.tv_nsec);
 	gsl_vector_set(t->time, k, cur_time);
 }
-
-int model_mpc_startup(mpc_glpk * mpc, struct json_object * in)
-{
-#ifdef INIT_X0_JSON
-	size_t i;
-	struct json_object *tmp_elem, *elem;
-#endif
-
-	/* Cleanup the MPC struct */
-	bzero(mpc,sizeof(*mpc));
-	
-	/* Init the solver control parameters */
-	mpc->param = malloc(sizeof(*(mpc->param)));
-	glp_init_smcp(mpc->param);
-#ifdef DEBUG_SIMPLEX
-	mpc->param->msg_lev = GLP_MSG_DBG; /* all messages */
-#else
-	mpc->param->msg_lev = GLP_MSG_OFF; /* no message */
-#endif
-	mpc->param->meth    = GLP_DUAL;    /* dual simplex */
-
-#if 1
-	mpc->param->it_lim  = INT_MAX;     /* max num of iterations */
-#else
-	mpc->param->it_lim  = 2;     /* max num of iterations */
-#endif
-
-	/* Initialize the plant */
-	mpc->model = malloc(sizeof(*(mpc->model)));
-	dyn_init_discrete(mpc->model, in);
-
-	/* Setting up a GLPK problem instance */
-	mpc->op = glp_create_prob();
-	glp_set_prob_name(mpc->op, "Model Predictive Control");
-
-	/* Setting up variables and bounds of control inputs */
-	mpc_input_addvar(mpc, in);
-	mpc_input_set_bnds(mpc, in);
-
-	/* Setting up constraints: bounding input variation */
-	/*	mpc_input_set_delta(mpc, in); */
-
-	/* Add a variable for each norm of states X(1), ..., X(H)*/
-	mpc_state_norm_addvar(mpc, in);
-	
-	/* Setting bounds to the states X(1), ..., X(H)*/
-	mpc_state_set_bnds(mpc, in);
-	
-	/* Set a minimization cost for the MPC */
-	mpc_goal_set(mpc, in);
- 
-#ifdef INIT_X0_JSON
-	/* 
-	 * Get the initial state from JSON, store it in the MPC
-	 * struct, and update the problem accordingly
-	 */
-	if (!json_object_object_get_ex(in, "state_init", &tmp_elem)) {
-		PRINT_ERROR("missing state_init in JSON");
-		return -1;
-	}
-	if ((size_t)json_object_array_length(tmp_elem) != mpc->model->n) {
-		PRINT_ERROR("wrong size of state_init in JSON");
-		return -1;
-	}
-	mpc->x0 = gsl_vector_calloc(mpc->model->n);
-	for (i=0; i < mpc->model->n; i++) {
-		elem = json_object_array_get_idx(tmp_elem, (int)i);
-		errno = 0;
-		mpc->x0->data[i] = json_object_get_double(elem);
-		if (errno) {
-			fprintf(stderr, "%i\n", (int)i);
-			PRINT_ERROR("issues in converting element in state_init");
-			return -1;
-		}
-	}
-	mpc_update_x0(mpc);
-#else
-	mpc_warmup(mpc);
-#endif
-
-	
-	/* 
-	 * Setting the max delta constraint, assuming an initial zero
-	 * input 
-	 */
-	/*
-	u_old = gsl_vector_calloc(mpc->model->m);
-	gsl_vector_set_zero(u_old);
-	mpc_input_set_delta0(mpc, u_old);
-	gsl_vector_free(u_old);
-	*/
-
-	return 0;
-}
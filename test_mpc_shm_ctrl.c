@@ -1,62 +1,60 @@
 #include <time.h>
 #include <stdio.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
+#include <stdlib.h>
 #include <string.h>
-#include <semaphore.h>
 #include <errno.h>
 #include "mpc_interface.h"
+#include "mpc_plant.h"
 
 /* Put this macro where debugging is needed */
 #define PRINT_ERROR(x) {fprintf(stderr, "%s:%d errno=%i, %s\n",	\
 				__FILE__, __LINE__, errno, (x));}
 
-int main() {	
-	int shm_id;
+/*
+ * argv[1]: instance of the MPC controller [OPTIONAL]
+ */
+int main(int argc, char * argv[]) {	
 	struct shared_data * data;
 	struct timespec tic, toc;
 	size_t i;
 	double time_mpc=0;
+	double * input;
 	/* 
 	 * Try changing the values below to test MPC with different
 	 * initial state
 	 */
 	double state_test[] = {0, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 	
-	if (sizeof(state_test)/sizeof(state_test[0]) != MPC_STATE_NUM) {
-		PRINT_ERROR("Warning: state dimension mismatch");
+	if ((data = mpc_plant_attach(argc >= 2 ? argv[1] : NULL)) == NULL) {
+		return -1;
 	}
-	
-	shm_id = shmget(MPC_SHM_KEY, 0, 0);
-	if (shm_id == -1) {
-		PRINT_ERROR("shmget failed");
+	if (sizeof(state_test)/sizeof(state_test[0]) != data->state_num) {
+		PRINT_ERROR("Warning: state dimension mismatch");
+		mpc_plant_detach(data);
 		return -1;
 	}
-	data = (struct shared_data *)shmat(shm_id, NULL, 0);
+	input = calloc(data->input_num, sizeof(*input));
 	
-	/* Create a pointer to the real data in the state vector  */
-	memcpy(data->state, state_test, sizeof(state_test[0])*MPC_STATE_NUM);
-
 	clock_gettime(CLOCK_MONOTONIC, &tic);
 	/* Now asking MPC to compute the optimal input for us... */
-	sem_post(data->sems+MPC_SEM_STATE_WRITTEN);
-	/* ... and waiting to get a response */
-	sem_wait(data->sems+MPC_SEM_INPUT_WRITTEN);
+	mpc_plant_input_wait(data, input,
+			     mpc_plant_state_write(data, state_test, 0), 0);
 	clock_gettime(CLOCK_MONOTONIC, &toc);
 
 	printf("MPC done\nstate:");
-	for (i=0; i<MPC_STATE_NUM; i++) {
-		printf("\t%5.2f", data->state[i]);
+	for (i=0; i<data->state_num; i++) {
+		printf("\t%5.2f", state_test[i]);
 	}
 	printf("\ninput:");
-	for (i=0; i<MPC_INPUT_NUM; i++) {
-		printf("\t%5.2f", data->input[i]);
+	for (i=0; i<data->input_num; i++) {
+		printf("\t%5.2f", input[i]);
 	}
-	time_mpc  = toc.tv_sec-tic.tv_sec;
-	time_mpc += (toc.tv_nsec-tic.tv_nsec)*1e-9;
+	time_mpc  = (double)(toc.tv_sec-tic.tv_sec);
+	time_mpc += (double)(toc.tv_nsec-tic.tv_nsec)*1e-9;
 	printf("\ntime:\t%f\n", time_mpc);
 
 	/* Finally detaching shared memory */
-	shmdt(data);
-
+	free(input);
+	mpc_plant_detach(data);
+	return 0;
 }
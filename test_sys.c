@@ -39,9 +39,6 @@
  *
  * DEBUG_SIMPLEX, turn on all Simplex messages for debugging
  *
- * HAVE_OBSTACLE, allow problem formulation with obstacles (WARNING:
- * not working!!! Consider fixing or removing the obstacle stuff)
- *
  * PRINT_MAT, print matrices (dont remember really how much stuff is
  * printed)
  */
@@ -53,7 +50,6 @@
 #define USE_DUAL
 #define PRINT_PROBLEM
 #define DEBUG_SIMPLEX
-#define HAVE_OBSTACLE
 #define PRINT_MAT
 */
 
@@ -74,11 +70,6 @@
  */
 void ctrl_by_mpc(size_t k, dyn_trace * t, void *param);
 
-/*
- * Initializing the model with JSON file
- */
-int model_mpc_startup(mpc_glpk * mpc, struct json_object * in);
-
 /*
  * GLOBAL VARIABLES
  */
@@ -94,11 +85,6 @@ mpc_status * mpc_st;
 int main(int argc, char *argv[]) {
 	mpc_glpk uav_mpc;
 
-#ifdef HAVE_OBSTACLE
-	/* TO BE FIXED: ADDED TO JSON FILE?? */
-	double center[] = OBSTACLE_CENTER;
-	double radius[] = OBSTACLE_RADIUS;
-#endif
 	dyn_trace * uav_trace;
 
 	int model_fd;
@@ -149,7 +135,17 @@ int main(int argc, char *argv[]) {
 	free(buffer);
 
 	/* Initializing the model */
-	model_mpc_startup(&uav_mpc, model_json);
+	mpc_startup(&uav_mpc, model_json, NULL);
+#ifdef DEBUG_SIMPLEX
+	uav_mpc.param->msg_lev = GLP_MSG_ALL; /* all messages */
+#endif
+#ifndef USE_DUAL
+	uav_mpc.param->meth = GLP_PRIMAL;    /* primal simplex */
+#endif
+#ifdef INIT_X0_JSON
+	if (mpc_state_init(&uav_mpc, model_json) != 0)
+		return -1;
+#endif
 
 	/* Allocating struct of solver status after problem defined */
 	mpc_st = mpc_status_alloc(&uav_mpc);
@@ -205,11 +201,7 @@ int main(int argc, char *argv[]) {
 	fclose(matfile);
 
 	/* Free all */
-	free(uav_mpc.model);
-	gsl_vector_free(uav_mpc.w);
-	gsl_vector_free(uav_mpc.x0);
-	glp_delete_prob(uav_mpc.op);
-	free(uav_mpc.param);
+	mpc_free(&uav_mpc);
 	dyn_trace_free(uav_trace);
 
 	return 0;
@@ -244,19 +236,13 @@ void ctrl_by_mpc(size_t k, dyn_trace * t, void *param)
 	/* resuming old basis for testing purpose */
 	mpc_status_resume(my_mpc, mpc_st);
 	
-#ifdef HAVE_OBSTACLE
-	glp_simplex(my_mpc->op, my_mpc->param);
-	glp_intopt(my_mpc->op, NULL);
-#else
-	/* Solve it by Simplex method */
-	glp_simplex(my_mpc->op, my_mpc->param);
-#endif
+	/* Solve it by Simplex method (or branch-and-bound if obstacle) */
+	mpc_optimize(my_mpc);
 
 	/* Getting the solution */
 	for (i = 0; i < t->m; i++) {
 		gsl_matrix_set(t->u, i, k,
-			       glp_get_col_prim(my_mpc->op,
-						my_mpc->v_U+(int)i));
+			       mpc_sol_col(my_mpc, my_mpc->v_U+(int)i));
 	}
 
 	/* Store optimality of solution */
@@ -275,114 +261,3 @@ void ctrl_by_mpc(size_t k, dyn_trace * t, void *param)
 
 
 }
-
-int model_mpc_startup(mpc_glpk * mpc, struct json_object * in)
-{
-#ifdef HAVE_OBSTACLE
-	/* TO BE FIXED: ADDED TO JSON FILE?? */
-	double center[] = OBSTACLE_CENTER;
-	double radius[] = OBSTACLE_RADIUS;
-#endif
-#ifdef INIT_X0_JSON
-	size_t i;
-	struct json_object *tmp_elem, *elem;
-#endif
-
-	/* Cleanup the MPC struct */
-	bzero(mpc,sizeof(*mpc));
-	
-	/* Init the solver control parameters */
-	mpc->param = malloc(sizeof(*(mpc->param)));
-	glp_init_smcp(mpc->param);
-#ifdef DEBUG_SIMPLEX
-	mpc->param->msg_lev = GLP_MSG_ALL; /* all messages */
-#else
-	mpc->param->msg_lev = GLP_MSG_OFF; /* no message */
-#endif
-#ifdef USE_DUAL
-	mpc->param->meth    = GLP_DUAL;    /* dual simplex */
-#endif
-
-#if 1
-	mpc->param->it_lim  = INT_MAX;     /* max num of iterations */
-#else
-	mpc->param->it_lim  = 15;     /* max num of iterations */
-#endif
-
-	/* Initialize the plant */
-	mpc->model = malloc(sizeof(*(mpc->model)));
-	dyn_init_discrete(mpc->model, in);
-
-	/* Setting up a GLPK problem instance */
-	mpc->op = glp_create_prob();
-	glp_set_prob_name(mpc->op, "Model Predictive Control");
-
-	/* Setting up variables and bounds of control inputs */
-	mpc_input_addvar(mpc, in);
-	mpc_input_set_bnds(mpc, in);
-
-	/* Setting up constraints: bounding input variation */
-	/*	mpc_input_set_delta(mpc, in); */
-
-	/* Add a variable for each norm of states X(1), ..., X(H)*/
-	mpc_state_norm_addvar(mpc, in);
-	
-	/* Setting bounds to the states X(1), ..., X(H)*/
-	mpc_state_set_bnds(mpc, in);
-	
-	/* Set a minimization cost for the MPC */
-	mpc_goal_set(mpc, in);
- 
-#ifdef HAVE_OBSTACLE
-	/* Add the obstacle */
-	mpc_state_obstacle_add(mpc, center, radius);
-#ifdef PRINT_PROBLEM
-	/* DEBUG ONLY: Writing the GLPK formulation in CPLEX form */
-	glp_write_lp(mpc->op, NULL, "problem_obstacle.txt");
-#endif
-
-#endif
-
-#ifdef INIT_X0_JSON
-	/* 
-	 * Get the initial state from JSON, store it in the MPC
-	 * struct, and update the problem accordingly
-	 */
-	if (!json_object_object_get_ex(in, "state_init", &tmp_elem)) {
-		PRINT_ERROR("missing state_init in JSON");
-		return -1;
-	}
-	if ((size_t)json_object_array_length(tmp_elem) != mpc->model->n) {
-		PRINT_ERROR("wrong size of state_init in JSON");
-		return -1;
-	}
-	mpc->x0 = gsl_vector_calloc(mpc->model->n);
-	for (i=0; i < mpc->model->n; i++) {
-		elem = json_object_array_get_idx(tmp_elem, (int)i);
-		errno = 0;
-		mpc->x0->data[i] = json_object_get_double(elem);
-		if (errno) {
-			fprintf(stderr, "%i\n", (int)i);
-			PRINT_ERROR("issues in converting element in state_init");
-			return -1;
-		}
-	}
-	mpc_update_x0(mpc);
-#else
-	mpc_warmup(mpc);
-#endif
-
-	
-	/* 
-	 * Setting the max delta constraint, assuming an initial zero
-	 * input 
-	 */
-	/*
-	u_old = gsl_vector_calloc(mpc->model->m);
-	gsl_vector_set_zero(u_old);
-	mpc_input_set_delta0(mpc, u_old);
-	gsl_vector_free(u_old);
-	*/
-
-	return 0;
-}